@@ -29,7 +29,10 @@ enum TrapCalls
   TrapJail = 0x6c69614a,
   TrapUnjail = 0x6c6a6e55,
   TrapExit = 0x74697845,
-  TrapFork = 0x6b726f46
+  TrapFork = 0x6b726f46,
+  TrapSave = 0x65766153,
+  TrapRelease = 0x656c6552,
+  TrapJailv = 0x766c614a
 };
 
 /* channel types */
@@ -58,6 +61,27 @@ struct ZVMChannel
   char *name;
 };
 
+/* cpu instruction sets detected by zerovm (each level includes the previous) */
+enum CPULevels {
+  CPUNone,
+  CPUSSE,
+  CPUSSE2,
+  CPUSSE3,
+  CPUSSSE3,
+  CPUSSE41,
+  CPUSSE42,
+  CPUAVX,
+  CPUAVX2,
+  CPUAVX512
+};
+
+/* code region for zvm_jailv */
+struct ZVMRegion
+{
+  void *buffer;
+  int32_t size;
+};
+
 /* system data available for the user */
 struct UserManifest
 {
@@ -66,6 +90,8 @@ struct UserManifest
   uint32_t stack_size;
   int32_t channels_count;
   struct ZVMChannel *channels;
+  int32_t *aliases; /* channels numbers ordered by name */
+  int32_t cpu_level; /* enum CPULevels */
 };
 
 /* pointer to the user manifest (read only memory area) */
@@ -91,9 +117,25 @@ struct UserManifest
  *   terminate program with "code"
  * zvm_fork
  *   ask for fork (for further details see "daemon mode")
+ * zvm_save
+ *   store session to the image specified by manifest "Save". returns 0 to
+ *   the current session and 1 to the session restored from the image
+ * zvm_release
+ *   return "size" bytes of the heap from "buffer" to the host. the memory
+ *   becomes read/write and zero filled. "buffer" and "size" should be 64kb
+ *   aligned
+ * zvm_jailv
+ *   jail "count" regions (struct ZVMRegion) in one call. if any region
+ *   fails validation nothing is jailed
+ *
+ * the validated 64kb pages (up to 1024 recently used) are cached for the
+ * session. jailing of the code not changed since the last (un)jail only
+ * compares the page digests with the cached ones, so a JIT can unjail the
+ * code, patch it and jail it back with only the patched pages validated again
  *
  * all trap functions return -errno code if error encountered, otherwise
- * result equal to processed bytes or 0 (for (un)jail). exit does not return
+ * result equal to processed bytes or 0 (for (un)jail(v) and release). exit
+ * does not return
  */
 #define zvm_pread(desc, buffer, size, offset) \
   TRAP((uint64_t[]){TrapRead, 0, desc, (uintptr_t)buffer, size, offset})
@@ -105,5 +147,41 @@ struct UserManifest
   TRAP((uint64_t[]){TrapUnjail, 0, (uintptr_t)buffer, size})
 #define zvm_exit(code) TRAP((uint64_t[]){TrapExit, 0, code})
 #define zvm_fork() TRAP((uint64_t[]){TrapFork})
+#define zvm_save() TRAP((uint64_t[]){TrapSave})
+#define zvm_release(buffer, size) \
+  TRAP((uint64_t[]){TrapRelease, 0, (uintptr_t)buffer, size})
+#define zvm_jailv(regions, count) \
+  TRAP((uint64_t[]){TrapJailv, 0, (uintptr_t)regions, count})
+
+/*
+ * get the channel number by "name" (binary search in the user manifest
+ * alias index). return -1 if there is no such channel
+ */
+static inline int zvm_channel(const char *name)
+{
+  const struct UserManifest *m =
+      (const struct UserManifest*)*((uintptr_t*)0xFEFFFFFC);
+  int32_t low = 0;
+  int32_t high = m->channels_count - 1;
+
+  while(low <= high)
+  {
+    int32_t middle = (low + high) / 2;
+    int32_t n = m->aliases[middle];
+    const unsigned char *a = (const unsigned char*)m->channels[n].name;
+    const unsigned char *b = (const unsigned char*)name;
+
+    while(*a != '\0' && *a == *b)
+    {
+      ++a;
+      ++b;
+    }
+    if(*a == *b) return n;
+    if(*a < *b) low = middle + 1;
+    else high = middle - 1;
+  }
+
+  return -1;
+}
 
 #endif /* ZVM_API_H__ */
@@ -22,57 +22,66 @@
 #include "src/channels/preload.h"
 #include "src/channels/prefetch.h"
 #include "src/channels/nservice.h"
+#include "src/channels/ring.h"
+#include "src/channels/replica.h"
 #include "src/channels/channel.h"
 
+#define RELAY_SUFFIX " (relay)"
+
 /*
  * array of read buffers. WARNING: buffers[0] should not be allocated
  * since it always will point to the user buffer for optimization reason
  */
 static GPtrArray *buffers = NULL;
 static uint32_t buffers_size = 0; /* size of buffers */
-static GTree *aliases;
-static int tree_reset = 0;
+static GHashTable *aliases; /* alias -> (struct ChannelDesc*) */
+static uint32_t channels_limit = MAX_CHANNELS_NUMBER;
 static uint32_t binds = 0; /* "bind" sources number */
 static uint32_t connects = 0; /* "connect" sources number */
+static int net = 0; /* network class constructed */
+static GPtrArray *pending = NULL; /* channels waiting for the name service */
 
-/* if the function called there is duplicate */
-static void DuplicateKey(gpointer key)
-{
-  ZLOGFAIL(tree_reset == 0, EFAULT, "%s is already allocated", key);
-}
-
-/* reset aliases tree */
+/* reset aliases set */
 static void ResetAliases()
 {
   if(aliases == NULL) return;
-  tree_reset = 1; /* we want to remove data from the tree */
-  g_tree_destroy(aliases);
-  tree_reset = 0; /* set it back to "check mode" */
+  g_hash_table_destroy(aliases);
   aliases = NULL;
 }
 
-/* get chunk of data from source. data will be put to "buffers" */
+/* get chunk of data from source "n" to "buffer" */
 static int32_t GetDataChunk(struct ChannelDesc *channel, int n,
-    size_t size, off_t offset)
+    char *buffer, size_t size, off_t offset)
 {
   int32_t result = 0;
 
   switch(CH_PROTO(channel, n))
   {
     case ProtoRegular:
+      /* resident channel: copy from the mapping shared with the daemon */
+      if(channel->data != NULL)
+      {
+        result = offset < channel->size ? MIN(size, channel->size - offset) : 0;
+        memcpy(buffer, (char*)channel->data + offset, result);
+        break;
+      }
       result = pread(GPOINTER_TO_INT(CH_HANDLE(channel, n)),
-          buffers->pdata[n], size, offset);
+          buffer, size, offset);
       if(result == -1) result = -errno;
       break;
     case ProtoCharacter:
     case ProtoFIFO:
-      result = fread(buffers->pdata[n], 1, size, CH_HANDLE(channel, n));
+      result = fread(buffer, 1, size, CH_HANDLE(channel, n));
       if(result == -1) result = -errno;
       break;
     case ProtoTCP:
       /* get another message if it already exhausted */
       if(channel->bufend - channel->bufpos == 0)
       {
+        /* the whole message fits: no need to copy it */
+        result = ReceiveData(channel, n, buffer, size);
+        if(result >= 0) break;
+
         channel->bufpos = size; /* workaround for udt to get full message */
         FetchMessage(channel, n);
       }
@@ -81,10 +90,13 @@ static int32_t GetDataChunk(struct ChannelDesc *channel, int n,
       if(channel->eof == 0)
       {
         result = MIN(size, channel->bufend - channel->bufpos);
-        memcpy(buffers->pdata[n], MessageData(channel) + channel->bufpos, result);
+        memcpy(buffer, MessageData(channel) + channel->bufpos, result);
         channel->bufpos += result;
       }
       break;
+    case ProtoIPC:
+      result = RingRead(channel, n, buffer, size);
+      break;
     default: /* design error */
       ZLOGFAIL(1, EFAULT, "invalid channel source %s;n", channel->alias, n);
       break;
@@ -105,7 +117,8 @@ static void TestEOFDigest(struct ChannelDesc *channel, int n)
   if(channel->tag != NULL && channel->bufend > 0)
   {
     char digest[TAG_DIGEST_SIZE + 1];
-    char *control = MessageData(channel);
+    char *control = CH_PROTO(channel, n) == ProtoIPC
+        ? RingDigest(channel, n) : MessageData(channel);
 
     assert(channel->bufend == TAG_DIGEST_SIZE);
 
@@ -122,17 +135,13 @@ static void TestEOFDigest(struct ChannelDesc *channel, int n)
   }
 }
 
-/*
- * return the 1st valid source in the raw or -1
- * TODO(d'b): implement a new logic to choose the 1st available source
- */
-static int GetFirstSource(struct ChannelDesc *channel)
+/* return monotonic time in nanoseconds */
+static int64_t Now()
 {
-  int n;
+  struct timespec t;
 
-  for(n = 0; n < channel->source->len; ++n)
-    if(IS_VALID(CH_FILE(channel, n))) return n;
-  return -1;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (int64_t)t.tv_sec * NANO_PER_SEC + t.tv_nsec;
 }
 
 int32_t ChannelRead(struct ChannelDesc *channel,
@@ -142,6 +151,7 @@ int32_t ChannelRead(struct ChannelDesc *channel,
   int good = -1; /* index of buffer with proper data */
   int readrest = size;
   int toread;
+  int k;
   int n;
 
   assert(buffers != NULL);
@@ -151,34 +161,45 @@ int32_t ChannelRead(struct ChannelDesc *channel,
   /* read "size" bytes or until channel EOF */
   while(readrest > 0 && !channel->eof)
   {
-    int first = GetFirstSource(channel);
+    int first = SelectPrimary(channel);
+    int64_t start = 0;
     toread = MIN(readrest, BUFFER_SIZE);
     good = -1;
 
     ZLOGFAIL(first < 0, EIO, "all %s sources failed", channel->alias);
-    for(n = first; n < channel->source->len && good < 0 && !channel->eof; ++n)
+
+    /* choose "zero copy" source (the primary) */
+    buffers->pdata[0] = buffer;
+
+    /* read the sources in the speed order until 2 of them agree */
+    for(k = 0; k < channel->source->len && good < 0 && !channel->eof; ++k)
     {
       int j;
 
-      /* choose "zero copy" source */
-      buffers->pdata[first] = buffer;
+      n = channel->order[k];
 
       /* get next data portion */
       if(!IS_VALID(CH_FILE(channel, n))) continue;
-      SyncSource(channel, n);
-      result = GetDataChunk(channel, n, toread, offset);
+      if(CH_PROTO(channel, n) == ProtoIPC)
+        RingSync(channel, n);
+      else
+        SyncSource(channel, n);
+      if(channel->source->len > 1) start = Now();
+      result = GetDataChunk(channel, n, buffers->pdata[k], toread, offset);
       if(result < 0)
       {
         CH_FLAGS(channel, n) |= FLAG_VALID_MASK;
         continue;
       }
+      if(channel->source->len > 1 && result > 0)
+        UpdateStats(CH_FILE(channel, n), result, Now() - start);
 
       /* compare buffers */
-      for(j = first; j < n; ++j)
+      for(j = 0; j < k; ++j)
       {
         /* skip invalid source buffer */
-        if(!IS_VALID(CH_FILE(channel, n))) continue;
-        if(memcmp(buffers->pdata[j], buffers->pdata[n], result) == 0)
+        if(!IS_VALID(CH_FILE(channel, channel->order[j]))) continue;
+        if(memcmp(buffers->pdata[j], buffers->pdata[k], result) == 0)
         {
           good = j;
           break;
@@ -189,6 +210,10 @@ int32_t ChannelRead(struct ChannelDesc *channel,
       CountGet(CH_CONN(channel, n), result);
     }
 
+    /* the sources left unread this time */
+    for(; k < channel->source->len; ++k)
+      AgeStats(CH_FILE(channel, channel->order[k]));
+
     /* fail session if chunk broken and cannot be restored */
     ZLOGFAIL(!channel->eof && good < 0 && channel->source->len > 1,
         EIO, "%s failed to read", channel->alias);
@@ -196,7 +221,7 @@ int32_t ChannelRead(struct ChannelDesc *channel,
         EIO, "%s failed to read", channel->alias);
 
     /* copy verified data to buffer and shift the position */
-    if(good > first)
+    if(good > 0)
       memcpy(buffer, buffers->pdata[good], result);
     buffer += result;
     offset += result;
@@ -212,6 +237,10 @@ int32_t ChannelRead(struct ChannelDesc *channel,
   buffer -= result;
   TagUpdate(channel->tag, buffer, result);
 
+  /* broadcast: pass the data to the next nodes of the tree */
+  if(channel->relay != NULL && result > 0)
+    ChannelWrite(channel->relay, buffer, result, channel->relay->putpos);
+
   /* extra corruption check for network source on EOF */
   good = GetFirstSource(channel);
   if(channel->eof && IS_NETWORK(CH_FILE(channel, good)))
@@ -232,6 +261,8 @@ int32_t ChannelWrite(struct ChannelDesc *channel,
 
   for(n = 0; n < channel->source->len; ++n)
   {
+    ZLOGFAIL(IS_NETWORK(CH_FILE(channel, n)) && CH_HANDLE(channel, n) == NULL,
+        EIO, "%s;%d is not mounted", channel->alias, n);
     switch(CH_PROTO(channel, n))
     {
       case ProtoRegular:
@@ -244,6 +275,9 @@ int32_t ChannelWrite(struct ChannelDesc *channel,
       case ProtoTCP:
         result = SendData(channel, n, buffer, size);
         break;
+      case ProtoIPC:
+        result = RingWrite(channel, n, buffer, size);
+        break;
       default: /* design error */
         ZLOGFAIL(1, EFAULT, "invalid channel source %s;%d", channel->alias, n);
         break;
@@ -269,46 +303,33 @@ int32_t ChannelWrite(struct ChannelDesc *channel,
   return result;
 }
 
-/* get network sources statistics (RO - binds, WO - connects) */
-static void CountNetSources(const struct ChannelDesc *channel,
-    uint32_t *binds_number, uint32_t *connects_number)
+/* count the channel network sources (RO - binds, WO - connects) */
+static void CountNetSources(struct ChannelDesc *channel)
 {
   int i;
 
+  channel->binds = channel->connects = 0;
   for(i = 0; i < channel->source->len; ++i)
-  {
-    struct Connection *c = CH_CONN(channel, i);
-
-    /* update binds/connects statistics */
-    if(IS_NETWORK(c))
+    if(IS_NETWORK(CH_CONN(channel, i)))
     {
-      if(IS_WO(channel)) ++*connects_number;
-      else ++*binds_number;
+      if(IS_WO(channel)) ++channel->connects;
+      else ++channel->binds;
     }
-  }
 }
 
 /*
  * order channels to mounting sequence
  * compares 2 channels in a distinct way: place "connect" ones after
- * "binds" and channels without network sources at the end
+ * "binds" and channels without network sources at the end. the sources
+ * must be counted by CountNetSources() before the sort
  */
 static int OrderMount(const struct ChannelDesc **a, const struct ChannelDesc **b)
 {
-  uint32_t a_binds = 0;
-  uint32_t b_binds = 0;
-  uint32_t a_connects = 0;
-  uint32_t b_connects = 0;
-
-  CountNetSources(*a, &a_binds, &a_connects);
-  CountNetSources(*b, &b_binds, &b_connects);
-
-  /* compare */
-  if(a_binds != 0 || b_binds != 0)
-    return b_binds - a_binds;
+  if((*a)->binds != 0 || (*b)->binds != 0)
+    return (int)((*b)->binds - (*a)->binds);
   else
-    if(a_connects != 0 || b_connects != 0)
-      return b_connects - a_connects;
+    if((*a)->connects != 0 || (*b)->connects != 0)
+      return (int)((*b)->connects - (*a)->connects);
 
   return 0; /* local sources does not matter */
 }
@@ -319,20 +340,26 @@ static int OrderDismount(const struct ChannelDesc **a, const struct ChannelDesc
   return OrderMount(b, a);
 }
 
+/* rank of the channel in the user manifest: standard channels go first */
+static int UserRank(const char *alias)
+{
+  if(g_strcmp0(alias, STDIN) == 0) return 0;
+  if(g_strcmp0(alias, STDOUT) == 0) return 1;
+  if(g_strcmp0(alias, STDERR) == 0) return 2;
+  return 3;
+}
+
 /*
  * order channels for user manifest
- * 1st 3 channels should be stdin, stdout, stderr
+ * 1st 3 channels should be stdin, stdout, stderr, others alphabetically
  */
 static int OrderUser(const struct ChannelDesc **a, const struct ChannelDesc **b)
 {
-  if(g_strcmp0((*a)->alias, STDIN) == 0) return -1;
-  if(g_strcmp0((*b)->alias, STDIN) == 0) return 1;
-  if(g_strcmp0((*a)->alias, STDOUT) == 0) return -1;
-  if(g_strcmp0((*b)->alias, STDOUT) == 0) return 1;
-  if(g_strcmp0((*a)->alias, STDERR) == 0) return -1;
-  if(g_strcmp0((*b)->alias, STDERR) == 0) return 1;
-
-  return 0; /* the order for other channels does not matter */
+  int a_rank = UserRank((*a)->alias);
+  int b_rank = UserRank((*b)->alias);
+
+  if(a_rank != b_rank) return a_rank - b_rank;
+  return g_strcmp0((*a)->alias, (*b)->alias);
 }
 
 /* to sort sources, network sources before local */
@@ -341,25 +368,27 @@ static int OrderSources(const struct Connection **a, const struct Connection **b
   return IS_FILE(*a) - IS_FILE(*b);
 }
 
-/* to sort channels alphabetically by alias */
-static int OrderAlias(const struct ChannelDesc **a, const struct ChannelDesc **b)
+void SortChannels(GPtrArray *channels)
 {
-  return g_strcmp0((*a)->alias, (*b)->alias);
+  g_ptr_array_sort(channels, (GCompareFunc)OrderUser);
 }
 
-void SortChannels(GPtrArray *channels)
+void ChannelsLimit(uint32_t limit)
 {
-  g_ptr_array_sort(channels, (GCompareFunc)OrderAlias);
-  g_ptr_array_sort(channels, (GCompareFunc)OrderUser);
+  channels_limit = limit;
 }
 
-/* get numbers of "binds" and "connects" sources */
+/* count channels sources, get numbers of "binds" and "connects" sources */
 static void GetNetworkStatistics(const struct Manifest *manifest)
 {
   int i;
 
   for(i = 0; i < manifest->channels->len; ++i)
-    CountNetSources(CH_CH(manifest, i), &binds, &connects);
+  {
+    CountNetSources(CH_CH(manifest, i));
+    binds += CH_CH(manifest, i)->binds;
+    connects += CH_CH(manifest, i)->connects;
+  }
 }
 
 /* mount the channel sources */
@@ -369,8 +398,10 @@ static void ChannelCtor(struct ChannelDesc *channel)
 
   assert(channel != NULL);
 
-  /* check alias for duplicates and update the list */
-  g_tree_insert(aliases, channel->alias, NULL);
+  /* check alias for duplicates and update the set */
+  ZLOGFAIL(g_hash_table_lookup(aliases, channel->alias) != NULL,
+      EFAULT, "%s is already allocated", channel->alias);
+  g_hash_table_insert(aliases, channel->alias, channel);
 
   ZLOGFAIL(channel->type > RGetRPut, EFAULT,
       "%s has invalid type %d", channel->alias, channel->type);
@@ -379,6 +410,8 @@ static void ChannelCtor(struct ChannelDesc *channel)
   for(i = 0; i < channel->source->len; ++i)
     if(IS_FILE(CH_FILE(channel, i)))
       PreloadChannelCtor(channel, i);
+    else if(CH_PROTO(channel, i) == ProtoIPC)
+      RingCtor(channel, i);
     else
       PrefetchChannelCtor(channel, i);
 
@@ -392,6 +425,29 @@ static void ChannelCtor(struct ChannelDesc *channel)
       buffers_size = channel->source->len;
 }
 
+/* close the channel source (network sources already closed are skipped) */
+static void SourceDtor(struct ChannelDesc *channel, int n)
+{
+  if(IS_FILE(CH_FILE(channel, n)))
+    PreloadChannelDtor(channel, n);
+  else if(CH_HANDLE(channel, n) == NULL)
+    return;
+  else if(CH_PROTO(channel, n) == ProtoIPC)
+    RingDtor(channel, n);
+  else
+    PrefetchChannelDtor(channel, n);
+}
+
+/* close the network sources of the channel */
+static void NetSourcesDtor(struct ChannelDesc *channel)
+{
+  int i;
+
+  for(i = 0; i < channel->source->len; ++i)
+    if(!IS_FILE(CH_FILE(channel, i)))
+      SourceDtor(channel, i);
+}
+
 /* close channel and deallocate its resources */
 static void ChannelDtor(struct ChannelDesc *channel)
 {
@@ -404,67 +460,155 @@ static void ChannelDtor(struct ChannelDesc *channel)
 
   /* free channel */
   for(i = 0; i < channel->source->len; ++i)
-    if(IS_FILE(CH_FILE(channel, i)))
-      PreloadChannelDtor(channel, i);
-    else
-      PrefetchChannelDtor(channel, i);
+    SourceDtor(channel, i);
+
+  /* the reader cancelled the stream: the session is not failed */
+  for(i = 0; i < channel->source->len; ++i)
+    if(IS_CANCELLED(CH_FILE(channel, i)) && GetExitCode() == 0)
+      SetExitState(CANCELLED_STATE);
 
   /*
    * message cannot be safely deallocated until 0mq context closed
    * since message can still be in use
    */
   FreeMessage(channel);
+  g_free(channel->order);
+  channel->order = NULL;
 }
 
-void ChannelsCtor(struct Manifest *manifest)
+/*
+ * link broadcast relays to their read only channels. relays are mounted
+ * as usual channels and hidden from the user by ChannelsFinish()
+ */
+static void LinkRelays(struct Manifest *manifest)
 {
-  int i = 0;
+  int i;
+  int j;
 
-#ifdef udt /* TODO(d'b): remove it after "channels" re-design */
-  extern void PrefetchAccept(struct ChannelDesc *channel);
-#endif
+  if(manifest->relays == NULL) return;
+
+  for(i = 0; i < manifest->channels->len; ++i)
+    CH_CH(manifest, i)->relay = NULL;
+
+  for(i = 0; i < manifest->relays->len; ++i)
+  {
+    struct ChannelDesc *relay = g_ptr_array_index(manifest->relays, i);
+    struct ChannelDesc *channel = NULL;
+    char *alias = relay->alias;
+
+    /* the relay has the alias of its channel until linked */
+    if(g_str_has_suffix(alias, RELAY_SUFFIX))
+      alias[strlen(alias) - strlen(RELAY_SUFFIX)] = '\0';
+    for(j = 0; j < manifest->channels->len && channel == NULL; ++j)
+      if(strcmp(CH_CH(manifest, j)->alias, alias) == 0)
+        channel = CH_CH(manifest, j);
+    ZLOGFAIL(channel == NULL, EFAULT, "no channel to broadcast %s", alias);
+    ZLOGFAIL(!IS_RO(channel) || !CH_SEQ_READABLE(channel)
+        || channel->relay != NULL, EFAULT, "%s cannot be broadcast", alias);
+
+    /* the relay writes what the channel reads */
+    relay->type = channel->type;
+    relay->limits[PutsLimit] = channel->limits[GetsLimit];
+    relay->limits[PutSizeLimit] = channel->limits[GetSizeLimit];
+    TagDtor(relay->tag);
+    relay->tag = channel->tag == NULL ? NULL : TagCtor();
+    relay->alias = g_strconcat(alias, RELAY_SUFFIX, NULL);
+    g_free(alias);
+
+    channel->relay = relay;
+    g_ptr_array_add(manifest->channels, relay);
+  }
+}
+
+/* read the rest of broadcast channel to relay it. user counters are kept */
+static void DrainChannel(struct ChannelDesc *channel)
+{
+  char buf[BUFFER_SIZE];
+  int64_t counters[LimitsNumber];
+
+  if(GetExitCode() != 0 || buffers == NULL) return;
+
+  memcpy(counters, channel->counters, sizeof counters);
+  while(!channel->eof)
+    ChannelRead(channel, buf, sizeof buf, channel->getpos);
+  memcpy(channel->counters, counters, sizeof counters);
+}
+
+void ChannelsStart(struct Manifest *manifest)
+{
+  int i = 0;
 
   /* allocate list to detect duplicate channels aliases */
   assert(manifest != NULL);
   assert(aliases == NULL);
-  aliases = g_tree_new_full((GCompareDataFunc)strcmp,
-      NULL, (GDestroyNotify)DuplicateKey, NULL);
+  aliases = g_hash_table_new(g_str_hash, g_str_equal);
 
   /*
-   * calculate channels count. maximum allowed (MAX_CHANNELS_NUMBER - 1)
-   * channels, minimum - RESERVED_CHANNELS
+   * calculate channels count. maximum allowed (channels limit - 1)
+   * channels, minimum - MIN_CHANNELS_NUMBER
    */
-  ZLOGFAIL(manifest->channels->len >= MAX_CHANNELS_NUMBER,
+  ZLOGFAIL(manifest->channels->len >= channels_limit,
       ENFILE, "channels number reached maximum");
   ZLOGFAIL(manifest->channels->len < MIN_CHANNELS_NUMBER,
       EFAULT, "not enough channels: %d", manifest->channels->len);
 
-  /* sort channels. then count "binds" / "connects" number */
-  g_ptr_array_sort(manifest->channels, (GCompareFunc)OrderMount);
+  /* count "binds" / "connects" number. then sort channels (with relays) */
+  LinkRelays(manifest);
+  binds = connects = 0;
   GetNetworkStatistics(manifest);
+  g_ptr_array_sort(manifest->channels, (GCompareFunc)OrderMount);
 
   /* construct prefetch class before usage */
-  if(binds + connects > 0)
+  net = binds + connects > 0;
+  if(net)
     NetCtor(manifest);
 
   /* mount RO channels */
   while(IS_RO(CH_CH(manifest, i)))
     ChannelCtor(CH_CH(manifest, i++));
 
-  /* ask for name service */
-  NameServiceCtor(manifest, binds, connects);
-  NameServiceDtor();
+  /* ask for name service, the reply is taken by ChannelsFinish() */
+  if(net)
+    NameServiceCtor(manifest, binds, connects);
 
-  /* mount the rest of channels */
+  /*
+   * the rest of channels is mounted by ChannelsFinish(): "connect" sources
+   * need the name service reply and write only files are truncated (and
+   * preallocated) which must not happen before the program is validated
+   */
+  pending = g_ptr_array_new();
   for(; i < manifest->channels->len; ++i)
-    ChannelCtor(CH_CH(manifest, i));
+    g_ptr_array_add(pending, CH_CH(manifest, i));
+}
+
+void ChannelsFinish(struct Manifest *manifest)
+{
+  int i;
+
+#ifdef udt /* TODO(d'b): remove it after "channels" re-design */
+  extern void PrefetchAccept(struct ChannelDesc *channel);
+#endif
+
+  assert(manifest != NULL);
+  assert(pending != NULL);
+
+  /* wait for name service, then mount the rest of channels */
+  NameServiceDtor();
+  for(i = 0; i < pending->len; ++i)
+    ChannelCtor(g_ptr_array_index(pending, i));
+  g_ptr_array_free(pending, TRUE);
+  pending = NULL;
 
 #ifdef udt /* TODO(d'b): remove it after "channels" re-design */
   /* accept after binds (to avoid hanging on accept) */
-  for(i = 0; i < manifest->channels->len; ++i)
+  for(i = 0; i < manifest->channels->len && net; ++i)
     PrefetchAccept(CH_CH(manifest, i));
 #endif
 
+  /* hide broadcast relays from the user */
+  for(i = 0; manifest->relays != NULL && i < manifest->relays->len; ++i)
+    g_ptr_array_remove(manifest->channels, g_ptr_array_index(manifest->relays, i));
+
   /* reorder channels for user manifest */
   SortChannels(manifest->channels);
 
@@ -481,6 +625,33 @@ void ChannelsCtor(struct Manifest *manifest)
     g_ptr_array_add(buffers, g_malloc(BUFFER_SIZE));
 }
 
+void ChannelsCtor(struct Manifest *manifest)
+{
+  ChannelsStart(manifest);
+  ChannelsFinish(manifest);
+}
+
+void ChannelsNetDtor(struct Manifest *manifest)
+{
+  int i;
+
+  if(manifest == NULL || manifest->channels == NULL || !net) return;
+
+  /* broadcast: relay the rest of data before the relays closed */
+  for(i = 0; i < manifest->channels->len; ++i)
+    if(CH_CH(manifest, i)->relay != NULL)
+      DrainChannel(CH_CH(manifest, i));
+
+  /* close network sources of the channels and the relays (send EOF) */
+  for(i = 0; i < manifest->channels->len; ++i)
+    NetSourcesDtor(CH_CH(manifest, i));
+  for(i = 0; manifest->relays != NULL && i < manifest->relays->len; ++i)
+    NetSourcesDtor(g_ptr_array_index(manifest->relays, i));
+
+  NetDtor(manifest);
+  net = 0;
+}
+
 void ChannelsDtor(struct Manifest *manifest)
 {
   int i;
@@ -488,6 +659,17 @@ void ChannelsDtor(struct Manifest *manifest)
   /* exit if channels are not constructed */
   if(manifest == NULL || manifest->channels == NULL) return;
 
+  /* broadcast: relay the rest of data, then close relays (send EOF) */
+  for(i = 0; manifest->relays != NULL && i < manifest->relays->len; ++i)
+    g_ptr_array_remove(manifest->channels, g_ptr_array_index(manifest->relays, i));
+  for(i = 0; i < manifest->channels->len; ++i)
+  {
+    struct ChannelDesc *channel = CH_CH(manifest, i);
+    if(channel->relay == NULL) continue;
+    DrainChannel(channel);
+    ChannelDtor(channel->relay);
+  }
+
   /* reverse the sort order and close channels */
   g_ptr_array_sort(manifest->channels, (GCompareFunc)OrderDismount);
   for(i = 0; i < manifest->channels->len; ++i)
@@ -503,6 +685,7 @@ void ChannelsDtor(struct Manifest *manifest)
     g_ptr_array_free(buffers, TRUE);
 
   /* release prefetch class */
-  if(binds + connects > 0)
+  if(net)
     NetDtor(manifest);
+  net = 0;
 }
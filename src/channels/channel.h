@@ -39,10 +39,12 @@ EXTERN_C_BEGIN
 #define STDRAM "/dev/memory"
 
 #define FLAG_VALID_MASK 8
+#define FLAG_CANCEL_MASK 16
 #define IS_NETWORK(c) ((c)->protocol < ProtoRegular)
 #define IS_FILE(c) (!IS_NETWORK(c))
 #define IS_IPHOST(c) ((c)->flags & 1)
 #define IS_VALID(c) (!((c)->flags & FLAG_VALID_MASK))
+#define IS_CANCELLED(c) ((c)->flags & FLAG_CANCEL_MASK)
 
 /* CH_RW_TYPE returns 0..3 */
 #define IS_NIL(channel) (CH_RW_TYPE(channel) == 0)
@@ -72,9 +74,32 @@ EXTERN_C_BEGIN
 /* sort channels */
 void SortChannels(GPtrArray *channels);
 
+/* set the channels number limit (MAX_CHANNELS_NUMBER by default) */
+void ChannelsLimit(uint32_t limit);
+
 /* construct all channels, initialize it and update system_manifest */
 void ChannelsCtor(struct Manifest *manifest);
 
+/*
+ * 1st part of ChannelsCtor(): mount read only channels and start the name
+ * service exchange. the session can continue its initialization while the
+ * name server reply is on the way
+ */
+void ChannelsStart(struct Manifest *manifest);
+
+/*
+ * 2nd part of ChannelsCtor(): wait for the name service and mount the rest
+ * of channels. finalize channels construction
+ */
+void ChannelsFinish(struct Manifest *manifest);
+
+/*
+ * close the network sources (send EOF) and the network context, the rest
+ * of channels stays mounted. should be called before fork(): network
+ * context and sockets do not survive it
+ */
+void ChannelsNetDtor(struct Manifest *manifest);
+
 /* free channels resources */
 void ChannelsDtor(struct Manifest *manifest);
 
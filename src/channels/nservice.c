@@ -16,6 +16,8 @@
 #include <arpa/inet.h> /* ip <-> int */
 #include <assert.h>
 #include <errno.h>
+#include <poll.h>
+#include <time.h>
 #include "src/channels/channel.h"
 #include "src/channels/nservice.h"
 
@@ -31,9 +33,11 @@
 #include <byteswap.h>
 #endif
 
-#define RETRY 3 /* poll retries */
-#define TIMEOUT 1200000 /* poll timeout in microseconds */
+#define TIMEOUT 3600 /* name service exchange timeout in milliseconds */
+#define BACKOFF_MIN 50 /* 1st retransmission timeout in milliseconds */
+#define BACKOFF_MAX 1200 /* maximum retransmission timeout in milliseconds */
 #define PARCEL_SIZE 65507 /* maximum size of an UDP packet */
+#define STREAM_MAGIC 0x5a4e5332 /* "ZNS2", tcp name service */
 
 /*
  * parcel will have at least 1 record or will not send
@@ -56,27 +60,58 @@ struct NSParcel
   uint32_t connect_number;
   struct NSRecord records[1];
 };
+
+/* tcp name service: the header precedes the parcel (both ways) */
+struct NSStream
+{
+  uint32_t magic;
+  uint64_t cluster;
+  uint32_t nodes;
+};
 #pragma pack(pop)
 
-/* get next bind/connect source */
-#define NEXT_SRC() \
-    do { \
-      c = CH_CONN(CH_CH(manifest, m), n++); \
-      if(n == CH_CH(manifest, m)->source->len) \
-      { \
-        ++m; \
-        n = 0; \
-        continue; \
-      } \
-    } while(c->protocol != ProtoTCP && IS_IPHOST(c))
+/* exchange in progress */
+static int sock = -1; /* name server socket */
+static struct sockaddr_in server; /* name server address */
+static char *parcel = NULL; /* sent parcel (received one after the exchange) */
+static uint32_t parcel_size = 0;
+static int64_t sent = 0; /* time the parcel was sent */
+static GPtrArray *order = NULL; /* sources in the parcel records order */
+static struct NSStream header; /* tcp name service header */
+static int64_t deadline = 0; /* tcp name service reply deadline */
+
+/*
+ * collect "end" bind/connect sources of the (mount ordered) channels to
+ * the records order. channels without network sources are at the end
+ */
+static GPtrArray *RecordsCtor(const GPtrArray *channels, int64_t end)
+{
+  GPtrArray *sources = g_ptr_array_sized_new(end);
+  int i, j;
+
+  for(i = 0; i < channels->len && sources->len < end; ++i)
+  {
+    struct ChannelDesc *channel = g_ptr_array_index(channels, i);
+
+    if(channel->binds + channel->connects == 0) break;
+    for(j = 0; j < channel->source->len && sources->len < end; ++j)
+    {
+      struct Connection *c = CH_CONN(channel, j);
+      if(c->protocol == ProtoTCP || !IS_IPHOST(c))
+        g_ptr_array_add(sources, c);
+    }
+  }
+
+  ZLOGFAIL(sources->len != end, EFAULT, "invalid network sources number");
+  return sources;
+}
 
 /* serialize channels data to the parcel. return parcel and its "size" */
 static void *ParcelCtor(const struct Manifest *manifest,
-    uint32_t *size, uint32_t binds, uint32_t connects)
+    const GPtrArray *sources, uint32_t *size, uint32_t binds, uint32_t connects)
 {
   struct NSParcel *p;
   int64_t end = binds + connects;
-  int64_t m = 0, n = 0;
   int64_t i;
 
   /* allocate parcel */
@@ -91,8 +126,7 @@ static void *ParcelCtor(const struct Manifest *manifest,
   /* populate parcel with bind/connect records */
   for(i = 0; i < end; ++i)
   {
-    struct Connection *c;
-    NEXT_SRC();
+    struct Connection *c = g_ptr_array_index(sources, i);
     p->records[i].host = bswap_32(c->host);
     p->records[i].port = bswap_16(c->port);
   }
@@ -101,106 +135,217 @@ static void *ParcelCtor(const struct Manifest *manifest,
 }
 
 /* de-serialize channels data from the parcel. return number of sources */
-static int ParcelDtor(struct Manifest *manifest, char *parcel)
+static int ParcelDtor(const GPtrArray *sources, char *parcel)
 {
   struct NSParcel *p = (void*)parcel;
   int64_t end = bswap_32(p->bind_number) + bswap_32(p->connect_number);
-  int64_t m = 0, n = 0;
   int64_t i;
 
-  /* update channels sources from the parcel */
-  for(i = 0; i < end; ++i)
-  {
-    struct Connection *c;
-    NEXT_SRC();
+  /* the reply cannot have more records than sent */
+  if(end > sources->len) return end;
 
-    /* skip "binds" */
-    if(i < bswap_32(p->bind_number)) continue;
+  /* update "connect" sources from the parcel, skip "binds" */
+  for(i = bswap_32(p->bind_number); i < end; ++i)
+  {
+    struct Connection *c = g_ptr_array_index(sources, i);
 
     /* ip is already in network format for inet_ntoa */
     c->host = p->records[i].host;
     c->port = bswap_16(p->records[i].port);
   }
 
-  g_free(parcel);
   return end;
 }
-#undef NEXT_SRC
+
+/* return monotonic time in milliseconds */
+static int64_t Now()
+{
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (int64_t)t.tv_sec * 1000 + t.tv_nsec / 1000000;
+}
+
+/* send the parcel to the name server */
+static void SendParcel()
+{
+  int result;
+
+  sent = Now();
+  result = sendto(sock, parcel, parcel_size, 0, &server, sizeof server);
+  ZLOGIF(result < 0, "cannot send parcel to name server: %s", strerror(errno));
+}
 
 /*
- * send the parcel to the name server and get it back
- * return the received parcel size
+ * wait for the parcel from the name server, retransmitting the sent one
+ * with the growing timeout. the time passed since the parcel was sent
+ * (session continued its initialization) counts. the reply is received
+ * aside: a wrong (or longer) datagram must not spoil the parcel to
+ * retransmit. return the received size
  */
-static int32_t PollServer(const struct Connection *server, char *parcel, uint32_t size)
+static int32_t WaitParcel()
 {
-  int i;
-  int s;
-  int32_t result;
-  struct sockaddr_in addr;
-  uint32_t len = sizeof addr;
-  struct timeval timeout = {TIMEOUT / MICRO_PER_SEC, TIMEOUT % MICRO_PER_SEC};
-
-  /* connect to the name server */
-  s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-  addr.sin_addr.s_addr = server->host;
-  addr.sin_port = bswap_16(server->port);
-  addr.sin_family = AF_INET;
-
-  /* set timeout on socket i/o */
-  result = setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof timeout);
-  ZLOGFAIL(result == -1, errno, "cannot set receiving timeout");
-  result = setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, (char*)&timeout, sizeof timeout);
-  ZLOGFAIL(result == -1, errno, "cannot set sending timeout");
-
-  /* poll server */
-  for(i = 0; i < RETRY; ++i)
+  struct pollfd fds = {sock, POLLIN, 0};
+  int64_t deadline = sent + TIMEOUT;
+  int backoff = BACKOFF_MIN;
+  int retries = 0;
+  int32_t result = -1;
+  char *reply = g_malloc(parcel_size);
+  int64_t now;
+
+  for(now = Now(); now < deadline; now = Now())
   {
-    result = sendto(s, parcel, size, 0, &addr, sizeof addr);
-    if(result < 0) continue;
-    result = recvfrom(s, parcel, size, 0, &addr, &len);
-    if(result > 0) break;
+    /* wait for the reply until the next retransmission */
+    if(poll(&fds, 1, MAX(MIN(sent + backoff, deadline) - now, 0)) > 0)
+    {
+      result = recv(sock, reply, parcel_size, MSG_TRUNC);
+      if(result != parcel_size) continue;
+      memcpy(parcel, reply, parcel_size);
+      break;
+    }
+
+    /* retransmit the late reply with the doubled timeout */
+    if(Now() - sent >= backoff)
+    {
+      SendParcel();
+      backoff = MIN(backoff * 2, BACKOFF_MAX);
+      ++retries;
+    }
   }
 
-  ZLOGIF(i && result > 0, "name service polled with %d retries", i);
-  ZLOGFAIL(result == -1, errno, "name service failed");
-  close(s);
+  g_free(reply);
+  ZLOGIF(retries > 0 && result == parcel_size,
+      "name service polled with %d retries", retries);
+  ZLOGFAIL(result != parcel_size, ETIMEDOUT, "name service failed");
   return result;
 }
 
-void NameServiceCtor(struct Manifest *manifest, uint32_t b, uint32_t c)
+/* send (or receive) "size" bytes through the tcp name server socket */
+static int Transfer(char *buf, int size, int output)
+{
+  struct pollfd fds = {sock, output ? POLLOUT : POLLIN, 0};
+  int result;
+
+  while(size > 0)
+  {
+    if(poll(&fds, 1, MAX(deadline - Now(), 0)) <= 0) return -1;
+    result = output ? send(sock, buf, size, MSG_NOSIGNAL | MSG_DONTWAIT)
+        : recv(sock, buf, size, MSG_DONTWAIT);
+    if(result < 0 && (errno == EAGAIN || errno == EINTR)) continue;
+    if(result <= 0) return -1;
+    buf += result;
+    size -= result;
+  }
+  return 0;
+}
+
+/* connect to the tcp name server and send the header and the parcel */
+static int SendStream()
 {
-  char *parcel;
-  uint32_t psize;
-  uint32_t control_psize;
-  uint32_t control_nsources;
+  sent = Now();
+  sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  ZLOGFAIL(sock < 0, errno, "cannot create name service socket");
+  if(connect(sock, &server, sizeof server) == 0
+      && Transfer((char*)&header, sizeof header, 1) == 0
+      && Transfer(parcel, parcel_size, 1) == 0) return 0;
+
+  ZLOGS(LOG_DEBUG, "cannot send parcel to name server: %s", strerror(errno));
+  close(sock);
+  sock = -1;
+  return -1;
+}
 
+/*
+ * get the parcel from the tcp name server. the reply comes when the whole
+ * cluster reported, so it is only limited by the session timeout. if the
+ * server is unavailable reconnect with the growing timeout
+ */
+static void WaitStream()
+{
+  struct NSStream reply;
+  int backoff = BACKOFF_MIN;
+
+  while(sock < 0 && Now() + backoff < deadline)
+  {
+    usleep(backoff * 1000);
+    backoff = MIN(backoff * 2, BACKOFF_MAX);
+    SendStream();
+  }
+
+  ZLOGFAIL(sock < 0, ECONNREFUSED, "name service failed");
+  ZLOGFAIL(Transfer((char*)&reply, sizeof reply, 0) != 0
+      || Transfer(parcel, parcel_size, 0) != 0,
+      ETIMEDOUT, "name service failed");
+  ZLOGFAIL(memcmp(&reply, &header, sizeof reply) != 0,
+      EFAULT, "name service replied for another cluster");
+}
+
+void NameServiceCtor(struct Manifest *manifest, uint32_t b, uint32_t c)
+{
   assert(manifest != NULL);
   assert(manifest->channels != NULL);
-  assert(b + c <= MAX_CHANNELS_NUMBER);
+  assert(parcel == NULL);
 
   /* return if there is no name service or network sources */
   if(manifest->name_server == NULL) return;
   if(b + c < 1) return;
 
-  /* create parcel */
+  /* create parcel. records order is fixed until the exchange completes */
   ZLOGFAIL(manifest->node < 1, EFAULT, "invalid node: %d", manifest->node);
-  ZLOGFAIL(manifest->name_server->protocol != ProtoUDP,
-      EFAULT, "name server only support udp protocol");
-  parcel = ParcelCtor(manifest, &psize, b, c);
-
-  /* exchange parcels with name server */
-  control_psize = PollServer(manifest->name_server, parcel, psize);
-  ZLOGFAIL(control_psize != psize, EFAULT,
-      "received parcel size %u is not equal to sent one %u",
-      control_psize, psize);
-
-  /* decode received parcel to channels */
-  control_nsources = ParcelDtor(manifest, parcel);
-  ZLOGFAIL(control_nsources != b + c, EFAULT,
-      "received parcel records %u is not equal to sent ones %u",
-      control_nsources, b + c);
+  ZLOGFAIL(manifest->name_server->protocol != ProtoUDP
+      && manifest->name_server->protocol != ProtoTCP,
+      EFAULT, "name server only support udp and tcp protocols");
+  order = RecordsCtor(manifest->channels, (int64_t)b + c);
+  parcel = ParcelCtor(manifest, order, &parcel_size, b, c);
+
+  /* send the parcel, the reply will be taken by NameServiceDtor() */
+  server.sin_addr.s_addr = manifest->name_server->host;
+  server.sin_port = bswap_16(manifest->name_server->port);
+  server.sin_family = AF_INET;
+
+  /* tcp: the parcel size is not limited, many clusters per server */
+  if(manifest->name_server->protocol == ProtoTCP)
+  {
+    header.magic = bswap_32(STREAM_MAGIC);
+    header.cluster = bswap_64(manifest->cluster);
+    header.nodes = bswap_32(manifest->nodes);
+    deadline = Now() + (manifest->timeout > 0
+        ? (int64_t)manifest->timeout * 1000 : TIMEOUT);
+    SendStream();
+    return;
+  }
+
+  /* udp: the parcel should fit the datagram */
+  ZLOGFAIL(parcel_size > PARCEL_SIZE, EFAULT,
+      "%u records do not fit udp name service parcel", b + c);
+  sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, IPPROTO_UDP);
+  ZLOGFAIL(sock < 0, errno, "cannot create name service socket");
+  SendParcel();
 }
 
 void NameServiceDtor()
 {
+  uint32_t records;
+  uint32_t expected;
+
+  if(parcel == NULL) return;
+
+  /* get the parcel back and decode it to the connect sources */
+  expected = (parcel_size - sizeof(struct NSParcel)) / sizeof(struct NSRecord) + 1;
+  if(header.magic != 0)
+    WaitStream();
+  else
+    WaitParcel();
+  records = ParcelDtor(order, parcel);
+  ZLOGFAIL(records != expected, EFAULT,
+      "received parcel records %u is not equal to sent ones %u",
+      records, expected);
+
+  close(sock);
+  sock = -1;
+  g_free(parcel);
+  parcel = NULL;
+  memset(&header, 0, sizeof header);
+  g_ptr_array_free(order, TRUE);
+  order = NULL;
 }
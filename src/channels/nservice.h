@@ -19,16 +19,23 @@
 #define NSERVICE_H_
 
 /*
- * TODO(d'b): find the neat solution to calculate (10915)
- * ((PARCEL_SIZE - sizeof(struct NSParcel)) / sizeof(struct NSRecord) + 1)
+ * default channels number limit (see "-L" command line switch). udp name
+ * service parcel (PARCEL_SIZE) holds up to 10915 records, tcp name service
+ * does not limit the records number
  */
-#define MAX_CHANNELS_NUMBER 10915
+#define MAX_CHANNELS_NUMBER 0x100000
 #define MIN_CHANNELS_NUMBER 3
 
-/* initialize name service and update channels information */
+/*
+ * start the name service exchange: send "b" binds and "c" connects records
+ * to the name server. does not wait for the reply
+ */
 void NameServiceCtor(struct Manifest *manifest, uint32_t b, uint32_t c);
 
-/* close name service */
+/*
+ * complete the name service exchange: wait for the reply (retransmitting
+ * with the growing timeout) and update the connect sources
+ */
 void NameServiceDtor();
 
 #endif
@@ -20,6 +20,10 @@
 #ifdef udt
 #include "prefetch_udt.c"
 #else
-#error "only supported choices are zmq and udt"
+#ifdef tcp
+#include "prefetch_tcp.c"
+#else
+#error "only supported choices are zmq, udt and tcp"
+#endif
 #endif
 #endif
@@ -22,6 +22,12 @@
 #include "src/channels/channel.h"
 #include "src/main/manifest.h"
 
+/*
+ * set the number of messages in flight for "connect" sources (1 by
+ * default). should be called before the channels construction
+ */
+void NetPipelineDepth(int depth);
+
 /* prepare network context */
 void NetCtor(const struct Manifest *manifest);
 
@@ -43,6 +49,13 @@ char *MessageData(struct ChannelDesc *channel);
 /* receive a new message and update channel with it */
 void FetchMessage(struct ChannelDesc *channel, int n);
 
+/*
+ * receive the next message directly to "buf" if it fits "size" bytes.
+ * return the received size (0 upon EOF) or -1 if the message should be
+ * fetched to the channel message instead
+ */
+int32_t ReceiveData(struct ChannelDesc *channel, int n, char *buf, int32_t size);
+
 /*
  * skip obsolete messages/bytes until the source will be in sync with
  * the channel position. works only for channels with sequential read
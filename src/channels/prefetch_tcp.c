@@ -0,0 +1,589 @@
+/*
+ * native network channels: non-blocking tcp sockets waited with epoll.
+ * the data goes in frames: 32-bit size (network order) and payload of
+ * up to NET_BUFFER_SIZE bytes. the empty frame is EOF, it is followed by
+ * the frame with the digest (empty if the channel has no tag). the reader
+ * closing before EOF sends CANCEL byte back: the writer stops sending
+ *
+ * Copyright (c) 2013, LiteStack, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+#include <arpa/inet.h> /* convert ip <-> int */
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <linux/errqueue.h>
+#include "src/channels/prefetch.h"
+#include "src/main/accounting.h"
+#include "src/main/report.h"
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
+#define NET_BUFFER_SIZE BUFFER_SIZE
+#define HEADER_SIZE sizeof(uint32_t) /* frame header */
+#define ZEROCOPY_SIZE 0x10000 /* smaller writes are copied by the kernel */
+#define IOV_FRAMES 512 /* frames per one sendmsg() */
+#define MAX_CONN 1
+#define CANCEL 'C' /* the only message from the reader to the writer */
+#define BACKOFF_MIN 10 /* 1st reconnection timeout in milliseconds */
+#define BACKOFF_MAX 1000 /* maximum reconnection timeout in milliseconds */
+#define FD(channel, n) GPOINTER_TO_INT(CH_HANDLE(channel, n))
+
+static int epoll = -1;
+static int depth = 1; /* frames in flight per "connect" source */
+static int zerocopy = 1; /* cleared if the kernel does not support it */
+static int64_t deadline; /* the session end (ms), refused connects retried until */
+
+void NetPipelineDepth(int d)
+{
+  depth = d;
+}
+
+/* return monotonic time in milliseconds */
+static int64_t Now()
+{
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (int64_t)t.tv_sec * 1000 + t.tv_nsec / 1000000;
+}
+
+/* wait for "events" of "fd". error events are always waited */
+static void Wait(int fd, uint32_t events)
+{
+  struct epoll_event ev;
+  int result;
+
+  /* arm the socket only for this wait */
+  ev.events = events | EPOLLONESHOT;
+  ev.data.fd = fd;
+  if(epoll_ctl(epoll, EPOLL_CTL_MOD, fd, &ev) != 0)
+    ZLOGFAIL(epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &ev) != 0,
+        EFAULT, "epoll: %s", strerror(errno));
+
+  do
+    result = epoll_wait(epoll, &ev, 1, -1);
+  while(result < 0 && errno == EINTR);
+  ZLOGFAIL(result < 0, EFAULT, "epoll: %s", strerror(errno));
+}
+
+/* fail if the socket has a pending error */
+static void CheckSocket(struct ChannelDesc *channel, int n)
+{
+  int error = 0;
+  socklen_t len = sizeof error;
+
+  getsockopt(FD(channel, n), SOL_SOCKET, SO_ERROR, &error, &len);
+  ZLOGFAIL(error != 0, EIO, "%s;%d: %s", channel->alias, n, strerror(error));
+}
+
+/* check if the reader cancelled the WO source stream */
+static int Cancelled(struct ChannelDesc *channel, int n)
+{
+  char c;
+
+  if(IS_CANCELLED(CH_FILE(channel, n))) return 1;
+  if(recv(FD(channel, n), &c, 1, MSG_DONTWAIT) != 1 || c != CANCEL) return 0;
+
+  ZLOGS(LOG_DEBUG, "%s;%d cancelled by the reader", channel->alias, n);
+  CH_FLAGS(channel, n) |= FLAG_CANCEL_MASK;
+  return 1;
+}
+
+/* bind the RO source. the connection is accepted upon the 1st read */
+static void Bind(struct ChannelDesc *channel, int n)
+{
+  struct sockaddr_in addr = {0};
+  socklen_t len = sizeof addr;
+
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = IS_IPHOST(CH_CONN(channel, n))
+      ? CH_HOST(channel, n) : htonl(INADDR_ANY);
+  addr.sin_port = htons(CH_PORT(channel, n));
+  ZLOGFAIL(bind(FD(channel, n), (struct sockaddr*)&addr, sizeof addr) != 0
+      || listen(FD(channel, n), MAX_CONN) != 0, EFAULT,
+      "cannot bind %s;%d: %s", channel->alias, n, strerror(errno));
+  ZLOGFAIL(getsockname(FD(channel, n), (struct sockaddr*)&addr, &len) != 0,
+      EFAULT, "cannot get port %s;%d: %s", channel->alias, n, strerror(errno));
+
+  /* extract port to connection structure */
+  CH_PORT(channel, n) = ntohs(addr.sin_port);
+  CH_BACKUP(channel, n) = CH_HANDLE(channel, n);
+  ZLOGS(LOG_DEBUG, "bind(): host = %u, port = %u",
+      CH_HOST(channel, n), CH_PORT(channel, n));
+}
+
+/*
+ * try to accept the RO source connection without waiting. return 0 if
+ * the connection is accepted (or was accepted before), -1 if the writer
+ * did not connect yet
+ */
+static int TryAccept(struct ChannelDesc *channel, int n)
+{
+  int fd;
+
+  if(CH_BACKUP(channel, n) == NULL) return 0;
+
+  fd = accept4(FD(channel, n), NULL, NULL, SOCK_NONBLOCK);
+  if(fd < 0)
+  {
+    ZLOGFAIL(errno != EAGAIN && errno != EINTR, EFAULT,
+        "cannot accept %s;%d: %s", channel->alias, n, strerror(errno));
+    return -1;
+  }
+
+  /* the listening socket is not needed anymore */
+  ZLOGS(LOG_DEBUG, "%s;%d accepted", channel->alias, n);
+  close(FD(channel, n));
+  CH_HANDLE(channel, n) = GINT_TO_POINTER(fd);
+  CH_BACKUP(channel, n) = NULL;
+  return 0;
+}
+
+/* accept the RO source connection if not accepted yet */
+static void Accept(struct ChannelDesc *channel, int n)
+{
+  while(TryAccept(channel, n) < 0)
+    Wait(FD(channel, n), EPOLLIN);
+}
+
+/* open the source socket */
+static void Socket(struct ChannelDesc *channel, int n)
+{
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+  ZLOGFAIL(fd < 0, EFAULT, "cannot get socket for %s;%d: %s",
+      channel->alias, n, strerror(errno));
+  CH_HANDLE(channel, n) = GINT_TO_POINTER(fd);
+}
+
+/* try to connect the WO source. return 0 if connected, -1 if refused */
+static int TryConnect(struct ChannelDesc *channel, int n)
+{
+  struct sockaddr_in peer = {0};
+  int size = depth * (NET_BUFFER_SIZE + HEADER_SIZE);
+  socklen_t len = sizeof size;
+  int one = 1;
+
+  setsockopt(FD(channel, n), IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+  if(depth > 1)
+    setsockopt(FD(channel, n), SOL_SOCKET, SO_SNDBUF, &size, sizeof size);
+  if(zerocopy && setsockopt(FD(channel, n),
+      SOL_SOCKET, SO_ZEROCOPY, &one, sizeof one) != 0)
+  {
+    ZLOGS(LOG_DEBUG, "zero copy send disabled: %s", strerror(errno));
+    zerocopy = 0;
+  }
+
+  peer.sin_family = AF_INET;
+  peer.sin_addr.s_addr = CH_HOST(channel, n);
+  peer.sin_port = htons(CH_PORT(channel, n));
+  ZLOGS(LOG_DEBUG, "connect %s;%d to %s:%u", channel->alias, n,
+      inet_ntoa(peer.sin_addr), CH_PORT(channel, n));
+  if(connect(FD(channel, n), (struct sockaddr*)&peer, sizeof peer) == 0)
+    return 0;
+
+  /* wait for the connection completion */
+  if(errno == EINPROGRESS)
+  {
+    Wait(FD(channel, n), EPOLLOUT);
+    errno = 0;
+    getsockopt(FD(channel, n), SOL_SOCKET, SO_ERROR, &errno, &len);
+  }
+  if(errno == 0) return 0;
+
+  ZLOGFAIL(errno != ECONNREFUSED, EFAULT, "cannot connect %s;%d: %s",
+      channel->alias, n, strerror(errno));
+  return -1;
+}
+
+/*
+ * connect the WO source. the reader can be not bound yet: the refused
+ * connection is retried with the growing timeout until the session end
+ */
+static void Connect(struct ChannelDesc *channel, int n)
+{
+  int backoff = BACKOFF_MIN;
+  int64_t now;
+
+  while(TryConnect(channel, n) != 0)
+  {
+    now = Now();
+    ZLOGFAIL(now >= deadline, ECONNREFUSED, "cannot connect %s;%d: %s",
+        channel->alias, n, strerror(ECONNREFUSED));
+    usleep(MIN(backoff, deadline - now) * 1000);
+    backoff = MIN(backoff * 2, BACKOFF_MAX);
+
+    /* the refused socket cannot connect again */
+    close(FD(channel, n));
+    Socket(channel, n);
+  }
+}
+
+/* receive exactly "size" bytes to "buf" */
+static void Receive(struct ChannelDesc *channel, int n, char *buf, int size)
+{
+  ssize_t result;
+
+  while(size > 0)
+  {
+    result = recv(FD(channel, n), buf, size, 0);
+    ZLOGFAIL(result == 0, EPIPE, "%s;%d connection lost", channel->alias, n);
+    if(result < 0)
+    {
+      ZLOGFAIL(errno != EAGAIN && errno != EINTR, EIO,
+          "%s;%d: %s", channel->alias, n, strerror(errno));
+      Wait(FD(channel, n), EPOLLIN);
+      continue;
+    }
+    buf += result;
+    size -= result;
+  }
+}
+
+/* receive the frame header, return the frame payload size */
+static int32_t GetHeader(struct ChannelDesc *channel, int n)
+{
+  uint32_t size;
+
+  Accept(channel, n);
+  Receive(channel, n, (char*)&size, HEADER_SIZE);
+  size = ntohl(size);
+  ZLOGFAIL(size > NET_BUFFER_SIZE, EPIPE,
+      "%s;%d invalid frame size %u", channel->alias, n, size);
+  return size;
+}
+
+/* get the 2nd part of EOF (digest) to the channel message */
+static void GetEOF(struct ChannelDesc *channel, int n)
+{
+  channel->eof = 1;
+  channel->bufpos = 0;
+  channel->bufend = GetHeader(channel, n);
+
+  /* check EOF digest size */
+  ZLOGFAIL(channel->bufend != 0 && channel->bufend != TAG_DIGEST_SIZE,
+      EFAULT, "invalid EOF size = %d", channel->bufend);
+  Receive(channel, n, channel->msg, channel->bufend);
+}
+
+void NetCtor(const struct Manifest *manifest)
+{
+  deadline = Now() + (int64_t)manifest->timeout * 1000;
+  epoll = epoll_create1(EPOLL_CLOEXEC);
+  ZLOGFAIL(epoll < 0, EFAULT, "cannot create epoll: %s", strerror(errno));
+}
+
+void NetDtor(struct Manifest *manifest)
+{
+  if(epoll < 0) return;
+  close(epoll);
+  epoll = -1;
+}
+
+char *MessageData(struct ChannelDesc *channel)
+{
+  return channel->msg;
+}
+
+void FreeMessage(struct ChannelDesc *channel)
+{
+  g_free(channel->msg);
+  channel->msg = NULL;
+}
+
+void FetchMessage(struct ChannelDesc *channel, int n)
+{
+  ZLOGS(LOG_INSANE, "FetchMessage of %s;%d", channel->alias, n);
+
+  if(channel->eof) return;
+  channel->bufpos = 0;
+  channel->bufend = GetHeader(channel, n);
+
+  /* if EOF detected get the 2nd part */
+  if(channel->bufend == 0)
+    GetEOF(channel, n);
+  else
+    Receive(channel, n, channel->msg, channel->bufend);
+}
+
+int32_t ReceiveData(struct ChannelDesc *channel, int n, char *buf, int32_t size)
+{
+  int32_t result;
+
+  /* the frame size is unknown until its header is received */
+  if(channel->eof || size < NET_BUFFER_SIZE) return -1;
+
+  ZLOGS(LOG_INSANE, "ReceiveData of %s;%d", channel->alias, n);
+  result = GetHeader(channel, n);
+
+  /* the channel message is empty now */
+  channel->bufpos = 0;
+  channel->bufend = 0;
+  if(result == 0)
+    GetEOF(channel, n);
+  else
+    Receive(channel, n, buf, result);
+  return result;
+}
+
+/* send all "iov" entries. return the number of zero copy sendmsg() calls */
+static int Send(struct ChannelDesc *channel, int n,
+    struct iovec *iov, int count, int flags)
+{
+  struct msghdr msg = {0};
+  ssize_t result;
+  int calls = 0;
+
+  msg.msg_iov = iov;
+  msg.msg_iovlen = count;
+  while(msg.msg_iovlen > 0 && !IS_CANCELLED(CH_FILE(channel, n)))
+  {
+    result = sendmsg(FD(channel, n), &msg, flags | MSG_NOSIGNAL);
+    if(result < 0)
+    {
+      /* out of the pinned memory limit: let the kernel copy the rest */
+      if(errno == ENOBUFS && (flags & MSG_ZEROCOPY))
+        flags &= ~MSG_ZEROCOPY;
+      else if(errno == EAGAIN)
+      {
+        Wait(FD(channel, n), EPOLLOUT | EPOLLIN);
+        Cancelled(channel, n);
+      }
+      else if(errno != EINTR)
+        ZLOGFAIL(!Cancelled(channel, n), EIO, "%s;%d: %s",
+            channel->alias, n, strerror(errno));
+      continue;
+    }
+    if(flags & MSG_ZEROCOPY) ++calls;
+
+    /* skip the sent part */
+    for(; msg.msg_iovlen > 0 && (size_t)result >= msg.msg_iov->iov_len; --msg.msg_iovlen)
+      result -= msg.msg_iov++->iov_len;
+    if(msg.msg_iovlen > 0)
+    {
+      msg.msg_iov->iov_base = (char*)msg.msg_iov->iov_base + result;
+      msg.msg_iov->iov_len -= result;
+    }
+  }
+
+  return calls;
+}
+
+/* wait until the kernel released the user memory of "calls" sends */
+static void WaitCompletions(struct ChannelDesc *channel, int n, int calls)
+{
+  char control[CMSG_SPACE(sizeof(struct sock_extended_err))];
+  struct sock_extended_err *err;
+  struct cmsghdr *cm;
+  struct msghdr msg;
+
+  while(calls > 0 && !IS_CANCELLED(CH_FILE(channel, n)))
+  {
+    memset(&msg, 0, sizeof msg);
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof control;
+
+    /* the completions come with the socket error queue */
+    if(recvmsg(FD(channel, n), &msg, MSG_ERRQUEUE) < 0)
+    {
+      ZLOGFAIL(errno != EAGAIN && errno != EINTR, EIO, "%s;%d: %s",
+          channel->alias, n, strerror(errno));
+      if(Cancelled(channel, n)) break;
+      CheckSocket(channel, n);
+      Wait(FD(channel, n), EPOLLIN);
+      continue;
+    }
+
+    for(cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm))
+    {
+      err = (struct sock_extended_err*)CMSG_DATA(cm);
+      if(err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+      calls -= err->ee_data - err->ee_info + 1;
+    }
+  }
+}
+
+int32_t SendData(struct ChannelDesc *channel, int n, const char *buf, int32_t count)
+{
+  struct iovec iov[2 * IOV_FRAMES];
+  uint32_t *headers;
+  int flags = zerocopy && count >= ZEROCOPY_SIZE ? MSG_ZEROCOPY : 0;
+  int frames = (count + NET_BUFFER_SIZE - 1) / NET_BUFFER_SIZE;
+  int calls = 0;
+  int32_t pos = 0;
+  int i;
+
+  assert(channel != NULL);
+  assert(buf != NULL);
+  assert(count >= 0);
+
+  ZLOGS(LOG_INSANE, "send(): channel %s;%d, buffer=0x%lx, size=%d",
+      channel->alias, n, (intptr_t)buf, count);
+
+  /* the reader does not need the data anymore */
+  if(IS_CANCELLED(CH_FILE(channel, n))) return count;
+
+  /* headers must live until the kernel released zero copy sends */
+  headers = g_new(uint32_t, frames + 1);
+  for(i = 0; i < frames; ++i)
+  {
+    int32_t size = MIN(count - pos, NET_BUFFER_SIZE);
+
+    headers[i] = htonl(size);
+    iov[2 * (i % IOV_FRAMES)].iov_base = &headers[i];
+    iov[2 * (i % IOV_FRAMES)].iov_len = HEADER_SIZE;
+    iov[2 * (i % IOV_FRAMES) + 1].iov_base = (char*)buf + pos;
+    iov[2 * (i % IOV_FRAMES) + 1].iov_len = size;
+    pos += size;
+
+    /* send the batch of frames with one call */
+    if(i % IOV_FRAMES == IOV_FRAMES - 1 || i == frames - 1)
+      calls += Send(channel, n, iov, 2 * (i % IOV_FRAMES + 1), flags);
+  }
+
+  /* user can change the buffer after the trap returns */
+  WaitCompletions(channel, n, calls);
+  g_free(headers);
+  return count;
+}
+
+void SyncSource(struct ChannelDesc *channel, int n)
+{
+  if(!CH_SEQ_READABLE(channel)) return;
+
+  ZLOGS(LOG_INSANE, "%s;%d before skip pos = %ld, getpos = %ld",
+      channel->alias, n, CH_CONN(channel, n)->pos, channel->getpos);
+
+  /* if source is a pipe read (*->getpos - *->pos) bytes */
+  if(CH_PROTO(channel, n) == ProtoFIFO || CH_PROTO(channel, n) == ProtoCharacter)
+  {
+    int result;
+    while(CH_CONN(channel, n)->pos < channel->getpos)
+    {
+      char buf[BUFFER_SIZE];
+      result = fread(buf, 1, channel->getpos - CH_CONN(channel, n)->pos,
+          CH_HANDLE(channel, n));
+      ZLOGFAIL(result < 0, EIO, "%s;%d: %s", channel->alias, n, strerror(errno));
+      CH_CONN(channel, n)->pos += result;
+    }
+  }
+
+  /* if source is a network get over (*->getpos - *->pos) bytes */
+  else if(IS_NETWORK(CH_CONN(channel, n)))
+  {
+    while(CH_CONN(channel, n)->pos < channel->getpos && !channel->eof)
+    {
+      FetchMessage(channel, n);
+      CH_CONN(channel, n)->pos += channel->bufend;
+    }
+  }
+
+  /* no need to sync with regular files, just set (*->getpos to *->pos) */
+  else
+    CH_CONN(channel, n)->pos = channel->getpos;
+
+  ZLOGS(LOG_INSANE, "%s;%d skipped pos = %ld, getpos = %ld",
+      channel->alias, n, CH_CONN(channel, n)->pos, channel->getpos);
+  ZLOGFAIL(CH_CONN(channel, n)->pos != channel->getpos,
+      EPIPE, "%s;%d is out of sync", channel->alias, n);
+}
+
+void PrefetchChannelCtor(struct ChannelDesc *channel, int n)
+{
+  assert(epoll >= 0);
+  assert(channel != NULL);
+  assert(n < channel->source->len);
+  ZLOGS(LOG_DEBUG, "prefetch %s;%d", channel->alias, n);
+
+  /* choose socket type */
+  ZLOGFAIL((uint32_t)CH_RW_TYPE(channel) - 1 > 1, EFAULT, "invalid i/o type");
+  CH_FLAGS(channel, n) |= (CH_RW_TYPE(channel) - 1) << 1;
+
+  /* open source */
+  Socket(channel, n);
+
+  /* one message buffer per RO channel */
+  if(IS_RO(channel) && channel->msg == NULL)
+    channel->msg = g_malloc(NET_BUFFER_SIZE);
+
+  /* bind or connect the channel */
+  IS_RO(channel) ? Bind(channel, n) : Connect(channel, n);
+}
+
+void PrefetchChannelDtor(struct ChannelDesc *channel, int n)
+{
+  char digest[TAG_DIGEST_SIZE + 1];
+  uint32_t headers[2] = {0};
+  struct iovec iov[3];
+
+  /* skip source closing if session is broken */
+  if(GetExitCode() != 0) return;
+
+  assert(channel != NULL);
+  assert(n < channel->source->len);
+  ZLOGS(LOG_DEBUG, "closing %s;%d", channel->alias, n);
+
+  /* close WO source (send EOF and digest) */
+  if(IS_WO(channel) && !Cancelled(channel, n))
+  {
+    channel->eof = 1;
+    if(channel->tag != NULL)
+    {
+      TagDigest(channel->tag, digest);
+      headers[1] = htonl(TAG_DIGEST_SIZE);
+    }
+    iov[0].iov_base = &headers[0];
+    iov[0].iov_len = HEADER_SIZE;
+    iov[1].iov_base = &headers[1];
+    iov[1].iov_len = HEADER_SIZE;
+    iov[2].iov_base = digest;
+    iov[2].iov_len = ntohl(headers[1]);
+    Send(channel, n, iov, 3, 0);
+    CountPut(CH_CONN(channel, n), 0);
+  }
+  /*
+   * close RO source. if the data is not read to EOF tell the writer to
+   * stop sending: closing with unread data resets the connection. the
+   * writer which did not connect yet is not waited for: it only gets
+   * the refused connections
+   */
+  else if(IS_RO(channel))
+  {
+    if((!channel->eof || CH_CONN(channel, n)->pos < channel->getpos)
+        && TryAccept(channel, n) == 0)
+    {
+      char c = CANCEL;
+
+      send(FD(channel, n), &c, 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+      ZLOGS(LOG_DEBUG, "%s;%d cancelled", channel->alias, n);
+    }
+    channel->eof = 1;
+  }
+
+  /* close source (the message is deallocated later) */
+  close(FD(channel, n));
+  CH_HANDLE(channel, n) = NULL;
+  CH_BACKUP(channel, n) = NULL;
+  ZLOGS(LOG_DEBUG, "%s;%d closed", channel->alias, n);
+}
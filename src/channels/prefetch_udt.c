@@ -43,6 +43,7 @@ void PrefetchAccept(struct ChannelDesc *channel)
   for(n = 0; n < channel->source->len; ++n)
   {
     if(IS_FILE(CH_CONN(channel, n))) continue;
+    if(CH_PROTO(channel, n) == ProtoIPC) continue;
 
     result = udt_accept(GPOINTER_TO_INT(CH_HANDLE(channel, n)),
         (struct sockaddr*)&incoming, &result);
@@ -105,6 +106,11 @@ static void Connect(struct ChannelDesc *channel, int n, struct addrinfo *local)
       channel->alias, n, udt_getlasterror_desc());
 }
 
+/* udt sends directly from the user buffer, the depth is not used */
+void NetPipelineDepth(int d)
+{
+}
+
 void NetCtor(const struct Manifest *manifest)
 {
   ZLOG(LOG_DEBUG, "NetCtor: udt");
@@ -130,25 +136,32 @@ void FreeMessage(struct ChannelDesc *channel)
   channel->msg = NULL;
 }
 
-/* get the next message. updates channel->msg (and indices) */
-static void GetMessage(struct ChannelDesc *channel, int n, int size)
+/* receive "size" bytes to "buf" or less if the stream ended */
+static int32_t Receive(struct ChannelDesc *channel, int n, char *buf, int size)
 {
-  ZLOGS(LOG_INSANE, "GetMessage: %s;%d", channel->alias, n);
-  channel->bufpos = 0;
-  channel->bufend = 0;
+  int32_t received = 0;
 
-  while(channel->bufend < size && !channel->eof)
+  while(received < size)
   {
     int i = udt_recv(GPOINTER_TO_INT(CH_HANDLE(channel, n)),
-        channel->msg + channel->bufend, size - channel->bufend, 0);
+        buf + received, size - received, 0);
     if(i < 0) break;
     else
-      channel->bufend += i;
+      received += i;
   }
 
   /* only set EOF if this read returned nothing */
-  if(channel->bufend == 0)
+  if(received == 0)
     channel->eof = 1;
+  return received;
+}
+
+/* get the next message. updates channel->msg (and indices) */
+static void GetMessage(struct ChannelDesc *channel, int n, int size)
+{
+  ZLOGS(LOG_INSANE, "GetMessage: %s;%d", channel->alias, n);
+  channel->bufpos = 0;
+  channel->bufend = channel->eof ? 0 : Receive(channel, n, channel->msg, size);
 }
 
 void FetchMessage(struct ChannelDesc *channel, int n)
@@ -168,6 +181,15 @@ void FetchMessage(struct ChannelDesc *channel, int n)
     GetMessage(channel, n, channel->bufpos);
 }
 
+/* udt is a stream: any requested size can be received directly */
+int32_t ReceiveData(struct ChannelDesc *channel, int n, char *buf, int32_t size)
+{
+  ZLOGS(LOG_INSANE, "ReceiveData: %s;%d", channel->alias, n);
+  channel->bufpos = 0;
+  channel->bufend = 0;
+  return channel->eof ? 0 : Receive(channel, n, buf, size);
+}
+
 int32_t SendData(struct ChannelDesc *channel, int n, const char *buf, int32_t count)
 {
   int i;
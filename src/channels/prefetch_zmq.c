@@ -15,6 +15,8 @@
  */
 
 #include <assert.h>
+#include <pthread.h>
+#include <time.h>
 #include <arpa/inet.h> /* convert ip <-> int */
 #include <zmq.h>
 #include "src/channels/prefetch.h"
@@ -22,7 +24,12 @@
 #include "src/main/report.h"
 
 #define NET_BUFFER_SIZE BUFFER_SIZE
+#define ZEROCOPY_SIZE 0x1000 /* smaller slices are copied to the message */
 #define ZMQ_ERR(code) ZLOGIF(code < 0, "failed: %s", zmq_strerror(zmq_errno()))
+#define CANCEL 'C' /* the reader closed the source before EOF */
+#define DONE 'D' /* the reader got EOF */
+#define CLOSE_LINGER 1000 /* ms to deliver the reader reply */
+#define REPLY_TIMEOUT CLOSE_LINGER /* ms the writer waits for the reply */
 
 /* TODO(d'b): find more neat solution than put it twice */
 #define XARRAY(a) static char *ARRAY_##a[] = {a};
@@ -31,6 +38,90 @@
 #undef X
 
 static void *context = NULL; /* zeromq context */
+static int depth = 1; /* messages in flight per "connect" source */
+
+/* user buffer slices given to zmq without copying and not released yet */
+static int pending = 0;
+static pthread_mutex_t pending_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pending_cond = PTHREAD_COND_INITIALIZER;
+
+void NetPipelineDepth(int d)
+{
+  depth = d;
+}
+
+/* zmq (i/o thread) does not need the user buffer slice anymore */
+static void ReleaseSlice(void *data, void *hint)
+{
+  pthread_mutex_lock(&pending_lock);
+  if(--pending == 0) pthread_cond_signal(&pending_cond);
+  pthread_mutex_unlock(&pending_lock);
+}
+
+/* wait until zmq released all user buffer slices */
+static void WaitSlices()
+{
+  pthread_mutex_lock(&pending_lock);
+  while(pending > 0)
+    pthread_cond_wait(&pending_cond, &pending_lock);
+  pthread_mutex_unlock(&pending_lock);
+}
+
+/* return monotonic time in milliseconds */
+static int64_t Now()
+{
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (int64_t)t.tv_sec * 1000 + t.tv_nsec / 1000000;
+}
+
+/*
+ * wait for "events" of the source socket up to "timeout" ms (-1: until
+ * they come). return the number of ready sockets
+ */
+static int Wait(struct ChannelDesc *channel, int n, short events, long timeout)
+{
+  zmq_pollitem_t item = {0};
+  int result;
+
+  item.socket = CH_HANDLE(channel, n);
+  item.events = events;
+  do
+    result = zmq_poll(&item, 1, timeout);
+  while(result < 0 && zmq_errno() == EINTR);
+  ZLOGFAIL(result < 0, EIO, "%s;%d: %s", channel->alias, n,
+      zmq_strerror(zmq_errno()));
+  return result;
+}
+
+/*
+ * drop the WO source cancelled by the reader. the socket is closed at
+ * once: zmq drops the queued messages and releases their slices
+ */
+static void Drop(struct ChannelDesc *channel, int n)
+{
+  int linger = 0;
+
+  ZLOGS(LOG_DEBUG, "%s;%d cancelled by the reader", channel->alias, n);
+  CH_FLAGS(channel, n) |= FLAG_CANCEL_MASK;
+  zmq_setsockopt(CH_HANDLE(channel, n), ZMQ_LINGER, &linger, sizeof linger);
+  ZMQ_ERR(zmq_close(CH_HANDLE(channel, n)));
+  CH_HANDLE(channel, n) = NULL;
+}
+
+/* check if the reader cancelled the WO source stream */
+static int Cancelled(struct ChannelDesc *channel, int n)
+{
+  char c;
+
+  if(IS_CANCELLED(CH_FILE(channel, n))) return 1;
+  if(zmq_recv(CH_HANDLE(channel, n), &c, 1, ZMQ_DONTWAIT) != 1
+      || c != CANCEL) return 0;
+
+  Drop(channel, n);
+  return 1;
+}
 
 /* return connection url. returned string must be freed with g_free */
 static char *MakeURL(struct ChannelDesc *channel, int n)
@@ -82,7 +173,7 @@ static void Bind(struct ChannelDesc *channel, int n)
 static void Connect(struct ChannelDesc *channel, int n)
 {
   char *url;
-  int hwm = 1;
+  int hwm = depth;
   void *h = CH_HANDLE(channel, n);
 
   ZMQ_ERR(zmq_setsockopt(h, ZMQ_SNDHWM, &hwm, sizeof hwm));
@@ -143,6 +234,18 @@ static void GetMessage(struct ChannelDesc *channel, int n)
   channel->bufpos = 0;
 }
 
+/* get the 2nd part of EOF (digest) */
+static void GetEOF(struct ChannelDesc *channel, int n)
+{
+  GetMessage(channel, n);
+  channel->eof = 1;
+
+  /* check EOF digest size */
+  if(channel->bufend > 0)
+    ZLOGFAIL(channel->bufend != TAG_DIGEST_SIZE, EFAULT,
+        "invalid EOF size = %d", channel->bufend);
+}
+
 void FetchMessage(struct ChannelDesc *channel, int n)
 {
   ZLOGS(LOG_INSANE, "FetchMessage of %s;%d", channel->alias, n);
@@ -152,21 +255,85 @@ void FetchMessage(struct ChannelDesc *channel, int n)
   GetMessage(channel, n);
 
   /* if EOF detected get the 2nd part */
-  if(channel->bufend > 0) return;
-  GetMessage(channel, n);
-  channel->eof = 1;
+  if(channel->bufend == 0) GetEOF(channel, n);
+}
 
-  /* check EOF digest size */
-  if(channel->bufend > 0)
-    ZLOGFAIL(channel->bufend != TAG_DIGEST_SIZE, EFAULT,
-        "invalid EOF size = %d", channel->bufend);
+int32_t ReceiveData(struct ChannelDesc *channel, int n, char *buf, int32_t size)
+{
+  int result;
+
+  /* the message can be truncated if the buffer is smaller */
+  if(channel->eof || size < NET_BUFFER_SIZE) return -1;
+
+  ZLOGS(LOG_INSANE, "ReceiveData of %s;%d", channel->alias, n);
+  result = zmq_recv(CH_HANDLE(channel, n), buf, size, 0);
+  ZLOGFAIL(result < 0, EIO, "%s;%d: %s", channel->alias, n,
+      zmq_strerror(zmq_errno()));
+  ZLOGFAIL(result > size, EIO, "%s;%d message truncated", channel->alias, n);
+
+  /* the channel message is empty now */
+  channel->bufpos = 0;
+  channel->bufend = 0;
+  if(result == 0) GetEOF(channel, n);
+  return result;
 }
 
-/* send message "channel->msg" */
+/*
+ * send message "channel->msg" unless the reader cancelled the stream.
+ * unsent message is released
+ */
 static void SendMessage(struct ChannelDesc *channel, int n)
 {
+  int result;
+
   ZLOGS(LOG_INSANE, "SendMessage to %s;%d", channel->alias, n);
-  ZMQ_ERR(zmq_msg_send(channel->msg, CH_HANDLE(channel, n), 0));
+  while(!Cancelled(channel, n))
+  {
+    result = zmq_msg_send(channel->msg, CH_HANDLE(channel, n), ZMQ_DONTWAIT);
+    if(result >= 0) return;
+
+    /* the queue is full: wait for the room or the reader reply */
+    if(zmq_errno() == EAGAIN)
+      Wait(channel, n, ZMQ_POLLIN | ZMQ_POLLOUT, -1);
+    else if(zmq_errno() != EINTR)
+    {
+      ZMQ_ERR(result);
+      break;
+    }
+  }
+  zmq_msg_close(channel->msg);
+}
+
+/*
+ * wait for the reader reply to EOF. the reader which did not reply in
+ * REPLY_TIMEOUT (e.g. the broken session or the old zerovm) is considered
+ * closed as usual: the rest of data is delivered by the socket linger
+ */
+static void GetReply(struct ChannelDesc *channel, int n)
+{
+  int64_t deadline = Now() + REPLY_TIMEOUT;
+  int64_t now;
+  char c;
+
+  while(!IS_CANCELLED(CH_FILE(channel, n)))
+  {
+    if(zmq_recv(CH_HANDLE(channel, n), &c, 1, ZMQ_DONTWAIT) == 1)
+    {
+      if(c == CANCEL) Drop(channel, n);
+      if(c == DONE) break;
+      continue;
+    }
+    ZLOGFAIL(zmq_errno() != EAGAIN && zmq_errno() != EINTR, EIO,
+        "%s;%d: %s", channel->alias, n, zmq_strerror(zmq_errno()));
+
+    now = Now();
+    if(now >= deadline)
+    {
+      ZLOGS(LOG_DEBUG, "%s;%d got no reply", channel->alias, n);
+      break;
+    }
+    Wait(channel, n, ZMQ_POLLIN, deadline - now);
+  }
 }
 
 int32_t SendData(struct ChannelDesc *channel, int n, const char *buf, int32_t count)
@@ -180,19 +347,45 @@ int32_t SendData(struct ChannelDesc *channel, int n, const char *buf, int32_t co
   /* send a buffer through the multiple messages */
   ZLOGS(LOG_INSANE, "send(): channel %s;%d, buffer=0x%lx, size=%d",
       channel->alias, n, (intptr_t)buf, count);
-  for(writerest = count; writerest > 0; writerest -= NET_BUFFER_SIZE)
+
+  /* the reader does not need the data anymore */
+  for(writerest = count; writerest > 0 && !Cancelled(channel, n);
+      writerest -= NET_BUFFER_SIZE)
   {
     int32_t towrite = MIN(writerest, NET_BUFFER_SIZE);
+    int result;
 
-    /* create the message */
-    ZMQ_ERR(zmq_msg_init_size(channel->msg, towrite));
-    memcpy(MessageData(channel), buf, towrite);
+    /*
+     * create the message. large slices are given to zmq without copying,
+     * the slice is counted only when zmq took it (and will release it)
+     */
+    if(towrite >= ZEROCOPY_SIZE)
+    {
+      result = zmq_msg_init_data(channel->msg,
+          (void*)buf, towrite, ReleaseSlice, NULL);
+      if(result == 0)
+      {
+        pthread_mutex_lock(&pending_lock);
+        ++pending;
+        pthread_mutex_unlock(&pending_lock);
+      }
+    }
+    else
+    {
+      result = zmq_msg_init_size(channel->msg, towrite);
+      if(result == 0)
+        memcpy(MessageData(channel), buf, towrite);
+    }
+    ZLOGFAIL(result < 0, EIO, "%s;%d: %s", channel->alias, n,
+        zmq_strerror(zmq_errno()));
 
     /* send the message */
     SendMessage(channel, n);
     buf += towrite;
   }
 
+  /* user can change the buffer after the trap returns */
+  WaitSlices();
   return count;
 }
 
@@ -239,7 +432,6 @@ void SyncSource(struct ChannelDesc *channel, int n)
 
 void PrefetchChannelCtor(struct ChannelDesc *channel, int n)
 {
-  int sock_type;
   struct Connection *c;
 
   assert(context != NULL);
@@ -253,10 +445,9 @@ void PrefetchChannelCtor(struct ChannelDesc *channel, int n)
   /* choose socket type */
   ZLOGFAIL((uint32_t)CH_RW_TYPE(channel) - 1 > 1, EFAULT, "invalid i/o type");
   CH_FLAGS(channel, n) |= (CH_RW_TYPE(channel) - 1) << 1;
-  sock_type = IS_RO(channel) ? ZMQ_PULL : ZMQ_PUSH;
 
-  /* open source (0mq socket) */
-  c->handle = zmq_socket(context, sock_type);
+  /* open source (0mq socket). the pair carries the reader reply back */
+  c->handle = zmq_socket(context, ZMQ_PAIR);
   ZLOGFAIL(c->handle == NULL, EFAULT,
       "cannot get socket for %s;%d", channel->alias, n);
 
@@ -268,7 +459,7 @@ void PrefetchChannelCtor(struct ChannelDesc *channel, int n)
   }
 
   /* bind or connect the channel */
-  sock_type == ZMQ_PULL ? Bind(channel, n) : Connect(channel, n);
+  IS_RO(channel) ? Bind(channel, n) : Connect(channel, n);
 }
 
 void PrefetchChannelDtor(struct ChannelDesc *channel, int n)
@@ -289,7 +480,7 @@ void PrefetchChannelDtor(struct ChannelDesc *channel, int n)
   url = MakeURL(channel, n);
   ZLOGS(LOG_DEBUG, "closing %s;%d with url %s", channel->alias, n, url);
 
-  /* close WO source (send EOF) */
+  /* close WO source (send EOF and wait for the reader reply) */
   if(IS_WO(channel))
   {
     /* 1st EOF part */
@@ -309,41 +500,44 @@ void PrefetchChannelDtor(struct ChannelDesc *channel, int n)
     /* dummy message to avoid #197 */
     ZMQ_ERR(zmq_msg_init_data(channel->msg, digest, 0, NULL, NULL));
     SendMessage(channel, n);
-    CountPut(CH_CONN(channel, n), 0);
+    GetReply(channel, n);
+    if(!IS_CANCELLED(CH_FILE(channel, n)))
+      CountPut(CH_CONN(channel, n), 0);
 
     /* only for the last source */
     if(n == channel->source->len - 1)
       FreeMessage(channel);
   }
-  /* close RO source, "fast forward" to EOF if needed */
+  /*
+   * close RO source. if the data is not read to EOF tell the writer to
+   * stop sending instead of receiving the rest. the reply is given
+   * CLOSE_LINGER to reach the writer which can be already gone
+   */
   else
   {
-    /*
-     * TODO(d'b): this is a temporary solution. complete solution can be
-     * implemented when daemon/proxy will be able to terminate zerovm by
-     * request for instance when cluster is already done except "sending"
-     * reserve node (reported as useless by "receiving" node(s))
-     */
-    if(CH_CONN(channel, n)->pos < channel->getpos)
-      channel->eof = 0;
+    char c = DONE;
+    int linger = CLOSE_LINGER;
 
-    /* read until EOF (to avoid hanging sending session) */
-    for(; channel->eof == 0; FetchMessage(channel, n))
+    if(!channel->eof || CH_CONN(channel, n)->pos < channel->getpos)
     {
-      if(n == 0) channel->getpos += channel->bufend;
-      CH_CONN(channel, n)->pos += channel->bufend;
-      CountGet(CH_CONN(channel, n), channel->bufend);
+      c = CANCEL;
+      ZLOGS(LOG_DEBUG, "%s;%d cancelled", channel->alias, n);
+    }
+    else
+    {
+      /* get dummy message (#197) */
+      channel->eof = 0;
+      GetMessage(channel, n);
     }
-
-    /* get dummy message (#197) */
-    channel->eof = 0;
-    GetMessage(channel, n);
     channel->eof = 1;
+    zmq_setsockopt(CH_HANDLE(channel, n), ZMQ_LINGER, &linger, sizeof linger);
+    zmq_send(CH_HANDLE(channel, n), &c, 1, ZMQ_DONTWAIT);
     /* message will be deallocated later */
   }
 
-  /* close source */
-  ZMQ_ERR(zmq_close(CH_HANDLE(channel, n)));
+  /* close source (cancelled WO source is already closed) */
+  if(CH_HANDLE(channel, n) != NULL)
+    ZMQ_ERR(zmq_close(CH_HANDLE(channel, n)));
   CH_HANDLE(channel, n) = NULL;
   ZLOGS(LOG_DEBUG, "%s closed", url);
   g_free(url);
@@ -14,18 +14,25 @@
  * limitations under the License.
  */
 #include <assert.h>
+#include <sys/mman.h>
 #include "src/channels/preload.h"
 
 #define CHANNEL_RIGHTS S_IRUSR | S_IWUSR
 #define DEV_NULL "/dev/null"
 
 static int disable_preallocation = 0;
+static int keep_resident = 0;
 
 void PreloadAllocationDisable()
 {
   disable_preallocation = 1;
 }
 
+void PreloadKeepResident()
+{
+  keep_resident = 1;
+}
+
 /* detect and set source type */
 #define SET(f, p) if(f(fs.st_mode)) CH_PROTO(channel, n) = Proto##p; else
 static void SetChannelSource(struct ChannelDesc *channel, int n)
@@ -58,6 +65,14 @@ int PreloadChannelDtor(struct ChannelDesc *channel, int n)
   assert(channel != NULL);
   assert(n < channel->source->len);
 
+  /* resident channel stays mounted in the daemon for its children */
+  if(channel->data != NULL)
+  {
+    if(keep_resident) return 0;
+    munmap(channel->data, channel->size);
+    channel->data = NULL;
+  }
+
   /* adjust the size of writable channels */
   handle = GPOINTER_TO_INT(CH_HANDLE(channel, n));
   if(channel->limits[PutSizeLimit] && channel->limits[PutsLimit]
@@ -112,6 +127,25 @@ static void CharacterChannel(struct ChannelDesc* channel, int n)
   channel->size = 0;
 }
 
+/*
+ * map the whole file of the resident channel. the pages are populated
+ * once by the daemon and shared with its children (copy-on-write)
+ */
+static void ResidentChannel(struct ChannelDesc* channel, int n)
+{
+  int h = GPOINTER_TO_INT(CH_HANDLE(channel, n));
+
+  ZLOGFAIL(!IS_RO(channel) || channel->source->len != 1, EFAULT,
+      "resident %s must be read-only with the single source", channel->alias);
+  if(channel->size == 0) return;
+
+  channel->data = mmap(NULL, channel->size, PROT_READ,
+      MAP_PRIVATE | MAP_POPULATE, h, 0);
+  ZLOGFAIL(channel->data == MAP_FAILED, errno,
+      "cannot map resident %s", channel->alias);
+  ZLOGS(LOG_DEBUG, "%s is resident, %ld bytes", channel->alias, channel->size);
+}
+
 /* preload given regular device to channel */
 static void RegularChannel(struct ChannelDesc* channel, int n)
 {
@@ -125,6 +159,7 @@ static void RegularChannel(struct ChannelDesc* channel, int n)
       CH_HANDLE(channel, n) = GINT_TO_POINTER(h);
       channel->size = GetFileSize(CH_NAME(channel, n));
       ZLOGFAIL(channel->size < 0, EFAULT, "cannot open %s", CH_NAME(channel, n));
+      if(channel->resident && h >= 0) ResidentChannel(channel, n);
       break;
 
     case 2: /* write only. existing file will be overwritten */
@@ -171,6 +206,9 @@ void PreloadChannelCtor(struct ChannelDesc *channel, int n)
   assert(channel != NULL);
   assert(n < channel->source->len);
 
+  /* resident channel is already mounted by the daemon */
+  if(channel->data != NULL) return;
+
   /* check the given channel */
   ZLOGS(LOG_DEBUG, "mounting file %s to alias %s",
       CH_NAME(channel, n), channel->alias);
@@ -25,6 +25,9 @@
 /* disable space preallocation */
 void PreloadAllocationDisable();
 
+/* do not unmount resident channels (daemon keeps them for children) */
+void PreloadKeepResident();
+
 /*
  * preload given file to channel.
  * return 0 if success, otherwise negative errcode
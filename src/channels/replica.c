@@ -0,0 +1,93 @@
+/*
+ * replicated channels: the sources keep EWMA of the read latency and
+ * throughput, the fastest valid one becomes the primary
+ *
+ * Copyright (c) 2013, LiteStack, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <glib.h>
+#include "src/main/tools.h"
+#include "src/channels/replica.h"
+
+int64_t Estimate(const struct File *f, int32_t size)
+{
+  return f->rate == 0 ? 0 : f->latency + size * NANO_PER_SEC / f->rate;
+}
+
+void UpdateStats(struct File *f, int32_t size, int64_t time)
+{
+  int64_t rate = size * NANO_PER_SEC / MAX(time, 1);
+
+  /* the 1st sample initializes the averages */
+  if(f->rate == 0)
+  {
+    f->latency = time;
+    f->rate = MAX(rate, 1);
+    return;
+  }
+
+  f->latency += (time - f->latency) / (1 << EWMA_SHIFT);
+  f->rate += (rate - f->rate) / (1 << EWMA_SHIFT);
+  f->rate = MAX(f->rate, 1);
+}
+
+void AgeStats(struct File *f)
+{
+  /* failed and never read sources have nothing to improve */
+  if(!IS_VALID(f) || f->rate == 0) return;
+
+  f->latency -= f->latency >> AGING_SHIFT;
+  f->rate = MIN(f->rate + (f->rate >> AGING_SHIFT), RATE_LIMIT);
+}
+
+int GetFirstSource(struct ChannelDesc *channel)
+{
+  int n;
+
+  for(n = 0; n < channel->source->len; ++n)
+    if(IS_VALID(CH_FILE(channel, n))) return n;
+  return -1;
+}
+
+/* order the sources to read: valid ones by the estimated read time */
+static int OrderSpeed(const int *a, const int *b, struct ChannelDesc *channel)
+{
+  struct File *fa = CH_FILE(channel, *a);
+  struct File *fb = CH_FILE(channel, *b);
+  int64_t d;
+
+  if(IS_VALID(fa) != IS_VALID(fb))
+    return IS_VALID(fb) - IS_VALID(fa);
+  d = Estimate(fa, BUFFER_SIZE) - Estimate(fb, BUFFER_SIZE);
+  return d != 0 ? (d < 0 ? -1 : 1) : *a - *b;
+}
+
+int SelectPrimary(struct ChannelDesc *channel)
+{
+  int n;
+
+  if(channel->order == NULL)
+  {
+    channel->order = g_new(int, channel->source->len);
+    for(n = 0; n < channel->source->len; ++n)
+      channel->order[n] = n;
+  }
+
+  if(channel->source->len > 1)
+    g_qsort_with_data(channel->order, channel->source->len, sizeof(int),
+        (GCompareDataFunc)OrderSpeed, channel);
+  n = channel->order[0];
+  return IS_VALID(CH_FILE(channel, n)) ? n : -1;
+}
@@ -0,0 +1,53 @@
+/*
+ * replicated channels: the read statistics of the sources and the choice
+ * of the primary one
+ *
+ * Copyright (c) 2013, LiteStack, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef REPLICA_H_
+#define REPLICA_H_
+
+#include "src/channels/channel.h"
+
+EXTERN_C_BEGIN
+
+#define EWMA_SHIFT 3 /* the new sample weight is 1/8 */
+#define AGING_SHIFT 6 /* unread source estimation improves by 1/64 per read */
+#define RATE_LIMIT (1LL << 40) /* bytes per second the aging can reach */
+
+/* estimated time (ns) to read "size" bytes from the source, 0 if unknown */
+int64_t Estimate(const struct File *f, int32_t size);
+
+/* update the source averages with the chunk of "size" bytes read in "time" */
+void UpdateStats(struct File *f, int32_t size, int64_t time);
+
+/* the valid source was not read: improve its estimation to try it later */
+void AgeStats(struct File *f);
+
+/* return the 1st valid source in the raw or -1 */
+int GetFirstSource(struct ChannelDesc *channel);
+
+/*
+ * order the sources of the replicated channel (channel->order, the sources
+ * themselves are left in place): valid ones by the estimated read time, the
+ * sources which were never read first. return the index of the fastest
+ * valid source (the primary, it reads to the user buffer) or -1
+ */
+int SelectPrimary(struct ChannelDesc *channel);
+
+EXTERN_C_END
+
+#endif /* REPLICA_H_ */
@@ -0,0 +1,472 @@
+/*
+ * shared memory ring sources. WO source creates the single producer /
+ * single consumer ring in memfd and passes it to RO source through the
+ * abstract unix socket "zerovm.ring.<port>". the port is chosen by RO
+ * source and delivered to the peer by the name service. the reader copies
+ * the data from the ring directly to the user buffer. the reader closing
+ * before EOF cancels the stream: the writer drops the rest of data. the
+ * waiting side wakes up every RING_POLL to check if the peer is alive.
+ * the reader only maps the sealed ring of the right size from the process
+ * of the same user, the writer only connects to the local peer
+ *
+ * Copyright (c) 2013, LiteStack, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <assert.h>
+#include <fcntl.h>
+#include <ifaddrs.h>
+#include <poll.h>
+#include <signal.h>
+#include <stddef.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <linux/futex.h>
+#include "src/channels/ring.h"
+#include "src/main/accounting.h"
+#include "src/main/report.h"
+
+#define RING_NAME "zerovm.ring.%u"
+#define RING_HEADER 0x1000 /* the data follows the header page */
+#define RING_SIZE 0x100000 /* power of 2 */
+#define RING_MASK (RING_SIZE - 1)
+#define PORTS 0x10000
+#define RING_POLL 100000000 /* ns of the peer liveness checks */
+#define RING_SEALS (F_SEAL_SHRINK | F_SEAL_GROW) /* the ring size is fixed */
+#define RING(channel, n) ((struct Ring*)CH_HANDLE(channel, n))
+#define RING_DATA(r) ((char*)(r) + RING_HEADER)
+
+/*
+ * the producer and the consumer only update their own counters. "seq"
+ * words are futexes: the side increments it after the update and wakes
+ * the peer if it is waiting. "pid" words are set by the sides once: they
+ * are checked when the wait for the peer takes too long
+ */
+struct Ring
+{
+  volatile uint64_t head __attribute__((aligned(64))); /* produced bytes */
+  volatile uint32_t rseq; /* head or eof updated */
+  volatile uint32_t rwait; /* consumer is sleeping */
+  volatile uint64_t tail __attribute__((aligned(64))); /* consumed bytes */
+  volatile uint32_t wseq; /* tail updated */
+  volatile uint32_t wwait; /* producer is sleeping */
+  volatile uint32_t cancel; /* consumer does not need more data */
+  volatile uint32_t eof __attribute__((aligned(64)));
+  volatile int32_t wpid; /* producer process */
+  volatile int32_t rpid; /* consumer process (0 if unknown) */
+  uint32_t dsize; /* EOF digest size */
+  char digest[TAG_DIGEST_SIZE + 1];
+};
+
+/*
+ * wait for the peer signal if "seq" is still "old". fail if the wait
+ * timed out and the peer process "pid" is gone
+ */
+static void Sleep(struct ChannelDesc *channel, int n,
+    volatile uint32_t *seq, volatile uint32_t *waiting, uint32_t old, int32_t pid)
+{
+  struct timespec timeout = {0, RING_POLL};
+  int result;
+
+  *waiting = 1;
+  __sync_synchronize();
+  result = syscall(SYS_futex, seq, FUTEX_WAIT, old, &timeout, NULL, 0);
+  *waiting = 0;
+  if(result == 0 || errno != ETIMEDOUT || pid == 0) return;
+  ZLOGFAIL(kill(pid, 0) != 0 && errno == ESRCH, EPIPE,
+      "%s;%d connection lost", channel->alias, n);
+}
+
+/* tell the peer that the counter is updated */
+static void Signal(volatile uint32_t *seq, volatile uint32_t *waiting)
+{
+  __sync_synchronize();
+  ++*seq;
+  __sync_synchronize();
+  if(*waiting)
+    syscall(SYS_futex, seq, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+/* make the rendezvous socket address for the port, return its length */
+static socklen_t Address(struct sockaddr_un *addr, uint16_t port)
+{
+  memset(addr, 0, sizeof *addr);
+  addr->sun_family = AF_UNIX;
+  g_snprintf(addr->sun_path + 1, sizeof addr->sun_path - 1, RING_NAME, port);
+  return offsetof(struct sockaddr_un, sun_path) + 1 + strlen(addr->sun_path + 1);
+}
+
+/* return 1 if the host (network order) is this machine, otherwise 0 */
+static int IsLocal(uint32_t host)
+{
+  struct ifaddrs *list;
+  struct ifaddrs *i;
+  int result = 0;
+
+  if(ntohl(host) >> 24 == IN_LOOPBACKNET) return 1;
+  if(getifaddrs(&list) != 0) return 0;
+
+  for(i = list; i != NULL && result == 0; i = i->ifa_next)
+    if(i->ifa_addr != NULL && i->ifa_addr->sa_family == AF_INET)
+      result = ((struct sockaddr_in*)i->ifa_addr)->sin_addr.s_addr == host;
+
+  freeifaddrs(list);
+  return result;
+}
+
+/* bind RO source to the 1st free port, the ring is accepted upon 1st read */
+static void Bind(struct ChannelDesc *channel, int n)
+{
+  struct sockaddr_un addr;
+  uint16_t port = g_random_int();
+  int sock;
+  int i;
+
+  sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  ZLOGFAIL(sock < 0, EFAULT, "cannot get socket for %s;%d: %s",
+      channel->alias, n, strerror(errno));
+
+  for(i = 0; i < PORTS; ++i, ++port)
+  {
+    if(port == 0) continue;
+    if(bind(sock, (struct sockaddr*)&addr, Address(&addr, port)) == 0) break;
+    ZLOGFAIL(errno != EADDRINUSE, EFAULT, "cannot bind %s;%d: %s",
+        channel->alias, n, strerror(errno));
+  }
+  ZLOGFAIL(i == PORTS || listen(sock, 1) != 0, EFAULT,
+      "cannot bind %s;%d: %s", channel->alias, n, strerror(errno));
+
+  CH_PORT(channel, n) = port;
+  CH_HANDLE(channel, n) = GINT_TO_POINTER(sock);
+  CH_BACKUP(channel, n) = CH_HANDLE(channel, n);
+  ZLOGS(LOG_DEBUG, "%s;%d bound to ring port %u", channel->alias, n, port);
+}
+
+/* get the ring from the peer if not done yet */
+static void Accept(struct ChannelDesc *channel, int n)
+{
+  char control[CMSG_SPACE(sizeof(int))];
+  struct msghdr msg = {0};
+  struct iovec iov;
+  struct cmsghdr *cm;
+  struct ucred cred;
+  socklen_t len = sizeof cred;
+  struct stat st;
+  char dummy;
+  void *ring;
+  int sock;
+  int fd = -1;
+
+  if(CH_BACKUP(channel, n) == NULL) return;
+
+  /* get the ring descriptor */
+  do
+    sock = accept4(GPOINTER_TO_INT(CH_BACKUP(channel, n)), NULL, NULL, SOCK_CLOEXEC);
+  while(sock < 0 && errno == EINTR);
+  ZLOGFAIL(sock < 0, EFAULT, "cannot accept %s;%d: %s",
+      channel->alias, n, strerror(errno));
+
+  /* the abstract socket is open to anyone: only the same user can write */
+  ZLOGFAIL(getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0
+      || cred.uid != getuid(), EFAULT, "%s;%d: the ring from the other user",
+      channel->alias, n);
+
+  iov.iov_base = &dummy;
+  iov.iov_len = sizeof dummy;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof control;
+  if(recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) > 0)
+    for(cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm))
+      if(cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS)
+        memcpy(&fd, CMSG_DATA(cm), sizeof fd);
+  close(sock);
+  ZLOGFAIL(fd < 0, EFAULT, "%s;%d did not get the ring", channel->alias, n);
+
+  /* the ring which can be truncated would fault the reader (SIGBUS) */
+  ZLOGFAIL(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)
+      || st.st_size != RING_HEADER + RING_SIZE
+      || fcntl(fd, F_GET_SEALS) < 0
+      || (fcntl(fd, F_GET_SEALS) & RING_SEALS) != RING_SEALS,
+      EFAULT, "%s;%d got invalid ring", channel->alias, n);
+
+  /* map the ring */
+  ring = mmap(NULL, RING_HEADER + RING_SIZE,
+      PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  ZLOGFAIL(ring == MAP_FAILED, EFAULT, "cannot map %s;%d ring: %s",
+      channel->alias, n, strerror(errno));
+
+  close(GPOINTER_TO_INT(CH_BACKUP(channel, n)));
+  CH_HANDLE(channel, n) = ring;
+  CH_BACKUP(channel, n) = NULL;
+}
+
+/* create the ring and pass it to the peer */
+static void Connect(struct ChannelDesc *channel, int n)
+{
+  char control[CMSG_SPACE(sizeof(int))] = {0};
+  struct sockaddr_un addr;
+  struct msghdr msg = {0};
+  struct iovec iov;
+  struct cmsghdr *cm;
+  struct ucred cred;
+  socklen_t len = sizeof cred;
+  char dummy = 0;
+  void *ring;
+  int sock;
+  int fd;
+
+  /* the ring is local only */
+  ZLOGFAIL(!IsLocal(CH_HOST(channel, n)), EFAULT,
+      "%s;%d: ipc peer is not local", channel->alias, n);
+
+  /* the ring. its size is sealed */
+  fd = memfd_create("zerovm ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  ZLOGFAIL(fd < 0 || ftruncate(fd, RING_HEADER + RING_SIZE) != 0
+      || fcntl(fd, F_ADD_SEALS, RING_SEALS | F_SEAL_SEAL) != 0, EFAULT,
+      "cannot create %s;%d ring: %s", channel->alias, n, strerror(errno));
+  ring = mmap(NULL, RING_HEADER + RING_SIZE,
+      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+  ZLOGFAIL(ring == MAP_FAILED, EFAULT, "cannot map %s;%d ring: %s",
+      channel->alias, n, strerror(errno));
+  ((struct Ring*)ring)->wpid = getpid();
+
+  /* pass it to the peer */
+  sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  ZLOGFAIL(sock < 0 || connect(sock, (struct sockaddr*)&addr,
+      Address(&addr, CH_PORT(channel, n))) != 0, EFAULT,
+      "cannot connect %s;%d: %s", channel->alias, n, strerror(errno));
+
+  /* the consumer can die before it accepted the ring */
+  if(getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0)
+    ((struct Ring*)ring)->rpid = cred.pid;
+
+  iov.iov_base = &dummy;
+  iov.iov_len = sizeof dummy;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof control;
+  cm = CMSG_FIRSTHDR(&msg);
+  cm->cmsg_level = SOL_SOCKET;
+  cm->cmsg_type = SCM_RIGHTS;
+  cm->cmsg_len = CMSG_LEN(sizeof fd);
+  memcpy(CMSG_DATA(cm), &fd, sizeof fd);
+  ZLOGFAIL(sendmsg(sock, &msg, MSG_NOSIGNAL) < 0, EFAULT,
+      "cannot pass %s;%d ring: %s", channel->alias, n, strerror(errno));
+
+  close(sock);
+  close(fd);
+  CH_HANDLE(channel, n) = ring;
+  ZLOGS(LOG_DEBUG, "%s;%d connected to ring port %u",
+      channel->alias, n, CH_PORT(channel, n));
+}
+
+void RingCtor(struct ChannelDesc *channel, int n)
+{
+  assert(channel != NULL);
+  assert(n < channel->source->len);
+
+  /* the ring port only known to the name service */
+  ZLOGFAIL(IS_IPHOST(CH_CONN(channel, n)), EFAULT,
+      "%s;%d: ipc source needs the name service", channel->alias, n);
+  ZLOGFAIL((uint32_t)CH_RW_TYPE(channel) - 1 > 1, EFAULT, "invalid i/o type");
+  CH_FLAGS(channel, n) |= (CH_RW_TYPE(channel) - 1) << 1;
+
+  IS_RO(channel) ? Bind(channel, n) : Connect(channel, n);
+}
+
+int32_t RingRead(struct ChannelDesc *channel, int n, char *buf, int32_t size)
+{
+  struct Ring *r;
+  uint64_t tail;
+  uint64_t available;
+  uint32_t seq;
+  uint32_t eof;
+  int32_t count;
+  int32_t first;
+
+  Accept(channel, n);
+  r = RING(channel, n);
+
+  /* wait for the data or EOF. EOF is checked first: it follows the data */
+  for(;;)
+  {
+    seq = r->rseq;
+    __sync_synchronize();
+    eof = r->eof;
+    __sync_synchronize();
+    tail = r->tail;
+    available = r->head - tail;
+    if(available > 0 || eof) break;
+    Sleep(channel, n, &r->rseq, &r->rwait, seq, r->wpid);
+  }
+
+  /* EOF digest is taken by RingDigest() */
+  if(available == 0)
+  {
+    channel->bufpos = 0;
+    channel->bufend = r->dsize;
+    return 0;
+  }
+
+  /* copy the data in place, the ring can wrap */
+  __sync_synchronize();
+  count = MIN(available, size);
+  if(buf != NULL)
+  {
+    first = MIN(count, RING_SIZE - (tail & RING_MASK));
+    memcpy(buf, RING_DATA(r) + (tail & RING_MASK), first);
+    memcpy(buf + first, RING_DATA(r), count - first);
+  }
+
+  /* release the space */
+  __sync_synchronize();
+  r->tail = tail + count;
+  Signal(&r->wseq, &r->wwait);
+  return count;
+}
+
+int32_t RingWrite(struct ChannelDesc *channel, int n, const char *buf, int32_t size)
+{
+  struct Ring *r = RING(channel, n);
+  int32_t done = 0;
+
+  while(done < size && !IS_CANCELLED(CH_FILE(channel, n)))
+  {
+    uint64_t head = r->head;
+    uint64_t space;
+    uint32_t seq;
+    int32_t count;
+    int32_t first;
+
+    /* wait for the space or the stream cancellation */
+    seq = r->wseq;
+    __sync_synchronize();
+    if(r->cancel)
+    {
+      ZLOGS(LOG_DEBUG, "%s;%d cancelled by the reader", channel->alias, n);
+      CH_FLAGS(channel, n) |= FLAG_CANCEL_MASK;
+      break;
+    }
+    space = RING_SIZE - (head - r->tail);
+    if(space == 0)
+    {
+      Sleep(channel, n, &r->wseq, &r->wwait, seq, r->rpid);
+      continue;
+    }
+
+    /* copy the data, the ring can wrap */
+    count = MIN(space, size - done);
+    first = MIN(count, RING_SIZE - (head & RING_MASK));
+    memcpy(RING_DATA(r) + (head & RING_MASK), buf + done, first);
+    memcpy(RING_DATA(r), buf + done + first, count - first);
+
+    /* publish it */
+    __sync_synchronize();
+    r->head = head + count;
+    Signal(&r->rseq, &r->rwait);
+    done += count;
+  }
+
+  return size;
+}
+
+void RingSync(struct ChannelDesc *channel, int n)
+{
+  int32_t result;
+
+  if(!CH_SEQ_READABLE(channel)) return;
+
+  while(CH_CONN(channel, n)->pos < channel->getpos && !channel->eof)
+  {
+    result = RingRead(channel, n, NULL,
+        MIN(channel->getpos - CH_CONN(channel, n)->pos, RING_SIZE));
+    if(result == 0) channel->eof = 1;
+    CH_CONN(channel, n)->pos += result;
+  }
+
+  ZLOGFAIL(CH_CONN(channel, n)->pos != channel->getpos,
+      EPIPE, "%s;%d is out of sync", channel->alias, n);
+}
+
+char *RingDigest(struct ChannelDesc *channel, int n)
+{
+  return RING(channel, n)->digest;
+}
+
+void RingDtor(struct ChannelDesc *channel, int n)
+{
+  struct Ring *r;
+
+  /* skip source closing if session is broken */
+  if(GetExitCode() != 0) return;
+
+  assert(channel != NULL);
+  assert(n < channel->source->len);
+  ZLOGS(LOG_DEBUG, "closing %s;%d", channel->alias, n);
+
+  /* WO source: EOF with the digest follows the data */
+  if(IS_WO(channel) && !IS_CANCELLED(CH_FILE(channel, n)))
+  {
+    r = RING(channel, n);
+    if(channel->tag != NULL)
+    {
+      TagDigest(channel->tag, r->digest);
+      r->dsize = TAG_DIGEST_SIZE;
+    }
+    __sync_synchronize();
+    r->eof = 1;
+    Signal(&r->rseq, &r->rwait);
+    CountPut(CH_CONN(channel, n), 0);
+  }
+  /*
+   * RO source: cancel the rest of data to release the writer at once. the
+   * writer which did not pass the ring yet is not waited for
+   */
+  else if(IS_RO(channel))
+  {
+    struct pollfd peer = {0};
+
+    peer.fd = GPOINTER_TO_INT(CH_BACKUP(channel, n));
+    peer.events = POLLIN;
+    if(CH_BACKUP(channel, n) != NULL && poll(&peer, 1, 0) != 1)
+    {
+      close(peer.fd);
+      CH_HANDLE(channel, n) = NULL;
+      CH_BACKUP(channel, n) = NULL;
+      channel->eof = 1;
+      return;
+    }
+
+    Accept(channel, n);
+    r = RING(channel, n);
+    if(!r->eof)
+    {
+      ZLOGS(LOG_DEBUG, "%s;%d cancelled", channel->alias, n);
+      r->cancel = 1;
+      Signal(&r->wseq, &r->wwait);
+    }
+    channel->eof = 1;
+  }
+
+  munmap(CH_HANDLE(channel, n), RING_HEADER + RING_SIZE);
+  CH_HANDLE(channel, n) = NULL;
+  ZLOGS(LOG_DEBUG, "%s;%d closed", channel->alias, n);
+}
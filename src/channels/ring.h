@@ -0,0 +1,54 @@
+/*
+ * shared memory ring sources ("ipc" protocol) for the nodes running on
+ * the same host
+ *
+ * Copyright (c) 2013, LiteStack, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RING_H_
+#define RING_H_
+
+#include "src/channels/channel.h"
+
+EXTERN_C_BEGIN
+
+/*
+ * mount the ring source: RO source binds the local rendezvous socket
+ * (its key goes to the name service as the port), WO source creates the
+ * ring and passes it to the bound peer
+ */
+void RingCtor(struct ChannelDesc *channel, int n);
+
+/* send EOF (WO) or skip the rest of data (RO) and unmount the source */
+void RingDtor(struct ChannelDesc *channel, int n);
+
+/*
+ * read up to "size" bytes from the ring directly to "buf" (NULL to skip
+ * the data). return the read size or 0 upon EOF
+ */
+int32_t RingRead(struct ChannelDesc *channel, int n, char *buf, int32_t size);
+
+/* write "size" bytes to the ring, wait while it is full */
+int32_t RingWrite(struct ChannelDesc *channel, int n, const char *buf, int32_t size);
+
+/* skip the data until the source will be in sync with the channel position */
+void RingSync(struct ChannelDesc *channel, int n);
+
+/* return the EOF digest of the source */
+char *RingDigest(struct ChannelDesc *channel, int n);
+
+EXTERN_C_END
+
+#endif /* RING_H_ */
@@ -254,18 +254,22 @@ NORETURN void CreateSession(struct NaClApp *nap)
 
   assert(nap != NULL);
 
-  /* set up user stack */
-  stack_ptr = nap->mem_start + ((uintptr_t)1U << nap->addr_bits);
-  stack_ptr -= STACK_USER_DATA_SIZE;
-  memset((void*)stack_ptr, 0, STACK_USER_DATA_SIZE);
-  ((uint32_t*)stack_ptr)[4] = 1;
-  ((uint32_t*)stack_ptr)[5] = 0xfffffff0;
+  /* the restored session already has the user stack and context */
+  if(nacl_user->prog_ctr == 0)
+  {
+    /* set up user stack */
+    stack_ptr = nap->mem_start + ((uintptr_t)1U << nap->addr_bits);
+    stack_ptr -= STACK_USER_DATA_SIZE;
+    memset((void*)stack_ptr, 0, STACK_USER_DATA_SIZE);
+    ((uint32_t*)stack_ptr)[4] = 1;
+    ((uint32_t*)stack_ptr)[5] = 0xfffffff0;
+    ThreadContextCtor(nacl_user, nap, nap->initial_entry_pt, stack_ptr);
+  }
 
   /*
-   * construct "nacl_user" and "nacl_sys" globals
+   * construct "nacl_sys" global
    * note: nacl_sys->prog_ctr meaningless but should not be 0
    */
-  ThreadContextCtor(nacl_user, nap, nap->initial_entry_pt, stack_ptr);
   ThreadContextCtor(nacl_sys, nap, 1, GetStackPtr());
 
   /* pass control to the user side */
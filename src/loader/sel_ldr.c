@@ -214,7 +214,7 @@ void NaClAppCtor(struct NaClApp *nap)
   nap->stack_size = NACL_DEFAULT_STACK_MAX;
 
   gnap = nap;
-  nacl_user = g_malloc(sizeof *nacl_user);
+  nacl_user = g_malloc0(sizeof *nacl_user);
   nacl_sys = g_malloc(sizeof *nacl_sys);
 }
 
@@ -16,6 +16,7 @@
 
 #include <assert.h>
 #include <time.h>
+#include <sys/resource.h>
 #include "src/loader/sel_ldr.h"
 #include "src/main/accounting.h"
 #include "src/main/manifest.h"
@@ -26,6 +27,8 @@ static int64_t network_stats[LimitsNumber] = {0};
 static int64_t local_stats[LimitsNumber] = {0};
 static float user_time = 0;
 static float sys_time = 0;
+static int64_t resident = 0; /* resident memory size in bytes */
+static int64_t resident_peak = 0; /* peak resident memory size in bytes */
 
 /* count i/o statistics */
 static void CountBytes(struct Connection *c, int size, int index)
@@ -74,16 +77,37 @@ static void SystemAccounting()
   fclose(f);
 }
 
+/* get the current and the peak resident memory sizes */
+static void MemoryAccounting()
+{
+  struct rusage usage;
+  FILE *f;
+  long pages;
+
+  f = fopen("/proc/self/statm", "r");
+  if(f != NULL)
+  {
+    if(fscanf(f, "%*d %ld", &pages) == 1)
+      resident = (int64_t)pages * sysconf(_SC_PAGESIZE);
+    fclose(f);
+  }
+
+  if(getrusage(RUSAGE_SELF, &usage) == 0)
+    resident_peak = (int64_t)usage.ru_maxrss * 1024;
+}
+
 /* returns string i/o statistics */
 static char *Accounting(int fast)
 {
-  return g_strdup_printf("%.2f %.2f %ld %ld %ld %ld %ld %ld %ld %ld",
+  MemoryAccounting();
+  return g_strdup_printf("%.2f %.2f %ld %ld %ld %ld %ld %ld %ld %ld %ld %ld",
       fast ? 0 : sys_time /* TODO(d'b): put I/O time instead of 0 */,
       fast ? clock() / (float)CLOCKS_PER_SEC : user_time,
       local_stats[GetsLimit], local_stats[GetSizeLimit],
       local_stats[PutsLimit], local_stats[PutSizeLimit],
       network_stats[GetsLimit], network_stats[GetSizeLimit],
-      network_stats[PutsLimit], network_stats[PutSizeLimit]);
+      network_stats[PutsLimit], network_stats[PutSizeLimit],
+      resident, resident_peak);
 }
 
 char *FastAccounting()
@@ -28,13 +28,14 @@ void CountGet(struct Connection *c, int size);
 void CountPut(struct Connection *c, int size);
 
 /*
- * returns string with intermediate time and i/o statistics
+ * returns string with intermediate time, i/o statistics and memory usage
+ * (the current and the peak resident sizes)
  * WARNING: returned string should be deallocated with g_free
  */
 char *FastAccounting();
 
 /*
- * returns string with final time and i/o statistics
+ * returns string with final time, i/o statistics and memory usage
  * WARNING: returned string should be deallocated with g_free
  * and the function should be called only once
  */
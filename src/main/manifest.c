@@ -1,9 +1,11 @@
 /*
  * the manifest file format: key = value. parser ignores white spaces
- * each line can only contain single key=value
+ * each line can only contain single key=value. the text is tokenized in
+ * place with a single pass, the fields point into the text until copied
+ * to the manifest structure
  *
- * the api is very simple: just call GetValuByKey() after
- * manifest is constructed
+ * the compiled manifest is the binary image of the parsed (and validated)
+ * manifest. it is loaded with a single read without parsing
  *
  * Copyright (c) 2012, LiteStack, Inc.
  *
@@ -24,6 +26,7 @@
  * manifest parser. input: manifest file name. output: manifest structure
  */
 #include <assert.h>
+#include <sched.h>
 #include <arpa/inet.h> /* convert ip to int */
 #include "src/main/manifest.h"
 #include "src/channels/channel.h"
@@ -33,16 +36,21 @@
 /* general */
 #define PTR_SIZE (sizeof(void*))
 #define MANIFEST_VERSION "20130611"
-#define MANIFEST_SIZE_LIMIT 0x80000
-#define MANIFEST_LINES_LIMIT 0x2000
+#define MANIFEST_LINES_LIMIT 0x100000
 #define MANIFEST_TOKENS_LIMIT 0x10
+#define COMPILED_MAGIC 0x464d565a /* "ZVMF" */
+#define COMPILED_VERSION 4
+#define COMPILED_SIZE_LIMIT (4 * MANIFEST_SIZE_LIMIT)
+#define NO_STRING UINT32_MAX /* NULL string in the compiled manifest */
 
 /* delimiters */
-#define LINE_DELIMITER "\n"
-#define KEY_DELIMITER "="
-#define VALUE_DELIMITER ","
-#define TOKEN_DELIMITER ";"
-#define CONNECTION_DELIMITER ":"
+#define LINE_DELIMITER '\n'
+#define KEY_DELIMITER '='
+#define VALUE_DELIMITER ','
+#define TOKEN_DELIMITER ';'
+#define CONNECTION_DELIMITER ':'
+#define RANGE_DELIMITER '-'
+#define NUMA_NODES_LIMIT 64
 
 #define XARRAY(a) static char *ARRAY_##a[] = {a};
 #define X(a) #a,
@@ -60,6 +68,8 @@ typedef enum {
 typedef enum {
   MemorySize,
   MemoryTag,
+  MemoryPages,
+  MemoryPrefault,
   MemoryTokensNumber
 } MemoryTokens;
 
@@ -71,6 +81,23 @@ typedef enum {
   ConnectionTokensNumber
 } ConnectionTokens;
 
+/* name server tokens */
+typedef enum {
+  NameServerUrl,
+  NameServerCluster,
+  NameServerNodes,
+  NameServerTokensNumber
+} NameServerTokens;
+
+/* job tokens */
+typedef enum {
+  JobSocket,
+  JobPool,
+  JobLimit,
+  JobQueue,
+  JobTokensNumber
+} JobTokens;
+
 /* channel tokens */
 typedef enum {
   Name,
@@ -81,12 +108,21 @@ typedef enum {
   GetSize,
   Puts,
   PutSize,
+  Resident,
   ChannelTokensNumber
 } ChannelTokens;
 
+/* broadcast tokens */
+typedef enum {
+  BroadcastAlias,
+  BroadcastName,
+  BroadcastTokensNumber
+} BroadcastTokens;
+
 /* (x-macro): manifest keywords (name, obligatory, singleton) */
 #define KEYWORDS \
   X(Channel, 1, 0) \
+  X(Broadcast, 0, 0) \
   X(Version, 1, 1) \
   X(Program, 1, 1) \
   X(Memory, 1, 1) \
@@ -94,7 +130,10 @@ typedef enum {
   X(NameServer, 0, 1) \
   X(Node, 0, 1) \
   X(Job, 0, 1) \
-  X(Etag, 0, 1)
+  X(Save, 0, 1) \
+  X(Etag, 0, 1) \
+  X(Affinity, 0, 1) \
+  X(Numa, 0, 1)
 
 /* (x-macro): manifest enumeration, array and statistics */
 #define XENUM(a) enum ENUM_##a {a};
@@ -117,14 +156,54 @@ typedef enum {
  */
 static int cline = 0;
 
-/* get manifest data */
-static void GetManifestData(const char *name, char *buf)
+/* compiled manifest header (host byte order) */
+struct CompiledHeader
+{
+  uint32_t magic;
+  uint32_t version; /* COMPILED_VERSION */
+  uint32_t size; /* body size */
+  uint32_t reserved;
+};
+
+/*
+ * get manifest data with a single read. return the buffer (should be
+ * freed) with the terminating zero appended, update "size"
+ */
+static char *GetManifestData(const char *name, int64_t *size)
+{
+  struct stat st;
+  char *buf;
+  int h;
+
+  h = open(name, O_RDONLY);
+  ZLOGFAIL(h < 0, ENOENT, "manifest open error");
+  ZLOGFAIL(fstat(h, &st) != 0 || st.st_size < 1, EIO, "manifest read error");
+  ZLOGFAIL(st.st_size > COMPILED_SIZE_LIMIT, EFAULT, "manifest is too large");
+
+  buf = g_malloc(st.st_size + 1);
+  *size = read(h, buf, st.st_size);
+  ZLOGFAIL(*size != st.st_size, EIO, "manifest read error");
+  buf[*size] = '\0';
+  close(h);
+  return buf;
+}
+
+/*
+ * split "s" in place to the tokens separated by "delimiter" and put them to
+ * "tokens". the last of "limit" tokens gets the rest of the string. return
+ * the tokens number (at least 1)
+ */
+static int Split(char *s, char delimiter, char **tokens, int limit)
 {
-  FILE *h = fopen(name, "r");
+  int n = 0;
 
-  ZLOGFAIL(h == NULL, ENOENT, "manifest open error");
-  ZLOGFAIL(fread(buf, 1, MANIFEST_SIZE_LIMIT, h) < 1, EIO, "manifest read error");
-  fclose(h);
+  tokens[n++] = s;
+  while(n < limit && (s = strchr(s, delimiter)) != NULL)
+  {
+    *s++ = '\0';
+    tokens[n++] = s;
+  }
+  return n;
 }
 
 int64_t ToInt(char *a)
@@ -167,25 +246,32 @@ static void Program(struct Manifest *manifest, char *value)
   manifest->program = g_strdup(g_strstrip(value));
 }
 
-/* set mem_size and mem_tag field */
+/* set mem_size, mem_tag, mem_pages and mem_prefault fields */
 static void Memory(struct Manifest *manifest, char *value)
 {
-  char **tokens;
+  char *tokens[MemoryTokensNumber] = {NULL};
   int tag;
+  int n;
 
-  /* parse value */
-  tokens = g_strsplit(value, VALUE_DELIMITER, MemoryTokensNumber);
-  MFTFAIL(tokens[MemoryTokensNumber] != NULL || tokens[MemoryTag] == NULL,
-      EFAULT, "invalid memory token");
+  /* parse value (pages and prefault tokens are optional) */
+  n = Split(value, VALUE_DELIMITER, tokens, MemoryTokensNumber);
+  MFTFAIL(n < MemoryPages, EFAULT, "invalid memory token");
 
   manifest->mem_size = ToInt(tokens[MemorySize]);
   tag = ToInt(tokens[MemoryTag]);
+  manifest->mem_pages = n > MemoryPages ? ToInt(tokens[MemoryPages]) : 0;
+  manifest->mem_prefault = n > MemoryPrefault
+      ? ToInt(tokens[MemoryPrefault]) : 0;
 
   /* initialize manifest field */
   MFTFAIL(tag != 0 && tag != 1, EFAULT, "invalid memory etag token");
+  MFTFAIL(manifest->mem_pages < 0 || manifest->mem_pages > 2,
+      EFAULT, "invalid memory pages token");
+  MFTFAIL(manifest->mem_prefault < 0
+      || manifest->mem_prefault > manifest->mem_size,
+      EFAULT, "invalid memory prefault token");
 
   manifest->mem_tag = tag == 0 ? NULL : TagCtor();
-  g_strfreev(tokens);
 }
 
 static void Timeout(struct Manifest *manifest, char *value)
@@ -198,10 +284,43 @@ static void Node(struct Manifest *manifest, char *value)
   manifest->node = ToInt(value);
 }
 
+/* set job (daemon command socket), pool size, sessions limit and queue size */
 static void Job(struct Manifest *manifest, char *value)
 {
-  MFTFAIL(strlen(value) > UNIX_PATH_MAX, EFAULT, "too long Job name");
-  manifest->job = g_strdup(g_strstrip(value));
+  char *tokens[MANIFEST_TOKENS_LIMIT] = {NULL};
+  int n;
+
+  n = Split(value, VALUE_DELIMITER, tokens, MANIFEST_TOKENS_LIMIT);
+  MFTFAIL(*g_strstrip(tokens[JobSocket]) == '\0' || n > JobTokensNumber,
+      EFAULT, "invalid Job token");
+  MFTFAIL(strlen(tokens[JobSocket]) > UNIX_PATH_MAX, EFAULT, "too long Job name");
+  manifest->job = g_strdup(tokens[JobSocket]);
+
+  /* optional: number of pre-forked children */
+  if(n > JobPool)
+  {
+    manifest->pool = ToInt(tokens[JobPool]);
+    MFTFAIL(manifest->pool < 0, EFAULT, "invalid Job pool size");
+  }
+
+  /* optional: number of concurrent sessions (0 - number of cores) */
+  if(n > JobLimit)
+  {
+    manifest->limit = ToInt(tokens[JobLimit]);
+    MFTFAIL(manifest->limit < 0, EFAULT, "invalid Job sessions limit");
+  }
+
+  /* optional: number of queued commands */
+  if(n > JobQueue)
+  {
+    manifest->queue = ToInt(tokens[JobQueue]);
+    MFTFAIL(manifest->queue < 0, EFAULT, "invalid Job queue size");
+  }
+}
+
+static void Save(struct Manifest *manifest, char *value)
+{
+  manifest->save = g_strdup(g_strstrip(value));
 }
 
 static void Etag(struct Manifest *manifest, char *value)
@@ -209,6 +328,57 @@ static void Etag(struct Manifest *manifest, char *value)
   manifest->etag = g_strdup(g_strstrip(value));
 }
 
+/* set cpus the session is bound to: cpu numbers or "first-last" ranges */
+static void Affinity(struct Manifest *manifest, char *value)
+{
+  char *tokens[MANIFEST_TOKENS_LIMIT] = {NULL};
+  char *range[2] = {NULL};
+  int n;
+  int i;
+
+  n = Split(value, VALUE_DELIMITER, tokens, MANIFEST_TOKENS_LIMIT);
+  manifest->cpus = g_array_new(FALSE, FALSE, sizeof(int));
+  for(i = 0; i < n; ++i)
+  {
+    int first;
+    int last;
+
+    if(Split(tokens[i], RANGE_DELIMITER, range, 2) == 1) range[1] = range[0];
+    first = ToInt(range[0]);
+    last = ToInt(range[1]);
+    MFTFAIL(first < 0 || last < first || last >= CPU_SETSIZE,
+        EFAULT, "invalid Affinity token");
+    for(; first <= last; ++first)
+      g_array_append_val(manifest->cpus, first);
+  }
+}
+
+/* set NUMA policy ("bind" or "interleave") and the nodes list */
+static void Numa(struct Manifest *manifest, char *value)
+{
+  char *tokens[MANIFEST_TOKENS_LIMIT] = {NULL};
+  char *policy;
+  int n;
+  int i;
+
+  n = Split(value, VALUE_DELIMITER, tokens, MANIFEST_TOKENS_LIMIT);
+  policy = g_strstrip(tokens[0]);
+  if(strcmp(policy, "bind") == 0)
+    manifest->numa = NumaBind;
+  else if(strcmp(policy, "interleave") == 0)
+    manifest->numa = NumaInterleave;
+  else
+    MFTFAIL(1, EFAULT, "invalid Numa policy %s", policy);
+  MFTFAIL(n < 2, EFAULT, "Numa nodes are not specified");
+
+  for(i = 1; i < n; ++i)
+  {
+    int64_t node = ToInt(tokens[i]);
+    MFTFAIL(node < 0 || node >= NUMA_NODES_LIMIT, EFAULT, "invalid Numa node");
+    manifest->numa_nodes |= 1LLU << node;
+  }
+}
+
 /* convert ip address (or node id) to integer */
 static uint32_t ExtractHost(char *host, uint8_t *flags)
 {
@@ -241,19 +411,20 @@ static XTYPE(PROTOCOLS) GetChannelProtocol(char *proto)
 }
 
 /* parse the name and append to given array of names as connection or string */
-static void ParseName(char *name, GPtrArray *names)
+void ParseName(char *name, GPtrArray *names)
 {
-  char **tokens;
+  char *tokens[ConnectionTokensNumber] = {NULL};
   XTYPE(PROTOCOLS) proto;
+  int n;
 
   name = g_strstrip(name);
-  tokens = g_strsplit(name, CONNECTION_DELIMITER, ConnectionTokensNumber);
+  n = Split(name, CONNECTION_DELIMITER, tokens, ConnectionTokensNumber);
   proto = GetChannelProtocol(tokens[Protocol]);
 
   if(proto == -1)
   {
     struct File *f;
-    MFTFAIL(tokens[1] != NULL, EFAULT, "invalid channel name");
+    MFTFAIL(n > 1, EFAULT, "invalid channel name");
     MFTFAIL(!g_path_is_absolute(name), EFAULT,
         "only absolute path channels are allowed");
 
@@ -267,8 +438,7 @@ static void ParseName(char *name, GPtrArray *names)
   else
   {
     struct Connection *c = g_malloc0(sizeof *c);
-    MFTFAIL(tokens[ConnectionTokensNumber] != NULL || tokens[Host] == NULL,
-        EFAULT, "invalid channel url");
+    MFTFAIL(n != ConnectionTokensNumber, EFAULT, "invalid channel url");
 
     c->protocol = proto;
     c->host = ExtractHost(tokens[Host], &c->flags);
@@ -276,42 +446,73 @@ static void ParseName(char *name, GPtrArray *names)
     c->handle = NULL;
     g_ptr_array_add(names, c);
   }
-
-  g_strfreev(tokens);
 }
 
 /* TODO(d'b): it is ugly. solution needed */
-static void NameServer(struct Manifest *manifest, char *value)
+void ParseNameServer(struct Manifest *manifest, char *value)
 {
   GPtrArray *dummy = g_ptr_array_new();
-  ParseName(value, dummy);
+  char *tokens[MANIFEST_TOKENS_LIMIT] = {NULL};
+  int n;
+
+  n = Split(value, VALUE_DELIMITER, tokens, MANIFEST_TOKENS_LIMIT);
+  MFTFAIL(n > NameServerTokensNumber, EFAULT, "invalid NameServer token");
+  ParseName(tokens[NameServerUrl], dummy);
   manifest->name_server = g_ptr_array_index(dummy, 0);
   g_ptr_array_free(dummy, TRUE);
+
+  /* tcp name server serves many clusters and needs the cluster id and size */
+  manifest->cluster = 0;
+  manifest->nodes = 0;
+  if(manifest->name_server->protocol == ProtoTCP)
+  {
+    MFTFAIL(n != NameServerTokensNumber, EFAULT,
+        "tcp NameServer needs cluster id and nodes number");
+    manifest->cluster = ToInt(tokens[NameServerCluster]);
+    manifest->nodes = ToInt(tokens[NameServerNodes]);
+    MFTFAIL(manifest->nodes < 1, EFAULT, "invalid NameServer nodes number");
+  }
+  else
+    MFTFAIL(n > NameServerCluster, EFAULT,
+        "cluster id is only supported by tcp NameServer");
+}
+
+static void NameServer(struct Manifest *manifest, char *value)
+{
+  ParseNameServer(manifest, value);
 }
 
 /* set channels field */
 static void Channel(struct Manifest *manifest, char *value)
 {
-  char **tokens;
-  char **names;
+  char *tokens[ChannelTokensNumber] = {NULL};
+  char *names[MANIFEST_TOKENS_LIMIT] = {NULL};
+  int n;
   int i;
   struct ChannelDesc *channel;
 
+  /* get tokens from channel description */
+  n = Split(value, VALUE_DELIMITER, tokens, ChannelTokensNumber);
+
+  /* TODO(d'b): fix "invalid numeric value ', 0'" bug here */
+  MFTFAIL(n <= PutSize, EFAULT, "invalid channel tokens number");
+
   /* allocate a new channel */
   channel = g_malloc0(sizeof *channel);
   channel->source = g_ptr_array_new();
 
-  /* get tokens from channel description */
-  tokens = g_strsplit(value, VALUE_DELIMITER, ChannelTokensNumber);
-
-  /* TODO(d'b): fix "invalid numeric value ', 0'" bug here */
-  MFTFAIL(tokens[ChannelTokensNumber] != NULL || tokens[PutSize] == NULL,
-      EFAULT, "invalid channel tokens number");
+  /* optional: daemon-resident channel */
+  if(n > Resident)
+  {
+    channel->resident = ToInt(tokens[Resident]);
+    MFTFAIL(channel->resident != 0 && channel->resident != 1,
+        EFAULT, "invalid channel resident token");
+  }
 
   /* parse alias and name(s) */
   channel->alias = g_strdup(g_strstrip(tokens[Alias]));
-  names = g_strsplit(tokens[Name], TOKEN_DELIMITER, MANIFEST_TOKENS_LIMIT);
-  for(i = 0; names[i] != NULL; ++i)
+  n = Split(tokens[Name], TOKEN_DELIMITER, names, MANIFEST_TOKENS_LIMIT);
+  for(i = 0; i < n; ++i)
     ParseName(names[i], channel->source);
 
   channel->type = ToInt(tokens[Type]);
@@ -330,8 +531,38 @@ static void Channel(struct Manifest *manifest, char *value)
 
   /* append a new channel */
   g_ptr_array_add(manifest->channels, channel);
-  g_strfreev(names);
-  g_strfreev(tokens);
+}
+
+/*
+ * set relay of the read only channel: the data read from the channel is
+ * written to the given network sources (broadcast tree node)
+ */
+static void Broadcast(struct Manifest *manifest, char *value)
+{
+  char *tokens[BroadcastTokensNumber] = {NULL};
+  char *names[MANIFEST_TOKENS_LIMIT] = {NULL};
+  int n;
+  int i;
+  struct ChannelDesc *relay;
+
+  MFTFAIL(Split(value, VALUE_DELIMITER, tokens, BroadcastTokensNumber)
+      != BroadcastTokensNumber, EFAULT, "invalid Broadcast tokens number");
+
+  /* relay is linked to the channel with the same alias when mounted */
+  relay = g_malloc0(sizeof *relay);
+  relay->source = g_ptr_array_new();
+  relay->alias = g_strdup(g_strstrip(tokens[BroadcastAlias]));
+  n = Split(tokens[BroadcastName], TOKEN_DELIMITER, names, MANIFEST_TOKENS_LIMIT);
+  for(i = 0; i < n; ++i)
+  {
+    ParseName(names[i], relay->source);
+    MFTFAIL(IS_FILE(CH_FILE(relay, i)), EFAULT,
+        "broadcast %s can only relay to network", relay->alias);
+  }
+
+  if(manifest->relays == NULL)
+    manifest->relays = g_ptr_array_new();
+  g_ptr_array_add(manifest->relays, relay);
 }
 
 /*
@@ -349,81 +580,451 @@ static void CheckCounters(int *counters, int n)
   }
 }
 
-struct Manifest *ManifestTextCtor(char *text)
+/* parse the manifest text in place (single pass), the text is modified */
+static struct Manifest *ParseText(char *text)
 {
   struct Manifest *manifest = g_malloc0(sizeof *manifest);
   int counters[XSIZE(KEYWORDS)] = {0};
-  char **lines;
-  int i;
+  char *tokens[KeyValueTokensNumber + 1] = {NULL};
+  char *line;
+  char *next;
 
-  /* initialize channels */
   manifest->channels = g_ptr_array_new();
 
-  /* extract all lines */
-  lines = g_strsplit(text, LINE_DELIMITER, MANIFEST_LINES_LIMIT);
-
-  /* parse each line */
-  for(i = 0; lines[i] != NULL; ++i)
+  /* parse each line with the single key=value */
+  for(cline = 1, line = text; line != NULL && cline <= MANIFEST_LINES_LIMIT;
+      ++cline, line = next)
   {
-    char **tokens;
-    cline = i + 1;
-
-    tokens = g_strsplit(lines[i], KEY_DELIMITER, MANIFEST_TOKENS_LIMIT);
-    if(strlen(lines[i]) > 0 && tokens[Key] != NULL
-        && tokens[Value] != NULL && tokens[KeyValueTokensNumber] == NULL)
-    {
-      /* switch invoking functions by the keyword */
+    next = strchr(line, LINE_DELIMITER);
+    if(next != NULL) *next++ = '\0';
+
+    if(Split(line, KEY_DELIMITER, tokens, KeyValueTokensNumber + 1)
+        != KeyValueTokensNumber) continue;
+
+    /* switch invoking functions by the keyword */
 #define XSWITCH(a) switch(GetKey(tokens[Key])) {a};
 #define X(a, o, s) case Key##a: ++counters[Key##a]; a(manifest, tokens[Value]); break;
-      XSWITCH(KEYWORDS)
+    XSWITCH(KEYWORDS)
 #undef X
-    }
-    g_strfreev(tokens);
   }
 
   /* check obligatory and singleton keywords */
-  g_strfreev(lines);
   CheckCounters(counters, XSIZE(KEYWORDS));
 
   return manifest;
 }
 
+struct Manifest *ManifestTextCtor(char *text)
+{
+  return ParseText(text);
+}
+
+/* check the channel (or relay) fields the text parser checks on the fly */
+static void CheckChannel(const struct ChannelDesc *channel)
+{
+  int i;
+
+  MFTFAIL(channel->type < SGetSPut || channel->type > RGetRPut, EFAULT,
+      "%s has invalid type %d", channel->alias, channel->type);
+  MFTFAIL(channel->resident != 0 && channel->resident != 1,
+      EFAULT, "invalid channel resident token");
+  MFTFAIL(channel->source->len < 1, EFAULT, "%s has no sources", channel->alias);
+  for(i = 0; i < LimitsNumber; ++i)
+    MFTFAIL(channel->limits[i] < 0, EFAULT,
+        "negative limits for %s", channel->alias);
+}
+
+/*
+ * check the manifest values: the checks of the text parser and the channels
+ * checks made when the channels are mounted (aliases, types, standard
+ * channels). the compiled manifest is checked when compiled and when loaded
+ */
+static void CheckValues(const struct Manifest *manifest)
+{
+  GHashTable *aliases = g_hash_table_new(g_str_hash, g_str_equal);
+  int i;
+
+  MFTFAIL(manifest->program == NULL, EFAULT, "Program not specified");
+  MFTFAIL(manifest->mem_pages < 0 || manifest->mem_pages > 2,
+      EFAULT, "invalid memory pages token");
+  MFTFAIL(manifest->mem_prefault < 0
+      || manifest->mem_prefault > manifest->mem_size,
+      EFAULT, "invalid memory prefault token");
+  MFTFAIL(manifest->pool < 0 || manifest->limit < 0 || manifest->queue < 0,
+      EFAULT, "invalid Job token");
+  MFTFAIL(manifest->job != NULL && strlen(manifest->job) > UNIX_PATH_MAX,
+      EFAULT, "too long Job name");
+  MFTFAIL(manifest->numa > NumaInterleave, EFAULT, "invalid Numa policy");
+  for(i = 0; manifest->cpus != NULL && i < manifest->cpus->len; ++i)
+    MFTFAIL((unsigned)g_array_index(manifest->cpus, int, i) >= CPU_SETSIZE,
+        EFAULT, "invalid Affinity token");
+  MFTFAIL(manifest->name_server != NULL
+      && manifest->name_server->protocol == ProtoTCP && manifest->nodes < 1,
+      EFAULT, "invalid NameServer nodes number");
+
+  /* channels: aliases should be unique, standard channels should be given */
+  for(i = 0; i < manifest->channels->len; ++i)
+  {
+    struct ChannelDesc *channel = CH_CH(manifest, i);
+
+    CheckChannel(channel);
+    MFTFAIL(g_hash_table_lookup(aliases, channel->alias) != NULL,
+        EFAULT, "%s is already allocated", channel->alias);
+    g_hash_table_insert(aliases, channel->alias, channel);
+  }
+  MFTFAIL(g_hash_table_lookup(aliases, STDIN) == NULL
+      || g_hash_table_lookup(aliases, STDOUT) == NULL
+      || g_hash_table_lookup(aliases, STDERR) == NULL,
+      EFAULT, "missing standard channels in manifest");
+
+  /* relays: to the network only, from the existing channels */
+  for(i = 0; manifest->relays != NULL && i < manifest->relays->len; ++i)
+  {
+    struct ChannelDesc *relay = g_ptr_array_index(manifest->relays, i);
+    int j;
+
+    MFTFAIL(g_hash_table_lookup(aliases, relay->alias) == NULL,
+        EFAULT, "no channel to broadcast %s", relay->alias);
+    for(j = 0; j < relay->source->len; ++j)
+      MFTFAIL(IS_FILE(CH_FILE(relay, j)), EFAULT,
+          "broadcast %s can only relay to network", relay->alias);
+  }
+
+  g_hash_table_destroy(aliases);
+}
+
+/* append 32-bit number to the compiled manifest */
+static void Put32(GByteArray *buf, uint32_t a)
+{
+  g_byte_array_append(buf, (uint8_t*)&a, sizeof a);
+}
+
+/* append 64-bit number to the compiled manifest */
+static void Put64(GByteArray *buf, uint64_t a)
+{
+  g_byte_array_append(buf, (uint8_t*)&a, sizeof a);
+}
+
+/* append the string (32-bit length and the string itself) */
+static void PutString(GByteArray *buf, const char *s)
+{
+  Put32(buf, s == NULL ? NO_STRING : strlen(s));
+  if(s != NULL)
+    g_byte_array_append(buf, (uint8_t*)s, strlen(s));
+}
+
+/* append the channel source */
+static void PutSource(GByteArray *buf, const struct Connection *c)
+{
+  Put32(buf, c->protocol);
+  Put32(buf, c->flags);
+  if(IS_FILE(c))
+    PutString(buf, ((struct File*)c)->name);
+  else
+  {
+    Put32(buf, c->host);
+    Put32(buf, c->port);
+  }
+}
+
+/* append the channel: alias, type, tag, resident, limits and sources */
+static void PutChannel(GByteArray *buf, const struct ChannelDesc *channel)
+{
+  int i;
+
+  PutString(buf, channel->alias);
+  Put32(buf, channel->type);
+  Put32(buf, channel->tag != NULL);
+  Put32(buf, channel->resident);
+  for(i = 0; i < LimitsNumber; ++i)
+    Put64(buf, channel->limits[i]);
+  Put32(buf, channel->source->len);
+  for(i = 0; i < channel->source->len; ++i)
+    PutSource(buf, g_ptr_array_index(channel->source, i));
+}
+
+void ManifestCompile(const struct Manifest *manifest, const char *name)
+{
+  struct CompiledHeader header = {COMPILED_MAGIC, COMPILED_VERSION};
+  GByteArray *buf = g_byte_array_new();
+  int relays = manifest->relays == NULL ? 0 : manifest->relays->len;
+  int h;
+  int i;
+
+  /* only the valid manifest is compiled */
+  cline = 0;
+  CheckValues(manifest);
+
+  /* reserve the header */
+  g_byte_array_append(buf, (uint8_t*)&header, sizeof header);
+
+  /* strings, numbers, name server, channels and relays */
+  PutString(buf, manifest->program);
+  PutString(buf, manifest->etag);
+  PutString(buf, manifest->job);
+  PutString(buf, manifest->save);
+  PutString(buf, manifest->save == NULL ? NULL : manifest->text);
+  Put32(buf, manifest->node);
+  Put32(buf, manifest->pool);
+  Put32(buf, manifest->limit);
+  Put32(buf, manifest->queue);
+  Put32(buf, manifest->timeout);
+  Put64(buf, manifest->mem_size);
+  Put32(buf, manifest->mem_tag != NULL);
+  Put32(buf, manifest->mem_pages);
+  Put64(buf, manifest->mem_prefault);
+  Put32(buf, manifest->cpus == NULL ? 0 : manifest->cpus->len);
+  for(i = 0; manifest->cpus != NULL && i < manifest->cpus->len; ++i)
+    Put32(buf, g_array_index(manifest->cpus, int, i));
+  Put32(buf, manifest->numa);
+  Put64(buf, manifest->numa_nodes);
+  Put64(buf, manifest->cluster);
+  Put32(buf, manifest->nodes);
+  Put32(buf, manifest->name_server != NULL);
+  if(manifest->name_server != NULL)
+    PutSource(buf, manifest->name_server);
+  Put32(buf, manifest->channels->len);
+  for(i = 0; i < manifest->channels->len; ++i)
+    PutChannel(buf, g_ptr_array_index(manifest->channels, i));
+  Put32(buf, relays);
+  for(i = 0; i < relays; ++i)
+    PutChannel(buf, g_ptr_array_index(manifest->relays, i));
+
+  /* update the header and write the compiled manifest */
+  header.size = buf->len - sizeof header;
+  memcpy(buf->data, &header, sizeof header);
+  h = open(name, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP);
+  ZLOGFAIL(h < 0 || write(h, buf->data, buf->len) != buf->len, EIO,
+      "cannot write compiled manifest %s: %s", name, strerror(errno));
+  close(h);
+  g_byte_array_free(buf, TRUE);
+}
+
+/* read 32-bit number from the compiled manifest */
+static uint32_t Get32(uint8_t **p, uint8_t *end)
+{
+  uint32_t result;
+
+  MFTFAIL(*p + sizeof result > end, EFAULT, "malformed compiled manifest");
+  memcpy(&result, *p, sizeof result);
+  *p += sizeof result;
+  return result;
+}
+
+/* read 64-bit number from the compiled manifest */
+static uint64_t Get64(uint8_t **p, uint8_t *end)
+{
+  uint64_t result;
+
+  MFTFAIL(*p + sizeof result > end, EFAULT, "malformed compiled manifest");
+  memcpy(&result, *p, sizeof result);
+  *p += sizeof result;
+  return result;
+}
+
+/* read the string from the compiled manifest. should be freed */
+static char *GetString(uint8_t **p, uint8_t *end)
+{
+  uint32_t len = Get32(p, end);
+  char *result;
+
+  if(len == NO_STRING) return NULL;
+  MFTFAIL(len > end - *p, EFAULT, "malformed compiled manifest");
+  result = g_strndup((char*)*p, len);
+  *p += len;
+  return result;
+}
+
+/* read the channel source */
+static void *GetSource(uint8_t **p, uint8_t *end)
+{
+  uint32_t protocol = Get32(p, end);
+  uint32_t flags = Get32(p, end);
+  struct Connection *c;
+  struct File *f;
+
+  MFTFAIL(protocol >= XSIZE(PROTOCOLS), EFAULT, "malformed compiled manifest");
+  if(protocol >= ProtoRegular)
+  {
+    f = g_malloc0(sizeof *f);
+    f->protocol = protocol;
+    f->flags = flags;
+    f->name = GetString(p, end);
+    MFTFAIL(f->name == NULL, EFAULT, "malformed compiled manifest");
+    return f;
+  }
+
+  c = g_malloc0(sizeof *c);
+  c->protocol = protocol;
+  c->flags = flags;
+  c->host = Get32(p, end);
+  c->port = Get32(p, end);
+  return c;
+}
+
+/* read the channel */
+static struct ChannelDesc *GetChannel(uint8_t **p, uint8_t *end)
+{
+  struct ChannelDesc *channel = g_malloc0(sizeof *channel);
+  uint32_t n;
+  int i;
+
+  channel->alias = GetString(p, end);
+  MFTFAIL(channel->alias == NULL, EFAULT, "malformed compiled manifest");
+  channel->type = Get32(p, end);
+  channel->tag = Get32(p, end) == 0 ? NULL : TagCtor();
+  channel->resident = Get32(p, end);
+  for(i = 0; i < LimitsNumber; ++i)
+    channel->limits[i] = Get64(p, end);
+
+  n = Get32(p, end);
+  MFTFAIL(n > end - *p, EFAULT, "malformed compiled manifest");
+  channel->source = g_ptr_array_sized_new(n);
+  for(i = 0; i < n; ++i)
+    g_ptr_array_add(channel->source, GetSource(p, end));
+  return channel;
+}
+
+/*
+ * construct the manifest from the compiled one. the compiled manifest was
+ * validated when compiled, it is checked again (the file can be damaged)
+ */
+static struct Manifest *CompiledCtor(uint8_t *buf, int64_t size)
+{
+  struct Manifest *manifest = g_malloc0(sizeof *manifest);
+  struct CompiledHeader *header = (struct CompiledHeader*)buf;
+  uint8_t *end = buf + size;
+  uint8_t *p = buf + sizeof *header;
+  uint32_t n;
+  int i;
+
+  cline = 0;
+  MFTFAIL(header->version != COMPILED_VERSION, EFAULT,
+      "unsupported compiled manifest version %u", header->version);
+  MFTFAIL(header->size != size - sizeof *header, EFAULT,
+      "malformed compiled manifest");
+
+  manifest->program = GetString(&p, end);
+  manifest->etag = GetString(&p, end);
+  manifest->job = GetString(&p, end);
+  manifest->save = GetString(&p, end);
+  manifest->text = GetString(&p, end);
+  manifest->node = Get32(&p, end);
+  manifest->pool = Get32(&p, end);
+  manifest->limit = Get32(&p, end);
+  manifest->queue = Get32(&p, end);
+  manifest->timeout = Get32(&p, end);
+  manifest->mem_size = Get64(&p, end);
+  manifest->mem_tag = Get32(&p, end) == 0 ? NULL : TagCtor();
+  manifest->mem_pages = Get32(&p, end);
+  manifest->mem_prefault = Get64(&p, end);
+  n = Get32(&p, end);
+  MFTFAIL(n > CPU_SETSIZE, EFAULT, "malformed compiled manifest");
+  if(n > 0)
+    manifest->cpus = g_array_sized_new(FALSE, FALSE, sizeof(int), n);
+  for(i = 0; i < n; ++i)
+  {
+    int cpu = Get32(&p, end);
+    g_array_append_val(manifest->cpus, cpu);
+  }
+  manifest->numa = Get32(&p, end);
+  manifest->numa_nodes = Get64(&p, end);
+  manifest->cluster = Get64(&p, end);
+  manifest->nodes = Get32(&p, end);
+  if(Get32(&p, end) != 0)
+    manifest->name_server = GetSource(&p, end);
+
+  n = Get32(&p, end);
+  MFTFAIL(n > end - p, EFAULT, "malformed compiled manifest");
+  manifest->channels = g_ptr_array_sized_new(n);
+  for(i = 0; i < n; ++i)
+    g_ptr_array_add(manifest->channels, GetChannel(&p, end));
+
+  n = Get32(&p, end);
+  MFTFAIL(n > end - p, EFAULT, "malformed compiled manifest");
+  if(n > 0)
+    manifest->relays = g_ptr_array_sized_new(n);
+  for(i = 0; i < n; ++i)
+    g_ptr_array_add(manifest->relays, GetChannel(&p, end));
+
+  MFTFAIL(p != end, EFAULT, "malformed compiled manifest");
+  CheckValues(manifest);
+  return manifest;
+}
+
 struct Manifest *ManifestCtor(const char *name)
 {
-  char buf[MANIFEST_SIZE_LIMIT] = {0};
-  GetManifestData(name, buf);
-  return ManifestTextCtor(buf);
+  struct Manifest *manifest;
+  int64_t size;
+  char *buf = GetManifestData(name, &size);
+
+  /* compiled manifest */
+  if(size >= sizeof(struct CompiledHeader)
+      && ((struct CompiledHeader*)buf)->magic == COMPILED_MAGIC)
+    manifest = CompiledCtor((uint8_t*)buf, size);
+
+  /*
+   * text manifest is parsed in the copy of the read buffer. the original
+   * text is only kept for the session image (if "Save" is given)
+   */
+  else
+  {
+    char *text;
+
+    ZLOGFAIL(size > MANIFEST_SIZE_LIMIT, EFAULT, "manifest is too large");
+    text = g_strdup(buf);
+    manifest = ParseText(text);
+    g_free(text);
+    if(manifest->save != NULL)
+      manifest->text = buf;
+  }
+
+  if(manifest->text != buf)
+    g_free(buf);
+  return manifest;
+}
+
+/* free the channel and its sources */
+static void ChannelFree(struct ChannelDesc *channel)
+{
+  int i;
+
+  for(i = 0; i < channel->source->len; ++i)
+  {
+    struct File *file = g_ptr_array_index(channel->source, i);
+    if(IS_FILE(file))
+      g_free(file->name);
+    g_free(file);
+  }
+  g_ptr_array_free(channel->source, TRUE);
+  g_free(channel->alias);
+  TagDtor(channel->tag);
+  g_free(channel);
 }
 
 void ManifestDtor(struct Manifest *manifest)
 {
   int i;
-  int j;
 
   if(manifest == NULL) return;
 
   /* channels */
   for(i = 0; i < manifest->channels->len; ++i)
-  {
-    struct ChannelDesc *channel = g_ptr_array_index(manifest->channels, i);
-
-    /* sources */
-    for(j = 0; j < channel->source->len; ++j)
-    {
-      struct File *file = g_ptr_array_index(channel->source, j);
-      if(IS_FILE(file))
-        g_free(file->name);
-      g_free(file);
-    }
-    g_ptr_array_free(channel->source, TRUE);
-    g_free(channel->alias);
-    TagDtor(channel->tag);
-    g_free(channel);
-  }
+    ChannelFree(g_ptr_array_index(manifest->channels, i));
   g_ptr_array_free(manifest->channels, TRUE);
 
+  /* broadcast relays */
+  for(i = 0; manifest->relays != NULL && i < manifest->relays->len; ++i)
+    ChannelFree(g_ptr_array_index(manifest->relays, i));
+  if(manifest->relays != NULL)
+    g_ptr_array_free(manifest->relays, TRUE);
+
   /* other */
   g_free(manifest->etag);
+  g_free(manifest->save);
+  if(manifest->cpus != NULL)
+    g_array_free(manifest->cpus, TRUE);
+  g_free(manifest->text);
   TagDtor(manifest->mem_tag);
   g_free(manifest->name_server);
   g_free(manifest->program);
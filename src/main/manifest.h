@@ -57,13 +57,16 @@ EXTERN_C_BEGIN
  * 0:    id/ip. 0 means id specified by "Channel" field, 1 - ip4
  * 1..2: r/w source type: 0 - inaccessible, 1 - RO, 2 - WO, 3 - RW
  * 3:    0 means channel is valid, 1 - invalid
+ * 4:    1 means the reader cancelled the stream (WO network source)
  */
-/* network channel description */
+/* network channel description (the fields up to "rate" are common with File) */
 struct Connection {
   uint8_t protocol; /* XTYPE(PROTOCOLS) */
   void *handle; /* pointer to (0mq) socket */
   int64_t pos; /* position */
   uint8_t flags;
+  int64_t latency; /* EWMA of the chunk read time (ns) */
+  int64_t rate; /* EWMA of the read throughput (bytes per second) */
   uint16_t port;
   uint32_t host;
   void *backup; /* for udt it is stored original handle */
@@ -75,6 +78,8 @@ struct File {
   void *handle; /* (int*) or (FILE*) */
   int64_t pos; /* position */
   uint8_t flags;
+  int64_t latency; /* EWMA of the chunk read time (ns) */
+  int64_t rate; /* EWMA of the read throughput (bytes per second) */
   char *name;
 };
 
@@ -87,42 +92,86 @@ struct ChannelDesc {
   void *tag; /* tag context */
   int64_t limits[LimitsNumber];
   int8_t eof;
+  int8_t resident; /* daemon keeps the channel mounted for its children */
+  struct ChannelDesc *relay; /* broadcast: forwards the data read */
 
   /* constructor initialize it */
   void *msg; /* network message container */
+  void *data; /* resident channel contents (mapped file) */
   int64_t size; /* file size (or 0) */
   int64_t getpos; /* channel read position */
   int64_t putpos; /* channel write position */
   int32_t bufpos; /* index of the 1st available byte in the buffer */
   int32_t bufend; /* index of the 1st unavailable byte in the buffer */
+  int *order; /* sources indices in the read order (fastest first) */
   int64_t counters[LimitsNumber];
+  uint32_t binds; /* network RO sources number (mounting order key) */
+  uint32_t connects; /* network WO sources number (mounting order key) */
 };
 
+/* session NUMA memory policy */
+enum NumaPolicy {
+  NumaDefault,
+  NumaBind,
+  NumaInterleave
+};
+
+/* manifest text size limit */
+#define MANIFEST_SIZE_LIMIT 0x800000
+
 /* zerovm manifest structure */
 struct Manifest {
   int node; /* own node id from manifest */
   char *program; /* program file name */
   char *etag; /* signature. reserved for a future */
   char *job; /* daemon: job file name. child: manifest file name */
+  int pool; /* daemon: number of pre-forked children */
+  int limit; /* daemon: number of concurrent sessions */
+  int queue; /* daemon: number of commands waiting for the free slot */
+  char *save; /* session image file name */
+  char *text; /* manifest text (for session image) */
   int32_t timeout; /* time user module allowed to run */
   int64_t mem_size; /* user specified memory */
   void *mem_tag; /* tag context */
+  int mem_pages; /* 0 - regular, 1 - huge pages heap, 2 - heap and stack */
+  int64_t mem_prefault; /* heap bytes to prefault before the session */
   struct Connection *name_server;
+  int64_t cluster; /* name service job (cluster) id */
+  int nodes; /* name service job (cluster) nodes number */
+  GArray *cpus; /* (int) cpus the session is bound to, NULL - not bound */
+  int numa; /* enum NumaPolicy */
+  uint64_t numa_nodes; /* NUMA nodes mask */
   GPtrArray *channels; /* all elements are (ChannelDesc*) */
+  GPtrArray *relays; /* broadcast: (ChannelDesc*) hidden from the user */
 };
 
-/* de-serialize manifest from the given file */
+/* de-serialize manifest from the given (text or compiled) file */
 struct Manifest *ManifestCtor(const char *name);
 
 /* de-serialize manifest from the given text */
 struct Manifest *ManifestTextCtor(char *text);
 
+/*
+ * serialize the (parsed) manifest to the compiled manifest file. the
+ * compiled manifest is accepted by ManifestCtor() as well as the text one
+ */
+void ManifestCompile(const struct Manifest *manifest, const char *name);
+
 /*
  * release manifest resources. all elements initialized by another classes
  * must be deallocated by those classes
  */
 void ManifestDtor(struct Manifest *manifest);
 
+/* parse the channel source name and append it to the given sources */
+void ParseName(char *name, GPtrArray *names);
+
+/*
+ * parse the name server ("url[, cluster id, nodes number]") and set
+ * the manifest name server fields
+ */
+void ParseNameServer(struct Manifest *manifest, char *value);
+
 /* convert string to integer, fail if string is invalid */
 int64_t ToInt(char *a);
 
@@ -22,6 +22,7 @@
 #include "src/main/accounting.h"
 #include "src/main/setup.h"
 #include "src/channels/channel.h"
+#include "src/syscalls/daemon.h"
 
 #define QUANT MICRO_PER_SEC
 
@@ -32,6 +33,7 @@
 #define REPORT_ETAG "etag(s) = "
 #define REPORT_ACCOUNTING "accounting = "
 #define REPORT_STATE "exit state = "
+#define REPORT_PLACEMENT "placement = "
 #define REPORT_CMD cmd->str
 #define EOL "\r"
 #else
@@ -41,24 +43,29 @@
 #define REPORT_ETAG ""
 #define REPORT_ACCOUNTING ""
 #define REPORT_STATE ""
+#define REPORT_PLACEMENT ""
 #define REPORT_CMD ""
 #define EOL "\n"
 #endif
 
 /*
- * 0: to /dev/stdout, 1: to syslog, 2: (0) + fast reports, 3: to socket
+ * 0: to /dev/stdout, 1: to syslog, 2: (0) + fast reports, 3: to socket,
+ * 4: to socket with binary header
  * TODO(d'b): fast reports should be cut from report output
  * TODO(d'b): report outputs should be enumerated (magic numbers to remove)
  */
 static int report_mode = 0;
+int fast_report = 0;
 static int zvm_code = 0;
 static int user_code = 0;
 static int validation_state = 2;
 static int daemon_state = 0;
 static char *zvm_state = NULL;
+static char *placement = NULL; /* NULL if the session is not placed */
 static GString *digests = NULL; /* cumulative etags */
 static GString *cmd = NULL;
 static int report_handle = STDOUT_FILENO;
+static uint32_t report_id = 0;
 
 void SetReportHandle(int handle)
 {
@@ -68,6 +75,12 @@ void SetReportHandle(int handle)
 void ReportMode(int mode)
 {
   report_mode = mode;
+  fast_report = mode == 2;
+}
+
+void SetReportId(uint32_t id)
+{
+  report_id = id;
 }
 
 void SetExitState(const char *state)
@@ -76,6 +89,12 @@ void SetExitState(const char *state)
   zvm_state = g_strdup(state);
 }
 
+void SetPlacement(const char *s)
+{
+  g_free(placement);
+  placement = g_strdup(s);
+}
+
 void SetExitCode(int code)
 {
   /* only the 1st error matters */
@@ -184,6 +203,17 @@ static void OutputReport(char *r)
       REPORT(p);
       g_free(p);
       break;
+    case 4: /* unix socket, binary header (single write) */
+      {
+        struct DaemonHeader h = {DAEMON_MAGIC, report_id, size, DaemonSession};
+        p = g_malloc(sizeof h + size);
+        memcpy(p, &h, sizeof h);
+        memcpy(p + sizeof h, r, size);
+        size += sizeof h;
+        REPORT(p);
+        g_free(p);
+      }
+      break;
     case 0: /* stdout */
       REPORT(r);
       break;
@@ -253,6 +283,8 @@ void Report(struct NaClApp *nap)
   REPORT(r, "%s%s%s%s", eol, REPORT_ACCOUNTING, acc, eol);
   REPORT(r, "%s%s%s", REPORT_STATE,
       zvm_state == NULL ? UNKNOWN_STATE : zvm_state, eol);
+  if(placement != NULL)
+    REPORT(r, "%s%s%s", REPORT_PLACEMENT, placement, eol);
   REPORT(r, "%s%s", REPORT_CMD, eol);
   OutputReport(r->str);
 
@@ -291,6 +323,7 @@ void ReportDtor(int zvm_ret)
   g_string_free(digests, TRUE);
   g_string_free(cmd, TRUE);
   g_free(zvm_state);
+  g_free(placement);
 
   ZTrace("[exit]");
   ZTraceDtor(1);
@@ -24,6 +24,7 @@
 
 #define UNKNOWN_STATE "unknown error, see syslog"
 #define OK_STATE "ok"
+#define CANCELLED_STATE "cancelled"
 
 EXTERN_C_BEGIN
 
@@ -33,9 +34,15 @@ void SetReportHandle(int handle);
 /* put report to syslog instead of stdout */
 void ReportMode(int mode);
 
+/* set request id for the binary (daemon) report */
+void SetReportId(uint32_t id);
+
 /* set the text for "exit state" in report */
 void SetExitState(const char *state);
 
+/* set the session cpus / NUMA placement for the report */
+void SetPlacement(const char *placement);
+
 /* set zerovm exit code */
 void SetExitCode(int code);
 
@@ -68,6 +75,9 @@ void ReportCtor();
  */
 void FastReport();
 
+/* nonzero if the fast reports are on ("-t2"). lets the callers skip them */
+extern int fast_report;
+
 /* full report (declared for daemon) */
 void Report(struct NaClApp *nap);
 
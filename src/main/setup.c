@@ -17,18 +17,43 @@
  * limitations under the License.
  */
 #include <assert.h>
+#include <sched.h>
+#include <signal.h>
+#include <pthread.h>
 #include <sys/resource.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
 #include "src/loader/sel_ldr.h"
 #include "src/platform/sel_memory.h"
 #include "src/main/setup.h"
+#include "src/main/report.h"
 #include "src/channels/channel.h"
+#include "src/syscalls/switch_to_app.h"
+
+/* linux memory policies (numaif.h is the part of libnuma) */
+#ifndef MPOL_BIND
+#define MPOL_BIND 2
+#define MPOL_INTERLEAVE 3
+#endif
+#define NUMA_NODES 64
+
+/* linux 5.14+ (older kernels fail with EINVAL and the pages are touched) */
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
 
 static char *ztrace_name = NULL;
 static GTimer *timer = NULL;
 static FILE *ztrace_log = NULL;
 static GString *ztrace_buf = NULL;
 static double ztrace_chrono = 0;
+int ztrace_enabled = 0;
+
+/* heap prefaulting overlapped with the name service */
+static pthread_t prefault_thread;
+static uintptr_t prefault_area = 0;
+static int64_t prefault_size = 0;
+static double prefault_time = 0;
 
 void ZTraceCtor(const char *name)
 {
@@ -52,6 +77,7 @@ void ZTraceCtor(const char *name)
   /* set timer */
   ztrace_chrono = 0;
   timer = g_timer_new();
+  ztrace_enabled = 1;
 }
 
 void ZTraceDtor(int mode)
@@ -71,6 +97,7 @@ void ZTraceDtor(int mode)
   }
 
   /* free resources */
+  ztrace_enabled = 0;
   g_string_free(ztrace_buf, TRUE);
   g_timer_destroy(timer);
 }
@@ -125,6 +152,159 @@ void LastDefenseLine(struct Manifest *manifest)
   GiveUpPrivileges();
 }
 
+/* append bits set in "mask" of "bits" to "s" as the list of ranges */
+static void AppendRanges(GString *s, const unsigned long *mask, int bits)
+{
+  int width = 8 * sizeof *mask;
+  int first = -1;
+  int n = 0;
+  int i;
+
+  for(i = 0; i <= bits; ++i)
+  {
+    int set = i < bits && (mask[i / width] >> (i % width) & 1);
+
+    if(set && first < 0) first = i;
+    if(set || first < 0) continue;
+
+    if(n++ > 0) g_string_append_c(s, ',');
+    if(first == i - 1)
+      g_string_append_printf(s, "%d", first);
+    else
+      g_string_append_printf(s, "%d-%d", first, i - 1);
+    first = -1;
+  }
+}
+
+void PlaceSession(struct Manifest *manifest)
+{
+  unsigned long nodes[NUMA_NODES / (8 * sizeof(unsigned long))] = {0};
+  GString *placement;
+  cpu_set_t cpus;
+  int policy = 0;
+  int i;
+
+  assert(manifest != NULL);
+  if(manifest->cpus == NULL && manifest->numa == NumaDefault) return;
+
+  /* cpus affinity */
+  if(manifest->cpus != NULL)
+  {
+    CPU_ZERO(&cpus);
+    for(i = 0; i < manifest->cpus->len; ++i)
+      CPU_SET(g_array_index(manifest->cpus, int, i), &cpus);
+    ZLOGFAIL(sched_setaffinity(0, sizeof cpus, &cpus) != 0,
+        errno, "cannot set cpus affinity");
+  }
+
+  /* memory policy. the user memory is not touched yet */
+  if(manifest->numa != NumaDefault)
+  {
+    memcpy(nodes, &manifest->numa_nodes, sizeof manifest->numa_nodes);
+    ZLOGFAIL(syscall(SYS_set_mempolicy, manifest->numa == NumaBind
+        ? MPOL_BIND : MPOL_INTERLEAVE, nodes, NUMA_NODES + 1) != 0,
+        errno, "cannot set numa policy");
+  }
+
+  /* report the resulting placement */
+  placement = g_string_new("cpus ");
+  ZLOGFAIL(sched_getaffinity(0, sizeof cpus, &cpus) != 0,
+      errno, "cannot get cpus affinity");
+  AppendRanges(placement, (unsigned long*)&cpus, CPU_SETSIZE);
+  memset(nodes, 0, sizeof nodes);
+  if(syscall(SYS_get_mempolicy, &policy, nodes, NUMA_NODES + 1, NULL, 0) != 0)
+    policy = -1;
+  g_string_append(placement, policy == MPOL_BIND ? " numa bind "
+      : policy == MPOL_INTERLEAVE ? " numa interleave " : " numa default");
+  if(policy == MPOL_BIND || policy == MPOL_INTERLEAVE)
+    AppendRanges(placement, nodes, NUMA_NODES);
+
+  SetPlacement(placement->str);
+  ZLOGS(LOG_DEBUG, "session placement: %s", placement->str);
+  g_string_free(placement, TRUE);
+}
+
+/*
+ * ask the kernel to back 2mb aligned part of the area with transparent
+ * huge pages. the user space is reserved with MAP_NORESERVE, so the huge
+ * pages are allocated upon the 1st touch as well as the regular ones
+ */
+static void AdviseHugePages(uintptr_t area, int64_t size, const char *name)
+{
+  uintptr_t start = ROUNDUP_2M(area);
+  uintptr_t end = ROUNDDOWN_2M(area + size);
+
+  if(end <= start) return;
+#ifdef MADV_HUGEPAGE
+  ZLOGIF(madvise((void*)start, end - start, MADV_HUGEPAGE) != 0,
+      "cannot use huge pages for %s: %s", name, strerror(errno));
+#else
+  ZLOGIF(1, "huge pages are not supported, %s uses regular pages", name);
+#endif
+}
+
+void AdviseHeap(struct NaClApp *nap, uintptr_t area, int64_t size)
+{
+  uintptr_t start = NaClUserToSys(nap, ROUNDUP_64K(nap->data_end));
+  uintptr_t end = NaClUserToSys(nap, nap->heap_end);
+
+  if(nap->manifest->mem_pages <= 0) return;
+
+  /* only the part advised by PreallocateUserMemory() */
+  start = MAX(ROUNDUP_2M(start), area);
+  end = MIN(ROUNDDOWN_2M(end), area + size);
+  if(end <= start) return;
+  AdviseHugePages(start, end - start, "heap");
+}
+
+/* populate the heap pages. runs on the background thread */
+static void *Prefault(void *arg)
+{
+  GTimer *t = g_timer_new();
+  volatile char *p;
+
+  /* the kernel populates the pages writable without changing the data */
+  if(madvise((void*)prefault_area, prefault_size, MADV_POPULATE_WRITE) != 0)
+    for(p = (void*)prefault_area;
+        p < (char*)prefault_area + prefault_size; p += NACL_PAGESIZE)
+      *p = *p;
+
+  prefault_time = g_timer_elapsed(t, NULL);
+  g_timer_destroy(t);
+  return arg;
+}
+
+/*
+ * start prefaulting of "size" bytes of the heap "area" on the background
+ * thread. the signals are blocked for the thread to keep them for zerovm
+ */
+static void StartPrefault(uintptr_t area, int64_t size)
+{
+  sigset_t all, old;
+  int i;
+
+  prefault_area = area;
+  prefault_size = ROUNDUP_4K(size);
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  i = pthread_create(&prefault_thread, NULL, Prefault, NULL);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  /* the heap will be populated upon the 1st touch as usual */
+  ZLOGIF(i != 0, "cannot start heap prefaulting: %s", strerror(i));
+  if(i != 0) prefault_size = 0;
+}
+
+void FinishPrefault()
+{
+  if(prefault_size == 0) return;
+
+  pthread_join(prefault_thread, NULL);
+  ZLOGS(LOG_DEBUG, "%ld bytes of heap prefaulted in %.6fs",
+      prefault_size, prefault_time);
+  prefault_size = 0;
+}
+
 void PreallocateUserMemory(struct NaClApp *nap)
 {
   uintptr_t i;
@@ -150,6 +330,17 @@ void PreallocateUserMemory(struct NaClApp *nap)
   ZLOGFAIL(0 != i, -i, "cannot set protection on user heap");
   nap->heap_end = NaClSysToUser(nap, (uintptr_t)p + heap);
 
+  /* huge pages for the heap (and the stack) */
+  if(nap->manifest->mem_pages > 0)
+    AdviseHugePages((uintptr_t)p, heap, "heap");
+  if(nap->manifest->mem_pages > 1)
+    AdviseHugePages(nap->mem_map[StackIdx].start,
+        nap->mem_map[StackIdx].size, "stack");
+
+  /* populate the heap start while the name service exchange goes on */
+  if(nap->manifest->mem_prefault > 0)
+    StartPrefault((uintptr_t)p, MIN(nap->manifest->mem_prefault, heap));
+
   nap->mem_map[HeapIdx].size += heap;
   nap->mem_map[HeapIdx].end += heap;
 }
@@ -172,6 +363,8 @@ struct UserManifestSerialized
   uint32_t stack_size;
   int32_t channels_count;
   uint32_t channels;
+  uint32_t aliases;
+  int32_t cpu_level;
 };
 
 #define USER_PTR_SIZE sizeof(int32_t)
@@ -246,11 +439,19 @@ static void ProtectUserManifest(struct NaClApp *nap, void *mft)
       nap->mem_map[HeapIdx].end - nap->mem_map[HeapIdx].start;
 }
 
+/* order channels numbers by the channels aliases */
+static gint OrderIndex(gconstpointer a, gconstpointer b, gpointer manifest)
+{
+  return strcmp(CH_CH(((struct Manifest*)manifest), *(int32_t*)a)->alias,
+      CH_CH(((struct Manifest*)manifest), *(int32_t*)b)->alias);
+}
+
 void SetSystemData(struct NaClApp *nap)
 {
   struct Manifest *manifest;
   struct ChannelSerialized *channels;
   struct UserManifestSerialized *user_manifest;
+  int32_t *index; /* channels numbers ordered by alias */
   void *ptr; /* pointer to the user manifest area */
   int64_t size;
   int i;
@@ -262,16 +463,17 @@ void SetSystemData(struct NaClApp *nap)
   manifest = nap->manifest;
 
   /*
-   * 1. calculate channels array size (w/o aliases)
+   * 1. calculate channels array and alias index size (w/o aliases)
    * 2. calculate user manifest size (w/o aliases)
    * 3. calculate pointer to user manifest
-   * 4. calculate pointer to channels array
+   * 4. calculate pointers to channels array and alias index
    */
-  size = manifest->channels->len * CHANNEL_STRUCT_SIZE;
+  size = manifest->channels->len * (CHANNEL_STRUCT_SIZE + sizeof *index);
   size += USER_MANIFEST_STRUCT_SIZE + USER_PTR_SIZE;
   ptr = (void*)(FOURGIG - nap->stack_size - size);
   user_manifest = (void*)NaClUserToSys(nap, (uintptr_t)ptr);
-  channels = (void*)((uintptr_t)&user_manifest->channels + USER_PTR_SIZE);
+  channels = (void*)(user_manifest + 1);
+  index = (void*)(channels + manifest->channels->len);
 
   /* make the 1st page of user manifest writable */
   CopyDown((void*)NaClUserToSys(nap, FOURGIG - nap->stack_size), "");
@@ -296,8 +498,13 @@ void SetSystemData(struct NaClApp *nap)
     /* alias */
     ptr = CopyDown(ptr, CH_CH(manifest, i)->alias);
     channels[i].name = NaClSysToUser(nap, (uintptr_t)ptr);
+    index[i] = i;
   }
 
+  /* alias index for the binary search (see zvm_channel() in api/zvm.h) */
+  g_qsort_with_data(index, manifest->channels->len,
+      sizeof *index, OrderIndex, manifest);
+
   /* update heap_size in the user manifest */
   size = ROUNDDOWN_64K(NaClSysToUser(nap, (uintptr_t)ptr));
   size = MIN(nap->heap_end, size);
@@ -314,6 +521,8 @@ void SetSystemData(struct NaClApp *nap)
   user_manifest->stack_size = nap->stack_size;
   user_manifest->channels_count = manifest->channels->len;
   user_manifest->channels = NaClSysToUser(nap, (uintptr_t)channels);
+  user_manifest->aliases = NaClSysToUser(nap, (uintptr_t)index);
+  user_manifest->cpu_level = CPULevel();
 
   /* make the user manifest read only */
   ProtectUserManifest(nap, ptr);
@@ -25,14 +25,18 @@ EXTERN_C_BEGIN
 
 #define HELP_SCREEN /* update command line switches here */\
     "%s%s\033[1m\033[37mZeroVM tag%d\033[0m lightweight VM manager, build 2013-12-02\n"\
-    "Usage: <manifest> [-v#] [-T#] [-stFPQ]\n\n"\
+    "Usage: <manifest> [-v#] [-T#] [-D#] [-C#] [-L#] [-X#] [-stFPQ]\n\n"\
     " -s skip validation\n"\
     " -t <0..2> report to stdout/log/fast (default 0)\n"\
     " -v <0..3> log verbosity (default 0)\n"\
     " -F quit right before starting user session\n"\
     " -P disable channels space preallocation\n"\
     " -Q disable platform qualification\n"\
-    " -T enable time/call tracing\n"
+    " -T enable time/call tracing\n"\
+    " -D <1..> network send pipeline depth (default 1)\n"\
+    " -C <file> compile the manifest to the file and quit\n"\
+    " -L <4..> channels number limit (default 1048576)\n"\
+    " -X <0..3> context switcher auto/sse/avx/xsave (default 0)\n"
 
 #define ZEROVM_PRIORITY 19
 
@@ -45,12 +49,33 @@ int NaClSegmentValidates(uint8_t* mbase, size_t size, uint32_t vbase);
  */
 void LastDefenseLine();
 
-/* preallocate memory area of given size. abort if fail */
+/*
+ * bind the session to the manifest cpus and NUMA nodes and report the
+ * resulting placement. should be called before the user memory touched
+ */
+void PlaceSession(struct Manifest *manifest);
+
+/*
+ * preallocate memory area of given size. abort if fail. the manifest part
+ * of the heap is prefaulted on the background thread
+ */
 void PreallocateUserMemory(struct NaClApp *nap);
 
+/*
+ * restore the huge pages advice of the heap area [area, area + size). the
+ * area replaced with the fresh mapping loses it
+ */
+void AdviseHeap(struct NaClApp *nap, uintptr_t area, int64_t size);
+
+/* wait for the heap prefaulting. should be called before the user session */
+void FinishPrefault();
+
 /* serialize system data to user space */
 void SetSystemData(struct NaClApp *nap);
 
+/* nonzero while "ztrace" is on. lets the callers skip the messages */
+extern int ztrace_enabled;
+
 /* initialize "ztrace" service. if name == NULL exit silently */
 void ZTraceCtor(const char *name);
 
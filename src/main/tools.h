@@ -58,11 +58,15 @@
 #define BIG_ENOUGH_STRING 1024
 #define MICROS_PER_MILLI 1000
 #define MICRO_PER_SEC 1000000
+#define NANO_PER_SEC 1000000000LL
 
 #define ROUNDDOWN_64K(a) ((a) & ~(NACL_MAP_PAGESIZE - 1LLU))
 #define ROUNDUP_64K(a) ROUNDDOWN_64K((a) + NACL_MAP_PAGESIZE - 1LLU)
 #define ROUNDDOWN_4K(a) ((a) & ~(NACL_PAGESIZE - 1LLU))
 #define ROUNDUP_4K(a) ROUNDDOWN_4K((a) + NACL_PAGESIZE - 1LLU)
+#define HUGE_PAGESIZE 0x200000
+#define ROUNDDOWN_2M(a) ((a) & ~(HUGE_PAGESIZE - 1LLU))
+#define ROUNDUP_2M(a) ROUNDDOWN_2M((a) + HUGE_PAGESIZE - 1LLU)
 
 /* from nacl_macros.h */
 #define ARRAY_SIZE(arr) ((sizeof arr)/sizeof arr[0])
@@ -30,6 +30,10 @@
 #include "src/main/accounting.h"
 #include "src/main/tools.h"
 #include "src/channels/preload.h"
+#include "src/channels/prefetch.h"
+#include "src/channels/nservice.h"
+#include "src/syscalls/snapshot.h"
+#include "src/syscalls/switch_to_app.h"
 
 #define BADCMDLINE(msg) \
   do { \
@@ -59,13 +63,14 @@ static void ParseCommandLine(struct NaClApp *nap, int argc, char **argv)
 {
   int opt;
   char *manifest_name = NULL;
+  char *compiled_name = NULL;
   int64_t psize;
 
   /* construct logger with default verbosity */
   ZLogCtor(LOG_ERROR);
   CommandLine(argc, argv);
 
-  while((opt = getopt(argc, argv, "-PFQst:v:M:T:")) != -1)
+  while((opt = getopt(argc, argv, "-PFQst:v:M:T:D:C:L:X:")) != -1)
   {
     switch(opt)
     {
@@ -100,6 +105,23 @@ static void ParseCommandLine(struct NaClApp *nap, int argc, char **argv)
       case 'T':
         ZTraceCtor(optarg);
         break;
+      case 'D':
+        if(ToInt(optarg) < 1) BADCMDLINE("invalid pipeline depth");
+        NetPipelineDepth(ToInt(optarg));
+        break;
+      case 'C':
+        compiled_name = optarg;
+        break;
+      case 'L':
+        if(ToInt(optarg) <= MIN_CHANNELS_NUMBER)
+          BADCMDLINE("invalid channels limit");
+        ChannelsLimit(ToInt(optarg));
+        break;
+      case 'X':
+        if(ToInt(optarg) < 0 || ToInt(optarg) >= SwitchersNumber)
+          BADCMDLINE("invalid context switcher");
+        SetContextSwitch(ToInt(optarg));
+        break;
       default:
         BADCMDLINE(NULL);
         break;
@@ -110,6 +132,16 @@ static void ParseCommandLine(struct NaClApp *nap, int argc, char **argv)
   if(manifest_name == NULL) BADCMDLINE(NULL);
   nap->manifest = ManifestCtor(manifest_name);
 
+  /* compile the (validated) manifest and quit */
+  if(compiled_name != NULL)
+  {
+    ManifestCompile(nap->manifest, compiled_name);
+    ManifestDtor(nap->manifest);
+    nap->manifest = NULL;
+    SetExitState(OK_STATE);
+    ReportDtor(0);
+  }
+
   /* set available nap and manifest fields */
   ZLOGFAIL(nap->manifest->program == NULL, EFAULT, "program not specified");
   psize = GetFileSize(nap->manifest->program);
@@ -146,20 +178,11 @@ static void ValidateProgram(struct NaClApp *nap)
   SetValidationState(0);
 }
 
-int main(int argc, char **argv)
+/* load and validate program from elf file */
+static void LoadProgram(struct NaClApp *nap)
 {
-  struct NaClApp state = {0}, *nap = &state;
   struct GioMemoryFileSnapshot main_file;
 
-  /* initialize globals and set nap fields to default values */
-  ReportCtor();
-  NaClAppCtor(nap);
-  ParseCommandLine(nap, argc, argv);
-
-  /* We use the signal handler to verify a signal took place. */
-  if(skip_qualification == 0) RunSelQualificationTests();
-  SignalHandlerInit();
-
   /* read elf into memory */
   ZLOGFAIL(0 == GioMemoryFileSnapshotCtor(&main_file, nap->manifest->program),
       ENOENT, "Cannot open '%s'. %s", nap->manifest->program, strerror(errno));
@@ -180,12 +203,44 @@ int main(int argc, char **argv)
     ZLOG(LOG_ERROR, "Error while closing '%s'", nap->manifest->program);
   (*((struct Gio *) &main_file)->vtbl->Dtor)((struct Gio *) &main_file);
   ZTrace("[snapshot deallocation]");
+}
 
-  /* initialize all channels */
-  ChannelsCtor(nap->manifest);
-  ZLOGS(LOG_DEBUG, "channels constructed");
+int main(int argc, char **argv)
+{
+  struct NaClApp state = {0}, *nap = &state;
+
+  /* initialize globals and set nap fields to default values */
+  ReportCtor();
+  NaClAppCtor(nap);
+  ParseCommandLine(nap, argc, argv);
+  PlaceSession(nap->manifest);
+
+  /* We use the signal handler to verify a signal took place. */
+  if(skip_qualification == 0) RunSelQualificationTests();
+  SignalHandlerInit();
+
+  /*
+   * mount read only channels and start the name service exchange. the
+   * program loading, validation and heap allocation overlap with the
+   * exchange. write only channels are mounted after the validation
+   */
+  ChannelsStart(nap->manifest);
+  ZLOGS(LOG_DEBUG, "channels started");
   ZTrace("[channels mounting]");
 
+  /* restore session if the program is an image or load elf */
+  if(LoadSession(nap, nap->manifest->program) == 0)
+  {
+    ZTrace("[session restoring]");
+
+    /* validate restored text (ensure that text segment is safe) */
+    ZLOGS(LOG_DEBUG, "Validating %s", nap->manifest->program);
+    if(!skip_validation) ValidateProgram(nap);
+    ZTrace("[user module validation]");
+  }
+  else
+    LoadProgram(nap);
+
   /*
    * allocate user heap. should be the last allocation in raw because
    * after heap allocated there will be no free user memory
@@ -194,6 +249,18 @@ int main(int argc, char **argv)
   ZLOGS(LOG_DEBUG, "user memory preallocated");
   ZTrace("[user memory preallocation]");
 
+  /* get name service reply and mount the rest of channels */
+  ChannelsFinish(nap->manifest);
+  ZLOGS(LOG_DEBUG, "channels constructed");
+  ZTrace("[name service]");
+
+  /* wait for the heap prefaulting overlapped with the name service */
+  if(nap->manifest->mem_prefault > 0)
+  {
+    FinishPrefault();
+    ZTrace("[heap prefaulting]");
+  }
+
   /* set user manifest in user space */
   SetSystemData(nap);
   ZLOGS(LOG_DEBUG, "system data set");
@@ -25,19 +25,19 @@
 #define TAG_FORMAT "%s %d: "
 #define LOG_MSG_LIMIT 0x1000
 
-static int verbosity = 0;
+int zlog_verbosity = 0;
 static int zline = 0;
 static const char *zfile = NULL;
 
 void ZLogCtor(int v)
 {
-  verbosity = MAX(v, 0);
+  zlog_verbosity = MAX(v, 0);
   openlog(ZLOG_NAME, ZLOG_OPTIONS, ZLOG_FACILITY);
 }
 
 void ZLogDtor()
 {
-  verbosity = 0;
+  zlog_verbosity = 0;
   closelog();
 }
 
@@ -66,7 +66,7 @@ void ZLogTag(const char *file, int line)
 
 void ZLog(int priority, char *fmt, ...)
 {
-  ZLO(priority > verbosity);
+  ZLO(priority > zlog_verbosity);
   assert(priority != LOG_FATAL);
 }
 
@@ -25,15 +25,22 @@
 EXTERN_C_BEGIN
 
 /*
- * ZLOG(format, ...) - add file and line info to given message and put it to syslog
- * ZLOGS(format, ...) - put given message to syslog
+ * ZLOG(priority, format, ...) - add file and line info to given message and put it to syslog
+ * ZLOGS(priority, format, ...) - put given message to syslog
  * ZLOGIF(condition, format, ...) - check condition and, if true, ZLOG it
  * ZLOGFAIL(condition, code, format, ...) - check condition, if true, ZLOG it and exit with code
+ *
+ * the arguments are only evaluated if the message goes to the log, so the
+ * disabled logging costs one (predicted) branch
  */
-#define ZLOG ZLogTag(__FILE__, __LINE__), ZLog
-#define ZLOGIF ZLogTag(__FILE__, __LINE__), LogIf
-#define ZLOGFAIL ZLogTag(__FILE__, __LINE__), FailIf
-#define ZLOGS ZLogTag(NULL, 0), ZLog
+#define ZLOG(priority, ...) do { if(G_UNLIKELY((priority) <= zlog_verbosity)) \
+    ZLogTag(__FILE__, __LINE__), ZLog(priority, __VA_ARGS__); } while(0)
+#define ZLOGIF(cond, ...) do { if(G_UNLIKELY(cond)) \
+    ZLogTag(__FILE__, __LINE__), LogIf(1, __VA_ARGS__); } while(0)
+#define ZLOGFAIL(cond, code, ...) do { if(G_UNLIKELY(cond)) \
+    ZLogTag(__FILE__, __LINE__), FailIf(1, code, __VA_ARGS__); } while(0)
+#define ZLOGS(priority, ...) do { if(G_UNLIKELY((priority) <= zlog_verbosity)) \
+    ZLogTag(NULL, 0), ZLog(priority, __VA_ARGS__); } while(0)
 #define FAILED_MSG "check failed"
 
 /* develop fix for verbosity level names */
@@ -44,6 +51,9 @@ EXTERN_C_BEGIN
 #define LOG_ERROR  1 /* mandatory message */
 #define LOG_FATAL  0 /* for completeness. not used */
 
+/* current verbosity. should only be changed by ZLogCtor() / ZLogDtor() */
+extern int zlog_verbosity;
+
 /* initialize syslog with verbosity */
 void ZLogCtor(int v);
 
@@ -20,7 +20,12 @@
  */
 
 #include <sys/mman.h>
+#include "src/main/config.h"
 #include "src/main/zlog.h"
+#include "src/platform/sel_memory.h"
+
+#define PAGEMAP_POPULATED (3ULL << 62) /* present or swapped out */
+#define PAGEMAP_CHUNK 16 /* entries read at once */
 
 int NaCl_page_alloc_intern_flags(void **p, size_t size, int map_flags)
 {
@@ -57,3 +62,24 @@ int NaCl_madvise(void *start, size_t length, int advice)
   /* MADV_DONTNEED and MADV_NORMAL are needed */
   return ret == -1 ? -errno : ret;
 }
+
+int NaCl_page_untouched(int pagemap, void *addr, size_t size)
+{
+  uint64_t entries[PAGEMAP_CHUNK];
+  uintptr_t page = ROUNDDOWN_4K((uintptr_t)addr);
+  uintptr_t end = (uintptr_t)addr + size;
+  int i;
+
+  while(page < end)
+  {
+    int n = MIN(PAGEMAP_CHUNK, ROUNDUP_4K(end - page) / NACL_PAGESIZE);
+    off_t offset = page / NACL_PAGESIZE * sizeof *entries;
+
+    if(pread(pagemap, entries, n * sizeof *entries, offset) != n * sizeof *entries)
+      return 0;
+    for(i = 0; i < n; ++i)
+      if(entries[i] & PAGEMAP_POPULATED) return 0;
+    page += n * NACL_PAGESIZE;
+  }
+  return 1;
+}
@@ -45,6 +45,12 @@ int NaCl_mprotect(void *addr, size_t len, int prot) NACL_WUR;
 
 int NaCl_madvise(void *start, size_t length, int advice) NACL_WUR;
 
+/*
+ * return 1 if no page of the area was ever populated (neither present nor
+ * swapped out), otherwise 0. "pagemap" is the open /proc/self/pagemap
+ */
+int NaCl_page_untouched(int pagemap, void *addr, size_t size);
+
 EXTERN_C_END
 
 #endif /*  SEL_MEMORY_H_ */
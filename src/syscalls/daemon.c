@@ -18,69 +18,215 @@
 #include <sys/resource.h>
 #include <sys/wait.h>
 #include <sys/prctl.h>
+#include <sys/signalfd.h>
+#include <poll.h>
+#include <sched.h>
 #include "src/main/report.h"
 #include "src/main/setup.h"
 #include "src/main/accounting.h"
 #include "src/platform/signal.h"
 #include "src/channels/channel.h"
+#include "src/channels/preload.h"
 #include "src/syscalls/daemon.h"
 
 #define DAEMON_NAME "zvm."
-#define TASK_SIZE 0x10000 /* limited by protocol (server <-> zerovm ) */
 #define QUEUE_SIZE 16
 #define CMD_SIZE (sizeof(uint64_t))
+#define CMD_LIMIT (MANIFEST_SIZE_LIMIT + sizeof(struct DaemonHeader))
 
-static int client = -1;
+/* daemon: connection with partially received commands */
+struct Client
+{
+  int fd;
+  int eof; /* the client has shut down its sending side (or has gone) */
+  int pending; /* queued and running commands waiting for the reply */
+  int waiting; /* the client is in "backlog" */
+  GByteArray *buf;
+  GByteArray *out; /* replies not sent yet */
+};
 
 /*
- * child: get command from inherited command socket. current version can
- * only have one command and therefore the command format will only contain
- * one (pascal) string: 4-bytes length and data of "length" size. the data
- * is manifest (reduced form of it). WARNING: result should be freed
+ * daemon: report of the running session. the daemon is the only writer to
+ * the client socket: it collects the whole report from the session pipe and
+ * forwards it, so replies (and status replies) cannot interleave
  */
-static char *GetCommand()
+struct Reply
+{
+  int fd; /* daemon end of the session report pipe */
+  struct Client *client;
+  GByteArray *data;
+};
+
+/* daemon: pooled child waiting for the job on its own socket */
+struct Pooled
 {
-  int len;
-  char *cmd = g_malloc0(TASK_SIZE);
+  pid_t pid;
+  int fd; /* daemon end of the job socket */
+};
 
-  assert(client >= 0);
+/* daemon: command waiting for the free slot */
+struct Command
+{
+  struct Client *client;
+  GByteArray *data;
+};
 
-  ZLOGFAIL(read(client, cmd, CMD_SIZE) < 0, EIO, "%s", strerror(errno));
-  len = ToInt(cmd);
-  ZLOGFAIL(read(client, cmd, len) < 0, EIO, "%s", strerror(errno));
+static int client = -1; /* child: pipe to report to */
+static GByteArray *command = NULL; /* child: command to serve */
+static int running = 0; /* daemon: number of running sessions */
+static int sigchld = -1; /* daemon: SIGCHLD signalfd */
+static GPtrArray *clients = NULL; /* daemon: connections (struct Client*) */
+static GPtrArray *replies = NULL; /* daemon: reports (struct Reply*) */
+static GQueue *queue = NULL; /* daemon: commands (struct Command*) */
+static GQueue *backlog = NULL; /* daemon: clients with buffered commands */
+static GQueue *pool = NULL; /* daemon: pooled children (struct Pooled*) */
+static GHashTable *children = NULL; /* daemon: pid -> core index + 1, 0 - idle */
+static int cpus[CPU_SETSIZE]; /* daemon: available cores */
+static int load[CPU_SETSIZE]; /* daemon: sessions number per core index */
+static int cpus_number = 0;
 
-  return cmd;
+/* return 1 if the command is binary one, otherwise 0 */
+static int IsBinary(const uint8_t *cmd, int size)
+{
+  return size >= sizeof(uint32_t)
+      && ((struct DaemonHeader*)cmd)->magic == DAEMON_MAGIC;
 }
 
-/* child: update "nap" with the new manifest */
-static void UpdateSession(struct Manifest *manifest)
+/*
+ * daemon: return size of the 1st complete command in the buffer, 0 if the
+ * command is not complete yet and -1 if the command is malformed. the text
+ * command is (pascal) string: 8 bytes of the length and the manifest itself.
+ * the binary command is struct DaemonHeader followed by the command body
+ */
+static int64_t CommandSize(GByteArray *buf)
 {
+  char len[CMD_SIZE + 1] = {0};
+  char *end;
+  int64_t size;
+
+  if(buf->len < CMD_SIZE) return 0;
+
+  if(IsBinary(buf->data, buf->len))
+  {
+    if(buf->len < sizeof(struct DaemonHeader)) return 0;
+    size = sizeof(struct DaemonHeader)
+        + ((struct DaemonHeader*)buf->data)->size;
+  }
+  else
+  {
+    memcpy(len, buf->data, CMD_SIZE);
+    errno = 0;
+    size = g_ascii_strtoll(g_strstrip(len), &end, 0);
+    if(*end != '\0' || errno != 0 || size < 0) return -1;
+    size += CMD_SIZE;
+  }
+
+  if(size > CMD_LIMIT) return -1;
+  return buf->len < size ? 0 : size;
+}
+
+/* child: read 32-bit value from the binary command */
+static uint32_t GetUint32(uint8_t **p, uint8_t *end)
+{
+  uint32_t result;
+
+  ZLOGFAIL(*p + sizeof result > end, EFAULT, "malformed command");
+  memcpy(&result, *p, sizeof result);
+  *p += sizeof result;
+  return result;
+}
+
+/* child: read (pascal) string from the binary command. should be freed */
+static char *GetString(uint8_t **p, uint8_t *end)
+{
+  uint16_t len;
+  char *result;
+
+  ZLOGFAIL(*p + sizeof len > end, EFAULT, "malformed command");
+  memcpy(&len, *p, sizeof len);
+  *p += sizeof len;
+  ZLOGFAIL(*p + len > end, EFAULT, "malformed command");
+  result = g_strndup((char*)*p, len);
+  *p += len;
+  return result;
+}
+
+/*
+ * child: update "nap" with the binary command. the command only contains
+ * per-request fields, channels are given in the daemon (user manifest) order:
+ * timeout, node, name server, channels number and then for each channel:
+ * tag, sources number and sources. numbers are 32-bit, strings are 16-bit
+ * length followed by the string itself
+ */
+static void UpdateBinary(struct Manifest *manifest)
+{
+  uint8_t *p = command->data + sizeof(struct DaemonHeader);
+  uint8_t *end = command->data + command->len;
+  char *name;
   int i;
-  char *cmd = GetCommand();
-  struct Manifest *tmp = ManifestTextCtor(cmd);
+  int j;
 
-  /* re-initialize signals handling, accounting and the report handle */
-  g_free(cmd);
-  SignalHandlerFini();
-  SignalHandlerInit();
-  ResetAccounting();
-  ReportMode(3);
-  SetReportHandle(client);
-  ZLogDtor();
-  ZLogCtor(0);
-  ZTraceCtor(NULL);
+  manifest->timeout = GetUint32(&p, end);
+  manifest->node = GetUint32(&p, end);
+
+  /* name server is optional */
+  name = GetString(&p, end);
+  manifest->name_server = NULL;
+  if(*name != '\0')
+    ParseNameServer(manifest, name);
+  g_free(name);
+
+  /* channels layout is fixed by the daemon, only sources and tags differ */
+  ZLOGFAIL(GetUint32(&p, end) != manifest->channels->len,
+      EFAULT, "difference in channels number");
+  for(i = 0; i < manifest->channels->len; ++i)
+  {
+    struct ChannelDesc *channel = CH_CH(manifest, i);
+    int n;
+
+    channel->tag = GetUint32(&p, end) == 0 ? NULL : TagCtor();
+    n = GetUint32(&p, end);
+    ZLOGFAIL(n < 1, EFAULT, "%s has invalid sources number", channel->alias);
+
+    /* resident channel keeps the daemon source, given sources are skipped */
+    if(channel->data != NULL)
+    {
+      for(j = 0; j < n; ++j)
+        g_free(GetString(&p, end));
+      continue;
+    }
+
+    channel->source = g_ptr_array_new();
+    for(j = 0; j < n; ++j)
+    {
+      name = GetString(&p, end);
+      ParseName(name, channel->source);
+      g_free(name);
+    }
+  }
+}
+
+/* child: update "nap" with the text command (manifest) */
+static void UpdateText(struct Manifest *manifest)
+{
+  int i;
+  struct Manifest *tmp;
+
+  /* make the manifest string */
+  g_byte_array_append(command, (uint8_t*)"", 1);
+  tmp = ManifestTextCtor((char*)command->data + CMD_SIZE);
 
   /* copy needful fields from the new manifest */
   manifest->timeout = tmp->timeout;
   manifest->name_server = tmp->name_server;
+  manifest->cluster = tmp->cluster;
+  manifest->nodes = tmp->nodes;
   manifest->node = tmp->node;
-  manifest->job = tmp->job;
+  manifest->relays = tmp->relays;
 
-  /* reset timeout, i/o limit, privileges e.t.c. */
-  LastDefenseLine(manifest);
-
-  /* check and partially copy channels */
-  SortChannels(manifest->channels);
+  /* check and partially copy channels (daemon channels are sorted) */
+  ZLOGFAIL(manifest->channels->len != tmp->channels->len,
+      EFAULT, "difference in channels number");
   SortChannels(tmp->channels);
 
   for(i = 0; i < manifest->channels->len; ++i)
@@ -95,19 +241,686 @@ static void UpdateSession(struct Manifest *manifest)
     CHECK(limits[1]);
     CHECK(limits[2]);
     CHECK(limits[3]);
+    ZLOGFAIL(CH_CH(manifest, i)->resident != CH_CH(tmp, i)->resident,
+        EFAULT, "difference in %s resident token", CH_CH(manifest, i)->alias);
 
-    CH_CH(manifest, i)->source = CH_CH(tmp, i)->source;
+    /* resident channel keeps the daemon source */
+    if(CH_CH(manifest, i)->data == NULL)
+      CH_CH(manifest, i)->source = CH_CH(tmp, i)->source;
     CH_CH(manifest, i)->tag = CH_CH(tmp, i)->tag;
   }
+}
+
+/* child: update "nap" with the new command */
+static void UpdateSession(struct Manifest *manifest)
+{
+  int binary = IsBinary(command->data, command->len);
+
+  /* re-initialize signals handling, accounting and the report handle */
+  SignalHandlerFini();
+  SignalHandlerInit();
+  ResetAccounting();
+  ReportMode(binary ? 4 : 3);
+  if(binary) SetReportId(((struct DaemonHeader*)command->data)->id);
+  SetReportHandle(client);
+  ZLogDtor();
+  ZLogCtor(0);
+  ZTraceCtor(NULL);
+
+  /* copy per-request fields */
+  if(binary)
+    UpdateBinary(manifest);
+  else
+    UpdateText(manifest);
+  g_byte_array_free(command, TRUE);
+  command = NULL;
+
+  /* spawned session cannot become a daemon */
+  manifest->job = NULL;
+
+  /* reset timeout, i/o limit, privileges e.t.c. */
+  LastDefenseLine(manifest);
   ChannelsCtor(manifest);
 }
 
-/* daemon: get the next task: return when accept()'ed */
-static int Job(int sock)
+/* child: close daemon sockets inherited through fork(), restore SIGCHLD */
+static void CloseDaemonSockets(int sock)
+{
+  sigset_t mask;
+  int i;
+
+  close(sock);
+  close(sigchld);
+  for(i = 0; i < g_queue_get_length(pool); ++i)
+    close(((struct Pooled*)g_queue_peek_nth(pool, i))->fd);
+  for(i = 0; i < clients->len; ++i)
+    close(((struct Client*)g_ptr_array_index(clients, i))->fd);
+  for(i = 0; i < replies->len; ++i)
+    close(((struct Reply*)g_ptr_array_index(replies, i))->fd);
+
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
+  sigprocmask(SIG_UNBLOCK, &mask, NULL);
+}
+
+/* child: pin the session to the given core */
+static void Pin(int core)
+{
+  cpu_set_t set;
+
+  CPU_ZERO(&set);
+  CPU_SET(core, &set);
+  ZLOGIF(sched_setaffinity(0, sizeof set, &set) < 0,
+      "cannot pin session to cpu %d: %s", core, strerror(errno));
+}
+
+/* daemon: collect the cores available to the daemon */
+static void GetCores()
+{
+  cpu_set_t set;
+  int i;
+
+  ZLOGFAIL(sched_getaffinity(0, sizeof set, &set) < 0, EFAULT,
+      "%s", strerror(errno));
+  for(i = 0; i < CPU_SETSIZE; ++i)
+    if(CPU_ISSET(i, &set)) cpus[cpus_number++] = i;
+}
+
+/* daemon: return index of the least loaded core and reserve it */
+static int ReserveCore()
+{
+  int i;
+  int result = 0;
+
+  for(i = 1; i < cpus_number; ++i)
+    if(load[i] < load[result]) result = i;
+  ++load[result];
+  ++running;
+  return result;
+}
+
+/* daemon: release the core reserved for the finished session */
+static void ReleaseCore(int index)
+{
+  --load[index];
+  --running;
+}
+
+/* daemon: return 1 if there is a connection pending on "sock", otherwise 0 */
+static int IsPending(int sock)
+{
+  struct pollfd fds = {sock, POLLIN, 0};
+  return poll(&fds, 1, 0) > 0;
+}
+
+/*
+ * daemon: pass the core index, the command and the report pipe to the pooled
+ * child through its job socket. return 0 if successful, -1 if failed (f.e. the
+ * command is too large or the child is gone)
+ */
+static int PassJob(int sock, int fd, int index, const uint8_t *cmd, int size)
+{
+  char buf[CMSG_SPACE(sizeof fd)];
+  struct iovec iov[2] = {{&index, sizeof index}, {(void*)cmd, size}};
+  struct msghdr msg = {0};
+  struct cmsghdr *cmsg;
+
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 2;
+  msg.msg_control = buf;
+  msg.msg_controllen = sizeof buf;
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof fd);
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof fd);
+
+  return sendmsg(sock, &msg, MSG_DONTWAIT | MSG_NOSIGNAL)
+      == sizeof index + size ? 0 : -1;
+}
+
+/* pooled child: wait for the core, the command and the report pipe */
+static void GetJob(int sock)
+{
+  char buf[CMSG_SPACE(sizeof(int))];
+  int index;
+  struct iovec iov[2];
+  struct msghdr msg = {0};
+  struct cmsghdr *cmsg;
+  ssize_t size;
+
+  command = g_byte_array_sized_new(CMD_LIMIT);
+  iov[0].iov_base = &index;
+  iov[0].iov_len = sizeof index;
+  iov[1].iov_base = command->data;
+  iov[1].iov_len = CMD_LIMIT;
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 2;
+  msg.msg_control = buf;
+  msg.msg_controllen = sizeof buf;
+
+  size = recvmsg(sock, &msg, 0);
+  ZLOGFAIL(size <= (ssize_t)sizeof index, EIO, "no job: %s", strerror(errno));
+  cmsg = CMSG_FIRSTHDR(&msg);
+  ZLOGFAIL(cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS
+      || (msg.msg_flags & MSG_TRUNC), EIO, "invalid job");
+  memcpy(&client, CMSG_DATA(cmsg), sizeof client);
+  g_byte_array_set_size(command, size - sizeof index);
+  Pin(cpus[index]);
+}
+
+/* daemon: remove the pooled child from the pool, close its job socket */
+static void Unpool(pid_t pid)
+{
+  int i;
+
+  for(i = 0; i < g_queue_get_length(pool); ++i)
+  {
+    struct Pooled *p = g_queue_peek_nth(pool, i);
+    if(p->pid != pid) continue;
+
+    close(p->fd);
+    g_free(p);
+    g_queue_pop_nth(pool, i);
+    return;
+  }
+}
+
+/* daemon: release finished children and their cores */
+static void Reap()
+{
+  struct signalfd_siginfo info;
+  gpointer value;
+  pid_t pid;
+
+  /* drain signalfd. the signals can be merged, so wait for all children */
+  while(read(sigchld, &info, sizeof info) == sizeof info);
+
+  while((pid = waitpid(-1, NULL, WNOHANG)) > 0)
+  {
+    if(!g_hash_table_lookup_extended(children,
+        GINT_TO_POINTER(pid), NULL, &value)) continue;
+
+    /* idle pooled child died */
+    if(GPOINTER_TO_INT(value) == 0)
+      Unpool(pid);
+    else
+      ReleaseCore(GPOINTER_TO_INT(value) - 1);
+    g_hash_table_remove(children, GINT_TO_POINTER(pid));
+  }
+}
+
+/*
+ * daemon: replenish the pool of pre-forked children. pending connections
+ * have priority over the pool refilling. return 0 in the daemon and 1 in
+ * the pooled child which got a job
+ */
+static int FillPool(int sock, int size)
+{
+  struct Pooled *p;
+  int job[2];
+  pid_t pid;
+
+  while(g_queue_get_length(pool) < size && !IsPending(sock))
+  {
+    if(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, job) < 0)
+    {
+      ZLOG(LOG_ERROR, "cannot create job socket: %s", strerror(errno));
+      break;
+    }
+
+    pid = fork();
+    if(pid == 0)
+    {
+      close(job[0]);
+      CloseDaemonSockets(sock);
+      GetJob(job[1]);
+      close(job[1]);
+      return 1;
+    }
+
+    close(job[1]);
+    ZLOGIF(pid < 0, "fork failed: %s", strerror(errno));
+    if(pid < 0)
+    {
+      close(job[0]);
+      break;
+    }
+
+    p = g_malloc(sizeof *p);
+    p->pid = pid;
+    p->fd = job[0];
+    g_queue_push_tail(pool, p);
+    g_hash_table_insert(children, GINT_TO_POINTER(pid), GINT_TO_POINTER(0));
+  }
+  return 0;
+}
+
+/* daemon: start collecting the report of the session */
+static void AddReply(int fd, struct Client *c)
+{
+  struct Reply *r = g_malloc(sizeof *r);
+
+  fcntl(fd, F_SETFL, O_NONBLOCK);
+  r->fd = fd;
+  r->client = c;
+  r->data = g_byte_array_new();
+  g_ptr_array_add(replies, r);
+}
+
+/*
+ * daemon: start the session serving given command with the pooled child
+ * or with the freshly forked one. the session reports to its own pipe.
+ * return 0 in the daemon and 1 in the child
+ */
+static int Spawn(int sock, struct Command *cmd)
+{
+  struct Pooled *p;
+  int report[2];
+  pid_t pid;
+  int index;
+
+  if(pipe(report) < 0)
+  {
+    ZLOG(LOG_ERROR, "cannot create report pipe: %s", strerror(errno));
+    --cmd->client->pending;
+    return 0;
+  }
+
+  /*
+   * give the job to the pooled child. the core is recorded for the child
+   * right away, so it is released even if the child dies before the session
+   * started. the child which cannot take the job is dropped from the pool
+   * (it exits on its closed job socket), unless the command is too large
+   */
+  index = ReserveCore();
+  while((p = g_queue_pop_head(pool)) != NULL)
+  {
+    if(PassJob(p->fd, report[1], index, cmd->data->data, cmd->data->len) == 0)
+    {
+      g_hash_table_insert(children,
+          GINT_TO_POINTER(p->pid), GINT_TO_POINTER(index + 1));
+      close(p->fd);
+      g_free(p);
+      close(report[1]);
+      AddReply(report[0], cmd->client);
+      return 0;
+    }
+
+    if(errno == EMSGSIZE || errno == ENOBUFS)
+    {
+      g_queue_push_head(pool, p);
+      break;
+    }
+    close(p->fd);
+    g_free(p);
+  }
+
+  /* child: take the command, continue to the trap */
+  pid = fork();
+  if(pid == 0)
+  {
+    client = report[1];
+    close(report[0]);
+    command = cmd->data;
+    cmd->data = NULL;
+    CloseDaemonSockets(sock);
+    Pin(cpus[index]);
+    return 1;
+  }
+
+  close(report[1]);
+  ZLOGIF(pid < 0, "fork failed: %s", strerror(errno));
+  if(pid < 0)
+  {
+    ReleaseCore(index);
+    close(report[0]);
+    --cmd->client->pending;
+    return 0;
+  }
+
+  g_hash_table_insert(children,
+      GINT_TO_POINTER(pid), GINT_TO_POINTER(index + 1));
+  AddReply(report[0], cmd->client);
+  return 0;
+}
+
+/*
+ * daemon: start queued commands while there are free slots
+ * return 0 in the daemon and 1 in the child
+ */
+static int Dispatch(int sock, int limit)
+{
+  struct Command *cmd;
+  int code;
+
+  while(running < limit && !g_queue_is_empty(queue))
+  {
+    cmd = g_queue_pop_head(queue);
+    code = Spawn(sock, cmd);
+    if(cmd->data != NULL)
+      g_byte_array_free(cmd->data, TRUE);
+    g_free(cmd);
+    if(code) return 1;
+  }
+  return 0;
+}
+
+/*
+ * daemon: send the collected replies as long as the client takes them.
+ * the client which cannot be written is considered gone
+ */
+static void Flush(struct Client *c)
+{
+  ssize_t size;
+
+  while(c->out->len > 0)
+  {
+    size = send(c->fd, c->out->data, c->out->len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if(size > 0)
+    {
+      g_byte_array_remove_range(c->out, 0, size);
+      continue;
+    }
+    if(size < 0 && errno == EINTR) continue;
+    if(size < 0 && errno == EAGAIN) return;
+
+    ZLOG(LOG_ERROR, "reply write error: %s", strerror(errno));
+    g_byte_array_set_size(c->out, 0);
+    g_byte_array_set_size(c->buf, 0);
+    c->eof = 1;
+  }
+}
+
+/* daemon: queue the reply to the client and try to send it */
+static void PutReply(struct Client *c, const uint8_t *data, int size)
+{
+  g_byte_array_append(c->out, data, size);
+  Flush(c);
+}
+
+/*
+ * daemon: read the session report. when the session closed the pipe pass
+ * the (complete) report to the client and release the reply
+ */
+static void ReadReply(int index)
+{
+  struct Reply *r = g_ptr_array_index(replies, index);
+  uint8_t buf[BUFFER_SIZE];
+  ssize_t size;
+
+  for(;;)
+  {
+    size = read(r->fd, buf, sizeof buf);
+    if(size > 0)
+    {
+      g_byte_array_append(r->data, buf, size);
+      continue;
+    }
+    if(size < 0 && errno == EINTR) continue;
+    if(size < 0 && errno == EAGAIN) return;
+    break;
+  }
+
+  /* the session has gone. the broken report would break the framing */
+  --r->client->pending;
+  if(r->data->len > 0 && CommandSize(r->data) == r->data->len)
+    PutReply(r->client, r->data->data, r->data->len);
+  else
+    ZLOGIF(r->data->len > 0, "broken report dropped");
+
+  close(r->fd);
+  g_byte_array_free(r->data, TRUE);
+  g_free(r);
+  g_ptr_array_remove_index(replies, index);
+}
+
+/* daemon: reply to the status request with the daemon statistics */
+static void Status(struct Client *c, uint32_t id)
+{
+  struct DaemonHeader h = {DAEMON_MAGIC, id, 0, DaemonStatus};
+  char *r;
+
+  r = g_strdup_printf("queue = %u\nrunning = %d\nidle = %u\nconnections = %u\n",
+      g_queue_get_length(queue), running, g_queue_get_length(pool),
+      clients->len);
+  h.size = strlen(r);
+  g_byte_array_append(c->out, (uint8_t*)&h, sizeof h);
+  PutReply(c, (uint8_t*)r, h.size);
+  ZLOGS(LOG_DEBUG, "%s", r);
+  g_free(r);
+}
+
+/* daemon: accept a new connection */
+static void Accept(int sock)
 {
   struct sockaddr_un remote;
   socklen_t len = sizeof remote;
-  return accept(sock, &remote, &len);
+  struct Client *c;
+  int fd;
+
+  fd = accept(sock, &remote, &len);
+  if(fd < 0)
+  {
+    ZLOG(LOG_ERROR, "%s", strerror(errno));
+    return;
+  }
+
+  c = g_malloc(sizeof *c);
+  c->fd = fd;
+  c->eof = 0;
+  c->pending = 0;
+  c->waiting = 0;
+  c->buf = g_byte_array_new();
+  c->out = g_byte_array_new();
+  g_ptr_array_add(clients, c);
+}
+
+/*
+ * daemon: queue the complete commands from the connection buffer (as long as
+ * the queue has room), answer the status requests. return -1 if the command
+ * is malformed, otherwise 0
+ */
+static int QueueCommands(struct Client *c, int queue_size)
+{
+  int64_t size;
+
+  while(g_queue_get_length(queue) < queue_size
+      && (size = CommandSize(c->buf)) != 0)
+  {
+    struct DaemonHeader *h = (struct DaemonHeader*)c->buf->data;
+
+    if(size < 0) return -1;
+    if(IsBinary(c->buf->data, size) && h->type == DaemonStatus)
+      Status(c, h->id);
+    else
+    {
+      struct Command *cmd = g_malloc(sizeof *cmd);
+      cmd->client = c;
+      cmd->data = g_byte_array_sized_new(size);
+      g_byte_array_append(cmd->data, c->buf->data, size);
+      g_queue_push_tail(queue, cmd);
+      ++c->pending;
+    }
+    g_byte_array_remove_range(c->buf, 0, size);
+  }
+  return 0;
+}
+
+/*
+ * daemon: queue the buffered commands and read the connection while the
+ * queue has room. the commands which did not fit stay in the buffer until
+ * the queue is drained. the client which sent a malformed command is not
+ * read anymore (but gets the replies to the commands already queued)
+ */
+static void Serve(struct Client *c, int queue_size)
+{
+  uint8_t buf[BUFFER_SIZE];
+  int64_t size;
+
+  while(!c->eof)
+  {
+    if(QueueCommands(c, queue_size) < 0)
+    {
+      ZLOG(LOG_ERROR, "malformed command received");
+      g_byte_array_set_size(c->buf, 0);
+      c->eof = 1;
+      break;
+    }
+    if(g_queue_get_length(queue) >= queue_size) break;
+
+    size = recv(c->fd, buf, sizeof buf, MSG_DONTWAIT);
+    if(size > 0)
+      g_byte_array_append(c->buf, buf, size);
+    else if(size < 0 && errno == EINTR)
+      continue;
+    else if(size < 0 && errno == EAGAIN)
+      break;
+    else
+      c->eof = 1;
+  }
+
+  /* the client has gone, queue the rest of its complete commands */
+  if(c->eof && QueueCommands(c, queue_size) < 0)
+    g_byte_array_set_size(c->buf, 0);
+
+  /* the complete commands which did not fit wait for the free slots */
+  if(!c->waiting && CommandSize(c->buf) > 0)
+  {
+    c->waiting = 1;
+    g_queue_push_tail(backlog, c);
+  }
+}
+
+/*
+ * daemon: close the connections which have gone, have no commands left to
+ * queue and no replies to wait for or to send
+ */
+static void Prune()
+{
+  int i;
+
+  for(i = clients->len - 1; i >= 0; --i)
+  {
+    struct Client *c = g_ptr_array_index(clients, i);
+
+    if(!c->eof || CommandSize(c->buf) != 0 || c->waiting) continue;
+    if(c->pending > 0 || c->out->len > 0) continue;
+
+    close(c->fd);
+    g_byte_array_free(c->buf, TRUE);
+    g_byte_array_free(c->out, TRUE);
+    g_free(c);
+    g_ptr_array_remove_index(clients, i);
+  }
+}
+
+/*
+ * daemon: wait for the connections, commands and session reports. return
+ * when the child is spawned (or the pooled child got a job). when the queue
+ * is full the connections are not read (the commands stay in the sockets)
+ */
+static void Listen(int sock, struct Manifest *manifest)
+{
+  struct pollfd *fds = NULL;
+  int full;
+  int n;
+  int m;
+  int i;
+
+  for(;;)
+  {
+    /* start queued sessions and replenish the pool */
+    if(Dispatch(sock, manifest->limit)) break;
+    if(FillPool(sock, manifest->pool)) break;
+
+    /*
+     * the freed slots are given to the commands left in the buffers before
+     * waiting: there can be no more events for them. the commands left in
+     * the sockets are polled as soon as the queue has room
+     */
+    n = g_queue_get_length(queue);
+    while(!g_queue_is_empty(backlog)
+        && g_queue_get_length(queue) < manifest->queue)
+    {
+      struct Client *c = g_queue_pop_head(backlog);
+      c->waiting = 0;
+      Serve(c, manifest->queue);
+    }
+    if(g_queue_get_length(queue) > n && running < manifest->limit) continue;
+    Prune();
+
+    /* wait for connections, commands, reports and finished children */
+    n = clients->len;
+    m = replies->len;
+    full = g_queue_get_length(queue) >= manifest->queue;
+    fds = g_realloc(fds, (n + m + 2) * sizeof *fds);
+    fds[0].fd = sock;
+    fds[0].events = full ? 0 : POLLIN;
+    fds[1].fd = sigchld;
+    fds[1].events = POLLIN;
+    for(i = 0; i < n; ++i)
+    {
+      struct Client *c = g_ptr_array_index(clients, i);
+      fds[i + 2].events = (full || c->eof ? 0 : POLLIN)
+          | (c->out->len > 0 ? POLLOUT : 0);
+      fds[i + 2].fd = fds[i + 2].events == 0 ? -1 : c->fd; /* hangup ignored */
+    }
+    for(i = 0; i < m; ++i)
+    {
+      fds[i + n + 2].fd = ((struct Reply*)g_ptr_array_index(replies, i))->fd;
+      fds[i + n + 2].events = POLLIN;
+    }
+    if(poll(fds, n + m + 2, -1) < 0)
+    {
+      ZLOGIF(errno != EINTR, "%s", strerror(errno));
+      continue;
+    }
+
+    /* release finished children */
+    if(fds[1].revents & POLLIN) Reap();
+
+    /* collect reports (backwards: finished report is removed) */
+    for(i = m - 1; i >= 0; --i)
+      if(fds[i + n + 2].revents != 0) ReadReply(i);
+
+    /* serve connections */
+    for(i = 0; i < n; ++i)
+    {
+      struct Client *c = g_ptr_array_index(clients, i);
+
+      if(fds[i + 2].revents & (POLLOUT | POLLERR | POLLHUP)) Flush(c);
+      if(fds[i + 2].revents & ~POLLOUT) Serve(c, manifest->queue);
+    }
+
+    /* accept a new connection */
+    if(fds[0].revents & POLLIN) Accept(sock);
+  }
+
+  g_free(fds);
+}
+
+/* daemon: initialize admission control and children tracking */
+static void ListenCtor(struct Manifest *manifest)
+{
+  sigset_t mask;
+
+  GetCores();
+  if(manifest->limit == 0) manifest->limit = cpus_number;
+  if(manifest->queue == 0) manifest->queue = QUEUE_SIZE;
+  clients = g_ptr_array_new();
+  replies = g_ptr_array_new();
+  queue = g_queue_new();
+  backlog = g_queue_new();
+  pool = g_queue_new();
+  children = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+  /* children are reaped as soon as SIGCHLD received */
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
+  ZLOGFAIL(sigprocmask(SIG_BLOCK, &mask, NULL) < 0, EFAULT, "%s", strerror(errno));
+  sigchld = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  ZLOGFAIL(sigchld < 0, EFAULT, "%s", strerror(errno));
 }
 
 /* convert to the daemon mode */
@@ -119,8 +932,13 @@ static int Daemonize(struct NaClApp *nap)
   struct sigaction sa;
   struct sockaddr_un remote = {AF_UNIX, ""};
 
-  /* unmount channels, reset timeout */
+  /*
+   * unmount channels (except resident ones), fix channels layout for
+   * children, reset timeout
+   */
+  PreloadKeepResident();
   ChannelsDtor(nap->manifest);
+  SortChannels(nap->manifest->channels);
   nap->manifest->timeout = 0;
   alarm(0);
 
@@ -157,7 +975,7 @@ static int Daemonize(struct NaClApp *nap)
   sock = socket(AF_UNIX, SOCK_STREAM, 0);
   strcpy(remote.sun_path, nap->manifest->job);
   ZLOGFAIL(bind(sock, &remote, sizeof remote) < 0, EIO, "%s", strerror(errno));
-  ZLOGFAIL(listen(sock, QUEUE_SIZE) < 0, EIO, "%s", strerror(errno));
+  ZLOGFAIL(listen(sock, nap->manifest->queue) < 0, EIO, "%s", strerror(errno));
 
   /* set name for daemon */
   bname = g_path_get_basename(nap->manifest->job);
@@ -174,7 +992,6 @@ static int Daemonize(struct NaClApp *nap)
 int Daemon(struct NaClApp *nap)
 {
   pid_t pid;
-  siginfo_t info;
   int sock;
 
   /* can the daemon be started? */
@@ -184,6 +1001,13 @@ int Daemon(struct NaClApp *nap)
   /* report the daemon mode launched */
   SetDaemonState(1);
 
+  /*
+   * the session ends here: close its network channels before fork() and
+   * leave no network state to the daemon. spawned sessions mount them and
+   * exchange with the name service by themselves
+   */
+  ChannelsNetDtor(nap->manifest);
+
   /* finalize user session */
   umask(0);
   pid = fork();
@@ -191,34 +1015,11 @@ int Daemon(struct NaClApp *nap)
 
   /* forked sessions are not in daemon mode */
   SetDaemonState(0);
+  ListenCtor(nap->manifest);
   sock = Daemonize(nap);
 
-  for(;;)
-  {
-    /* get the next job */
-    if((client = Job(sock)) < 0)
-    {
-      ZLOG(LOG_ERROR, "%s", strerror(errno));
-      continue;
-    }
-
-    /* release waiting child sessions */
-    do
-      if(waitid(P_ALL, 0, &info, WEXITED | WNOHANG) < 0) break;
-    while(info.si_code);
-
-    /* child: update manifest, continue to the trap */
-    pid = fork();
-    if(pid == 0)
-    {
-      UpdateSession(nap->manifest);
-      break;
-    }
-
-    /* daemon: close command socket and wait for a new job */
-    close(client);
-    ZLOGIF(pid < 0, "fork failed: %s", strerror(errno));
-  }
-
+  /* child: update manifest, continue to the trap */
+  Listen(sock, nap->manifest);
+  UpdateSession(nap->manifest);
   return -1;
 }
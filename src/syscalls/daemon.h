@@ -18,6 +18,26 @@
 
 #include "src/loader/sel_ldr.h"
 
+/*
+ * binary daemon command and reply header (host byte order). the command
+ * body format is described in daemon.txt, the reply body is the report
+ */
+#define DAEMON_MAGIC 0x434d565a /* "ZVMC" */
+struct DaemonHeader
+{
+  uint32_t magic;
+  uint32_t id; /* request id given by the client, returned with the reply */
+  uint32_t size; /* body size */
+  uint32_t type; /* enum DaemonCommands */
+};
+
+/* binary commands */
+enum DaemonCommands
+{
+  DaemonSession, /* spawn session */
+  DaemonStatus /* get queue depth, running and idle children numbers */
+};
+
 /*
  * convert current session to daemon mode. after each new session spawning
  * this function will return to trap to serve the new session. if there is
@@ -15,49 +15,103 @@
  */
 
 /*
- * TODO(d'b): design (under construction)
  * image consist of 4 main parts:
- * 1. user memory map (for mprotect()'ion)
- * 2. user memory dump
- * 3. user context (registers) + user_ret (user entry point)
+ * 1. header (64kb): magic, nap fields, user memory map, user context
+ * 2. dump extents table (runs of non-empty 64kb user pages)
+ * 3. user memory dump (64kb aligned, only pages listed in extents table)
  * 4. manifest (text file, variable size, ends with eof)
  *
  * to save image
- * - check session status (should be "ok")
- * - check "Save" value
- * - catch TrapSave (drop, hold, shot, snap)
+ * - check session status (should be "ok") and "Save" value
+ * - catch TrapSave
+ * - scan user memory map skipping inaccessible regions, the hole and
+ *   user manifest. pages never touched by the user (neither present nor
+ *   swapped out, see /proc/self/pagemap) and pages filled with zeroes are
+ *   not stored
  * - store all mentioned above data into the file
  *
- * to restore image (zerovm initialization as usual)
- * - allocate user space
- * - read (to user space) memory map (it is 64kb)
- * - read (to user space) memory dump until hole (infer from map)
- * - read (to user space) the rest (user manifest and stack)
- * - read user context and initialize nacl_sys
- * - reconstruct nap from data above (nap->sysret to TrapSave retcode)
- * - return to user code (user_ret from image contain entry point)
+ * to restore image (zerovm initialization as usual, "Program" is image)
+ * - reconstruct nap from the header and allocate user space
+ * - read text and rodata extents to the anonymous user memory: the code
+ *   validated later must not be paged in again from the file. map
+ *   (MAP_PRIVATE) the other extents to user space, their pages will be read
+ *   lazily on the 1st access
+ * - install trampoline, apply memory protection. the text will be
+ *   validated by main() as usual
+ * - read old manifest from image and check it up against the new one
+ * - set user context. TrapSave returns 1 to the restored session
+ * - zerovm continues as usual: channels, heap, user manifest are
+ *   (re)constructed from the new manifest, CreateSession() keeps context
  *
- * CHANGES IN ZEROVM DESIGN
- * - main() loading of program with all checks allocations should be wrapped and carried out
- * - CreateSession() should not set user stack and affected things
- * - add manifest text to nap or manifest
+ * note: jailed (zvm_jail) memory is restored as read/write data
  */
 #include <stdio.h>
 #include <assert.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "src/loader/sel_ldr.h"
-#include "src/main/zlog.h"
+#include "src/loader/sel_addrspace.h"
+#include "src/main/report.h"
+#include "src/platform/sel_memory.h"
+#include "src/syscalls/switch_to_app.h"
+#include "src/channels/channel.h"
 #include "src/syscalls/snapshot.h"
 
+#define MAGIC 0x3030474d494d565aULL
+#define HEADER_SIZE NACL_MAP_PAGESIZE
+
+/* memory map element. addresses are user addresses */
+struct ImageBlock
+{
+  uint64_t start;
+  uint64_t size;
+  int64_t prot;
+};
+
+/* run of non-empty user pages stored in the image */
+struct ImageExtent
+{
+  uint64_t start; /* user address */
+  uint64_t size;
+  uint64_t offset; /* image file offset */
+  int64_t idx; /* memory map index */
+};
+
+struct ImageHeader
+{
+  uint64_t magic;
+
+  /* nap fields */
+  uint64_t static_text_end;
+  uint64_t dynamic_text_start;
+  uint64_t dynamic_text_end;
+  uint64_t rodata_start;
+  uint64_t data_start;
+  uint64_t data_end;
+  uint64_t break_addr;
+  uint64_t heap_end;
+  uint64_t initial_entry_pt;
+  uint64_t stack_size;
+
+  struct ImageBlock map[MemMapSize];
+  struct ThreadContext context;
+  uint64_t extents; /* extents number */
+  uint64_t manifest; /* manifest offset */
+  uint64_t manifest_size;
+};
+
 static int image = -1;
+static int pagemap = -1; /* /proc/self/pagemap while saving */
+static struct ImageHeader header;
+static struct ImageExtent *loaded = NULL; /* extents of the restored session */
+static int loaded_number = 0;
 
 /*
  * return 0: given file contains session, -1: random file
- * note: initializes image handler
+ * note: initializes image handler and header
  */
-#define MAGIC 0x3030474d494d565aULL
 static int IsImage(const char *name)
 {
-  uint64_t magic = 0;
   int code;
 
   /* open image */
@@ -65,111 +119,441 @@ static int IsImage(const char *name)
     image = open(name, O_RDONLY);
   if(image < 0) return -1;
 
-  /* read "magic" */
-  code = read(image, &magic, sizeof magic);
-  return code == sizeof magic ? magic == MAGIC ? 0 : -1 : -1;
+  /* read header and check "magic" */
+  code = pread(image, &header, sizeof header, 0);
+  if(code == sizeof header && header.magic == MAGIC) return 0;
+
+  close(image);
+  image = -1;
+  return -1;
 }
 
-/* get memory map from system */
-static void *GetSystemMemoryMap()
+/* write the whole buffer to image at offset. 0: success, -1: failed */
+static int Write(const void *buffer, uint64_t size, uint64_t offset)
 {
-  return NULL;
+  while(size > 0)
+  {
+    ssize_t code = pwrite(image, buffer, size, offset);
+    if(code <= 0) return -1;
+    buffer = (char*)buffer + code;
+    offset += code;
+    size -= code;
+  }
+  return 0;
 }
 
-/* save memory map to image */
-static int SaveMemoryMap(void *map)
+/* read the whole buffer from image at offset. 0: success, -1: failed */
+static int Read(void *buffer, uint64_t size, uint64_t offset)
 {
-  return -1;
+  while(size > 0)
+  {
+    ssize_t code = pread(image, buffer, size, offset);
+    if(code <= 0) return -1;
+    buffer = (char*)buffer + code;
+    offset += code;
+    size -= code;
+  }
+  return 0;
 }
 
-/* save 1st part of user memory dump to image */
-static int SaveMemory1(struct NaClApp *nap, void *map)
+int IsLoaded(struct NaClApp *nap, uintptr_t page)
 {
-  return -1;
+  int i;
+
+  if(loaded == NULL) return 0;
+  page = NaClSysToUser(nap, page);
+  for(i = 0; i < loaded_number; ++i)
+    if(page >= loaded[i].start && page < loaded[i].start + loaded[i].size)
+      return 1;
+  return 0;
 }
 
-/* save 2nd part of user memory dump to image */
-static int SaveMemory2(struct NaClApp *nap, void *map)
+/* return 1 if 64kb page is empty (never touched or zeroed), otherwise 0 */
+static int IsEmptyPage(struct NaClApp *nap, uintptr_t page)
 {
-  return -1;
+  uint64_t *p = (uint64_t*)page;
+  int i;
+
+  /*
+   * anonymous page neither present nor swapped out was never touched. note:
+   * mincore() cannot tell it from the swapped out one
+   */
+  if(!IsLoaded(nap, page) && pagemap >= 0
+      && NaCl_page_untouched(pagemap, (void*)page, NACL_MAP_PAGESIZE))
+    return 1;
+
+  for(i = 0; i < NACL_MAP_PAGESIZE / sizeof *p; ++i)
+    if(p[i] != 0) return 0;
+  return 1;
+}
+
+/* get memory map from system and build the list of non-empty pages runs */
+static GArray *GetSystemMemoryMap(struct NaClApp *nap)
+{
+  GArray *extents = g_array_new(FALSE, TRUE, sizeof(struct ImageExtent));
+  uint64_t offset;
+  int i;
+
+  for(i = LeftBumperIdx; i < MemMapSize; ++i)
+  {
+    struct MemBlock *block = &nap->mem_map[i];
+    struct ImageExtent *last = NULL;
+    uintptr_t page;
+
+    /* user manifest will be reconstructed, trampoline reinstalled */
+    if(block->prot == PROT_NONE || i == SysDataIdx) continue;
+    page = i == TextIdx ? nap->mem_start + NACL_TRAMPOLINE_END : block->start;
+
+    for(; page < block->end; page += NACL_MAP_PAGESIZE)
+    {
+      if(IsEmptyPage(nap, page))
+      {
+        last = NULL;
+        continue;
+      }
+
+      /* append page to the current run or start a new one */
+      if(last != NULL)
+      {
+        last->size += NACL_MAP_PAGESIZE;
+        continue;
+      }
+      g_array_set_size(extents, extents->len + 1);
+      last = &g_array_index(extents, struct ImageExtent, extents->len - 1);
+      last->start = NaClSysToUser(nap, page);
+      last->size = NACL_MAP_PAGESIZE;
+      last->idx = i;
+    }
+  }
+
+  /* calculate file offsets of extents */
+  offset = ROUNDUP_64K(HEADER_SIZE + extents->len * sizeof(struct ImageExtent));
+  for(i = 0; i < extents->len; ++i)
+  {
+    g_array_index(extents, struct ImageExtent, i).offset = offset;
+    offset += g_array_index(extents, struct ImageExtent, i).size;
+  }
+
+  return extents;
+}
+
+/* save memory map to image */
+static int SaveMemoryMap(struct NaClApp *nap, GArray *extents)
+{
+  int i;
+
+  header.magic = MAGIC;
+  header.static_text_end = nap->static_text_end;
+  header.dynamic_text_start = nap->dynamic_text_start;
+  header.dynamic_text_end = nap->dynamic_text_end;
+  header.rodata_start = nap->rodata_start;
+  header.data_start = nap->data_start;
+  header.data_end = nap->data_end;
+  header.break_addr = nap->break_addr;
+  header.heap_end = nap->heap_end;
+  header.initial_entry_pt = nap->initial_entry_pt;
+  header.stack_size = nap->stack_size;
+
+  for(i = LeftBumperIdx; i < MemMapSize; ++i)
+  {
+    header.map[i].start = nap->mem_map[i].start - nap->mem_start;
+    header.map[i].size = nap->mem_map[i].size;
+    header.map[i].prot = nap->mem_map[i].prot;
+  }
+
+  header.extents = extents->len;
+  return Write(extents->data, extents->len * sizeof(struct ImageExtent), HEADER_SIZE);
+}
+
+/* save user memory dump to image */
+static int SaveMemory(struct NaClApp *nap, GArray *extents)
+{
+  int i;
+
+  for(i = 0; i < extents->len; ++i)
+  {
+    struct ImageExtent *e = &g_array_index(extents, struct ImageExtent, i);
+    if(Write((void*)NaClUserToSys(nap, e->start), e->size, e->offset) < 0)
+      return -1;
+  }
+  return 0;
 }
 
-/* save user context to image */
+/* save user context to image (header is written last) */
 static int SaveUserContext(struct NaClApp *nap)
 {
-  return -1;
+  header.context = *nacl_user;
+  return Write(&header, sizeof header, 0);
 }
 
 /* save text manifest to image */
-static int SaveManifest(struct NaClApp *nap)
+static int SaveManifest(struct NaClApp *nap, GArray *extents)
 {
-  return -1;
-}
+  struct ImageExtent *e;
 
-/* .. */
+  if(nap->manifest->text == NULL) return -1;
+
+  /* manifest follows the memory dump */
+  header.manifest = ROUNDUP_64K(HEADER_SIZE
+      + extents->len * sizeof(struct ImageExtent));
+  if(extents->len > 0)
+  {
+    e = &g_array_index(extents, struct ImageExtent, extents->len - 1);
+    header.manifest = e->offset + e->size;
+  }
+  header.manifest_size = strlen(nap->manifest->text);
+
+  return Write(nap->manifest->text, header.manifest_size, header.manifest);
+}
 
-/* load memory map from image to user space */
-static void *LoadMemoryMap(struct NaClApp *nap)
+/* load memory map from image, reconstruct nap and allocate user space */
+static void LoadMemoryMap(struct NaClApp *nap)
 {
-  return NULL;
+  int code;
+
+  nap->static_text_end = header.static_text_end;
+  nap->dynamic_text_start = header.dynamic_text_start;
+  nap->dynamic_text_end = header.dynamic_text_end;
+  nap->rodata_start = header.rodata_start;
+  nap->data_start = header.data_start;
+  nap->data_end = header.data_end;
+  nap->break_addr = header.break_addr;
+  nap->heap_end = header.heap_end;
+  nap->initial_entry_pt = header.initial_entry_pt;
+  nap->stack_size = header.stack_size;
+
+  ZLOGFAIL(nap->data_end > FOURGIG || nap->static_text_end > nap->data_end,
+      ENOEXEC, "invalid image layout");
+
+  /* allocate user space and make image pages writable */
+  AllocAddrSpace(nap);
+  code = NaCl_mprotect((void*)(nap->mem_start + NACL_TRAMPOLINE_START),
+      ROUNDUP_64K(nap->data_end) - NACL_TRAMPOLINE_START,
+      PROT_READ | PROT_WRITE);
+  ZLOGFAIL(0 != code, EFAULT, "cannot make image pages writable");
+
+  /* load extents table */
+  ZLOGFAIL(header.extents > FOURGIG / NACL_MAP_PAGESIZE, ENOEXEC,
+      "invalid image extents number");
+  loaded_number = header.extents;
+  loaded = g_malloc(loaded_number * sizeof *loaded);
+  code = Read(loaded, loaded_number * sizeof *loaded, HEADER_SIZE);
+  ZLOGFAIL(code < 0, EIO, "cannot read image extents");
 }
 
-/* load 1st part of memory dump from image to user space */
-static void LoadMemory1(struct NaClApp *nap, void *map)
+/* return the end of text and rodata (user address, 64kb aligned) */
+static uint64_t ReadOnlyEnd(struct NaClApp *nap)
 {
+  uint64_t end = nap->static_text_end;
+
+  if(nap->rodata_start != 0)
+    end = nap->data_start != 0 ? nap->data_start : nap->break_addr;
+  return MIN(ROUNDUP_64K(end), ROUNDUP_64K(nap->data_end));
 }
 
-/* load 2nd part of memory dump from image to user space */
-static void LoadMemory2(struct NaClApp *nap, void *map)
+/*
+ * load memory dump from image to user space. only the regions which will
+ * be protected by zerovm (text, data, heap, stack) are allowed. text and
+ * rodata are copied, other pages are mapped. pages are read/write and
+ * reprotected later, text is validated later
+ */
+static void LoadMemory(struct NaClApp *nap)
 {
+  struct stat st;
+  uint64_t heap_end;
+  uint64_t stack_start;
+  uint64_t ro_end;
+  int i;
+
+  heap_end = ROUNDUP_64K(nap->manifest->mem_size - nap->stack_size);
+  stack_start = ROUNDUP_64K(FOURGIG - nap->stack_size);
+  ro_end = ReadOnlyEnd(nap);
+  ZLOGFAIL(fstat(image, &st) < 0, errno, "cannot stat image");
+
+  for(i = 0; i < loaded_number; ++i)
+  {
+    struct ImageExtent *e = &loaded[i];
+    uint64_t size = 0;
+    void *p;
+
+    ZLOGFAIL(e->start != ROUNDDOWN_64K(e->start) || e->size == 0
+        || e->size != ROUNDDOWN_64K(e->size)
+        || e->offset != ROUNDDOWN_64K(e->offset)
+        || e->offset + e->size > st.st_size
+        || e->start < NACL_TRAMPOLINE_END || e->start + e->size > FOURGIG
+        || (e->start + e->size > heap_end && e->start < stack_start),
+        ENOEXEC, "invalid image extent %d", i);
+
+    /* text and rodata part of the extent */
+    if(e->start < ro_end)
+    {
+      size = MIN(e->size, ro_end - e->start);
+      ZLOGFAIL(Read((void*)NaClUserToSys(nap, e->start), size, e->offset) < 0,
+          EIO, "cannot read image extent %d", i);
+    }
+    if(size == e->size) continue;
+
+    p = mmap((void*)NaClUserToSys(nap, e->start + size), e->size - size,
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, image,
+        e->offset + size);
+    ZLOGFAIL(p == MAP_FAILED, errno, "cannot map image extent %d", i);
+  }
+
+  /* finish the user space construction */
+  InitSwitchToApp(nap);
+  LoadTrampoline(nap);
+  MemoryProtection(nap);
 }
 
-/* load user context from image to user space */
+/* load user context from image. restored TrapSave returns 1 */
 static void LoadUserContext(struct NaClApp *nap)
 {
+  *nacl_user = header.context;
+  nacl_user->rsp = nap->mem_start + (uint32_t)nacl_user->rsp;
+  nacl_user->rbp = nap->mem_start + (uint32_t)nacl_user->rbp;
+  nacl_user->r15 = nap->mem_start;
+  nacl_user->prog_ctr = NaClSandboxCodeAddr(nap, nacl_user->prog_ctr);
+  nacl_user->sysret = 1;
+}
+
+/* return 1 if the channel is the broadcast relay, otherwise 0 */
+static int IsRelay(struct Manifest *manifest, struct ChannelDesc *channel)
+{
+  int i;
+
+  for(i = 0; manifest->relays != NULL && i < manifest->relays->len; ++i)
+    if(g_ptr_array_index(manifest->relays, i) == channel) return 1;
+  return 0;
+}
+
+/*
+ * return the sorted copy of the user channels. note: the manifest channels
+ * are being mounted and include the broadcast relays
+ */
+static GPtrArray *UserChannels(struct Manifest *manifest)
+{
+  GPtrArray *channels = g_ptr_array_new();
+  int i;
+
+  for(i = 0; i < manifest->channels->len; ++i)
+    if(!IsRelay(manifest, CH_CH(manifest, i)))
+      g_ptr_array_add(channels, CH_CH(manifest, i));
+  SortChannels(channels);
+  return channels;
 }
 
 /* read old manifest from image, and check it up against the new one */
 static void CheckManifest(struct NaClApp *nap)
 {
+  struct Manifest *old;
+  GPtrArray *channels;
+  GPtrArray *old_channels;
+  char *text;
+  int i;
+
+  ZLOGFAIL(header.manifest_size > MANIFEST_SIZE_LIMIT, ENOEXEC,
+      "invalid image manifest size");
+  text = g_malloc0(header.manifest_size + 1);
+  ZLOGFAIL(Read(text, header.manifest_size, header.manifest) < 0,
+      EIO, "cannot read image manifest");
+  old = ManifestTextCtor(text);
+  g_free(text);
+
+  ZLOGFAIL(old->mem_size != nap->manifest->mem_size,
+      EFAULT, "difference in Memory");
+  channels = UserChannels(nap->manifest);
+  old_channels = UserChannels(old);
+  ZLOGFAIL(old_channels->len != channels->len,
+      EFAULT, "difference in channels number");
+
+  for(i = 0; i < channels->len; ++i)
+  {
+    struct ChannelDesc *a = g_ptr_array_index(channels, i);
+    struct ChannelDesc *b = g_ptr_array_index(old_channels, i);
+
+#define CHECK(f) ZLOGFAIL(a->f != b->f, EFAULT, "difference in %s", a->alias)
+    ZLOGFAIL(strcmp(a->alias, b->alias) != 0,
+        EFAULT, "difference in %s", a->alias);
+    CHECK(type);
+    CHECK(limits[0]);
+    CHECK(limits[1]);
+    CHECK(limits[2]);
+    CHECK(limits[3]);
+#undef CHECK
+  }
+
+  g_ptr_array_free(channels, TRUE);
+  g_ptr_array_free(old_channels, TRUE);
+  ManifestDtor(old);
 }
 
 int SaveSession(struct NaClApp *nap)
 {
-  int code;
-  void *map;
+  int code = -1;
+  GArray *extents;
+  char *tmp;
 
-  map = GetSystemMemoryMap();
-  if(map == NULL) return -1;
+  assert(nap != NULL);
+  assert(nap->manifest != NULL);
 
-  code = SaveMemoryMap(map);
-  if(code < 0) return -1;
+  if(nap->manifest->save == NULL || GetExitCode() != 0) return -1;
 
-  code = SaveMemory1(nap, map);
-  if(code < 0) return -1;
+  /*
+   * create the image aside and replace the old one when it is complete: the
+   * restored session maps its memory from the image which can be the same
+   * file, truncating it would take the pages away (SIGBUS)
+   */
+  tmp = g_strdup_printf("%s.XXXXXX", nap->manifest->save);
+  image = mkstemp(tmp);
+  if(image < 0)
+  {
+    g_free(tmp);
+    return -1;
+  }
 
-  code = SaveMemory2(nap, map);
-  if(code < 0) return -1;
+  /* w/o pagemap all pages are scanned for zeroes */
+  pagemap = open("/proc/self/pagemap", O_RDONLY);
+  extents = GetSystemMemoryMap(nap);
+  if(pagemap >= 0) close(pagemap);
+  pagemap = -1;
 
-  code = SaveUserContext(nap);
-  if(code < 0) return -1;
+  if(SaveMemoryMap(nap, extents) == 0
+      && SaveMemory(nap, extents) == 0
+      && SaveManifest(nap, extents) == 0
+      && SaveUserContext(nap) == 0)
+    code = 0;
 
-  code = SaveManifest(nap);
-  if(code < 0) return -1;
+  ZLOGS(LOG_DEBUG, "session saved to %s with %d extents, code = %d",
+      nap->manifest->save, extents->len, code);
+  g_array_free(extents, TRUE);
+  code |= close(image);
+  image = -1;
 
-  return 0;
+  if(code == 0)
+    code = rename(tmp, nap->manifest->save);
+  if(code < 0)
+    unlink(tmp);
+  g_free(tmp);
+
+  return code < 0 ? -1 : 0;
 }
 
 int LoadSession(struct NaClApp *nap, const char *name)
 {
-  void *map;
+  assert(nap != NULL);
+  assert(nap->manifest != NULL);
+
   if(IsImage(name) < 0) return -1;
 
-  map = LoadMemoryMap(nap);
-  LoadMemory1(nap, map);
-  LoadMemory2(nap, map);
-  LoadUserContext(nap);
+  ZLOGS(LOG_DEBUG, "restoring session from %s", name);
   CheckManifest(nap);
+  LoadMemoryMap(nap);
+  LoadMemory(nap);
+  LoadUserContext(nap);
+
+  /* mapped extents hold their own references to the image */
+  close(image);
+  image = -1;
 
   return 0;
 }
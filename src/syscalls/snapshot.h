@@ -19,10 +19,18 @@
 #ifndef SNAPSHOT_H_
 #define SNAPSHOT_H_
 
-/* load session from given image. 0: success, -1: failed */
+#include "src/loader/sel_ldr.h"
+
+/*
+ * load session from given image. 0: success, -1: not an image
+ * note: replaces AppLoadFile() for the images
+ */
 int LoadSession(struct NaClApp *nap, const char *name);
 
 /* store session to image "Save". 0: success, -1: failed */
 int SaveSession(struct NaClApp *nap);
 
+/* return 1 if the page (system address) came from the restored image */
+int IsLoaded(struct NaClApp *nap, uintptr_t page);
+
 #endif /* SNAPSHOT_H_ */
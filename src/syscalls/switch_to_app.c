@@ -21,6 +21,7 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
 #include <assert.h>
 #include "src/main/tools.h"
 #include "src/syscalls/switch_to_app.h"
@@ -32,6 +33,20 @@
 # include <ammintrin.h>
 #endif
 
+/* xsave state components: x87, SSE, AVX, opmask, ZMM_Hi256, Hi16_ZMM */
+#define XSTATE_SCRUB 0xe7
+#define XSTATE_AVX 0x6
+#define XSTATE_AVX512 0xe0
+#define XSTATE_IMAGE_SIZE 576 /* legacy area and xsave header */
+
+/* SwitchXSAVE (to_app.S) data: initial state image and components mask */
+uint8_t XStateInit[XSTATE_IMAGE_SIZE] __attribute__((aligned(64)));
+uint64_t XStateMask = 0;
+
+static uint64_t xcr0 = 0;
+static int cpu_level = 0;
+static int switch_variant = SwitcherAuto;
+
 /* CPUID. "r" should be int[4], "func" = eax */
 #define CPUID(r, func) \
     asm("cpuid" : "=a"(r[0]), "=b"(r[1]), "=c"(r[2]), "=d"(r[3]) : "a"(func), "c"(0))
@@ -47,6 +62,7 @@
  * 6  or above = SSE4.2
  * 7  or above = AVX
  * 8  or above = AVX2
+ * 9           = AVX-512 (AVX-512F with opmask and zmm state enabled)
  */
 static int CPUTest(void)
 {
@@ -74,27 +90,62 @@ static int CPUTest(void)
   TEST_CPU(2, 27, 6);
 
   asm("xgetbv" : "=a"(a),"=d"(d) : "c"(0));
-  if(((a | (((uint64_t)d) << 32)) & 6) != 6) return 6;
+  xcr0 = a | (((uint64_t)d) << 32);
+  if((xcr0 & XSTATE_AVX) != XSTATE_AVX) return 6;
 
   TEST_CPU(2, 28, 6);
   CPUID(r, 7);
   TEST_CPU(1, 5, 7);
+  TEST_CPU(1, 16, 8);
+  if((xcr0 & XSTATE_AVX512) != XSTATE_AVX512) return 8;
 
-  return 8;
+  return 9;
 #undef TEST_CPU
 }
 
+void SetContextSwitch(int variant)
+{
+  switch_variant = variant;
+}
+
+int CPULevel()
+{
+  return cpu_level;
+}
+
 void InitSwitchToApp(struct NaClApp *nap)
 {
   int cpu = CPUTest();
+  int variant = switch_variant;
   char *name[] = {"no SSE", "SSE", "SSE2", "SSE3", "Supplementary SSE3",
-                  "SSE4.1", "SSE4.2", "AVX", "AVX2 or better"};
+                  "SSE4.1", "SSE4.2", "AVX", "AVX2", "AVX-512"};
+  char *switcher[] = {"auto", "SSE", "AVX", "XSAVE"};
 
   UNREFERENCED_PARAMETER(nap);
   assert((unsigned)cpu < ARRAY_SIZE_SAFE(name));
 
   ZLOGS(LOG_DEBUG, "%s cpu detected", name[cpu]);
   ZLOGFAIL(cpu == 0, EFAULT, "zerovm needs at least SSE CPU");
-  ZLOGIF(cpu > 7, "zerovm running on CPU with partial support. UNSAFE!");
-  ContextSwitch = cpu < 7 ? SwitchSSE : SwitchAVX;
+  cpu_level = cpu;
+
+  /* the cheapest switcher which clears all enabled state */
+  if(variant == SwitcherAuto)
+    variant = cpu < 7 ? SwitcherSSE
+        : (xcr0 & XSTATE_AVX512) != 0 ? SwitcherXSAVE : SwitcherAVX;
+
+  /* the forced switcher can leave the host data in the registers */
+  ZLOGFAIL(variant != SwitcherSSE && cpu < 7, EFAULT,
+      "%s switcher is not supported by CPU", switcher[variant]);
+  ZLOGIF(variant == SwitcherSSE && cpu > 6,
+      "SSE switcher on AVX CPU. UNSAFE!");
+  ZLOGIF(variant == SwitcherAVX && (xcr0 & XSTATE_AVX512) != 0,
+      "AVX switcher on AVX-512 CPU. UNSAFE!");
+  ZLOGS(LOG_DEBUG, "%s switcher selected", switcher[variant]);
+
+  /* XRSTOR image: the clean header puts all components to the initial state */
+  memset(XStateInit, 0, sizeof XStateInit);
+  XStateMask = xcr0 & XSTATE_SCRUB;
+
+  ContextSwitch = variant == SwitcherSSE ? SwitchSSE
+      : variant == SwitcherAVX ? SwitchAVX : SwitchXSAVE;
 }
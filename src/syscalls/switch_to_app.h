@@ -30,10 +30,27 @@
 
 EXTERN_C_BEGIN
 
+/* context switchers ("-X" command line switch) */
+enum Switchers {
+  SwitcherAuto, /* the cheapest one clearing all enabled state */
+  SwitcherSSE, /* x87 and xmm */
+  SwitcherAVX, /* x87 and ymm */
+  SwitcherXSAVE, /* XRSTOR of the initial x87, ymm, opmask and zmm state */
+  SwitchersNumber
+};
+
+/* force the context switcher. should be called before InitSwitchToApp() */
+void SetContextSwitch(int variant);
+
+/* detect cpu and choose the context switcher */
 void InitSwitchToApp(struct NaClApp *nap);
 
+/* return cpu level detected by InitSwitchToApp() (see api/zvm.h CPULevels) */
+int CPULevel();
+
 extern NORETURN void SwitchAVX(struct ThreadContext *context);
 extern NORETURN void SwitchSSE(struct ThreadContext *context);
+extern NORETURN void SwitchXSAVE(struct ThreadContext *context);
 NORETURN void (*ContextSwitch)(struct ThreadContext *context);
 
 EXTERN_C_END
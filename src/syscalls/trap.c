@@ -20,10 +20,38 @@
 #include "src/platform/sel_memory.h"
 #include "src/main/setup.h"
 #include "src/syscalls/daemon.h"
+#include "src/syscalls/snapshot.h"
 
-static int idx[] = {TrapRead, TrapWrite, TrapJail, TrapUnjail, TrapExit, TrapFork};
-static char *function[] =
-  {"TrapRead", "TrapWrite", "TrapJail", "TrapUnjail", "TrapExit", "TrapFork", "n/a"};
+#define JAIL_REGIONS_LIMIT 0x1000
+
+/* the traps table slot. all trap ids have distinct slots (see TrapSlots) */
+#define TRAPS_TABLE_SIZE 31
+#define TRAP_SLOT(id) ((uint32_t)(id) % TRAPS_TABLE_SIZE)
+
+/* should be kept in sync with api/zvm.h */
+struct RegionSerialized
+{
+  uint32_t buffer;
+  int32_t size;
+};
+
+/* validated 64kb page: sha256 digest of its contents */
+#define PAGE_DIGEST_SIZE 32
+struct Page
+{
+  uintptr_t addr;
+  int32_t size;
+  guint8 digest[PAGE_DIGEST_SIZE];
+};
+
+/*
+ * validated pages: page address -> (GList*) link of "lru" holding the page.
+ * the recently used pages are at the head, the cache is limited to
+ * VALIDATED_LIMIT pages: the least recently used ones are forgotten
+ */
+#define VALIDATED_LIMIT 0x400 /* 64mb of code */
+static GHashTable *validated = NULL;
+static GQueue lru = G_QUEUE_INIT;
 
 /*
  * check "prot" access for user area (start, size)
@@ -180,6 +208,104 @@ static int32_t ZVMWriteHandle(struct NaClApp *nap,
         sysaddr >= nap->mem_map[HeapIdx].end) return -EINVAL; \
     if(sysaddr != ROUNDDOWN_64K(sysaddr)) return -EINVAL
 
+/* drop the page from the cache */
+static void Forget(uintptr_t page)
+{
+  GList *link = g_hash_table_lookup(validated, (gpointer)page);
+
+  if(link == NULL) return;
+  g_hash_table_remove(validated, (gpointer)page);
+  g_free(link->data);
+  g_queue_delete_link(&lru, link);
+}
+
+/* calculate the digest of the page contents */
+static void Digest(uintptr_t page, int32_t size, guint8 *digest)
+{
+  GChecksum *ctx = g_checksum_new(G_CHECKSUM_SHA256);
+  gsize length = PAGE_DIGEST_SIZE;
+
+  g_checksum_update(ctx, (const guchar*)page, size);
+  g_checksum_get_digest(ctx, digest, &length);
+  g_checksum_free(ctx);
+}
+
+/* cache the valid page, forget the least recently used one if full */
+static void Remember(uintptr_t page, int32_t size)
+{
+  struct Page *p = g_malloc(sizeof *p);
+
+  if(g_queue_get_length(&lru) >= VALIDATED_LIMIT)
+    Forget(((struct Page*)g_queue_peek_tail(&lru))->addr);
+
+  p->addr = page;
+  p->size = size;
+  Digest(page, size, p->digest);
+  g_queue_push_head(&lru, p);
+  g_hash_table_insert(validated, (gpointer)page, g_queue_peek_head_link(&lru));
+}
+
+/* return 1 if the page is validated and not changed since, otherwise 0 */
+static int IsValidated(uintptr_t page, int32_t size)
+{
+  GList *link = g_hash_table_lookup(validated, (gpointer)page);
+  guint8 digest[PAGE_DIGEST_SIZE];
+  struct Page *p;
+
+  if(link == NULL) return 0;
+  p = link->data;
+  if(p->size != size) return 0;
+  Digest(page, size, digest);
+  if(memcmp(p->digest, digest, PAGE_DIGEST_SIZE) != 0) return 0;
+
+  /* move the page to the head */
+  g_queue_unlink(&lru, link);
+  g_queue_push_head_link(&lru, link);
+  return 1;
+}
+
+/*
+ * validate the area page by page skipping the pages validated before and
+ * not changed since. the page is only cached if it is valid by itself, so
+ * it stays valid whatever its neighbours become. it relies on the validator
+ * property: no instruction crosses 32 bytes bundle boundary and the direct
+ * jump leaving the validated segment may only target the bundle boundary.
+ * so every jump between the pages valid by themselves lands on the
+ * instruction start. if the page fails (e.g. the code jumps inside the
+ * instruction of the other page) the whole area is validated as usual.
+ * return 0 if the area is valid
+ */
+static int Validate(uintptr_t area, int32_t size)
+{
+  uintptr_t page;
+  int32_t n;
+
+  if(validated == NULL)
+    validated = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+  for(page = area; page < area + size; page += NACL_MAP_PAGESIZE)
+  {
+    n = MIN(NACL_MAP_PAGESIZE, area + size - page);
+    if(IsValidated(page, n)) continue;
+
+    Forget(page);
+    if(NaClSegmentValidates((uint8_t*)page, n, page) == 0)
+      return NaClSegmentValidates((uint8_t*)area, size, area) == 0 ? -1 : 0;
+
+    Remember(page, n);
+  }
+  return 0;
+}
+
+/* check and validate given buffer. return 0 if it can be jailed */
+static int32_t ZVMValidateHandle(struct NaClApp *nap, uintptr_t addr, int32_t size)
+{
+  JAIL_CHECK;
+
+  result = Validate(sysaddr, size);
+  return result == 0 ? 0 : -EPERM;
+}
+
 /*
  * validate given buffer and, if successful, change protection to
  * read / execute and return 0
@@ -189,8 +315,8 @@ static int32_t ZVMJailHandle(struct NaClApp *nap, uintptr_t addr, int32_t size)
   JAIL_CHECK;
 
   /* validate */
-  result = NaClSegmentValidates((uint8_t*)sysaddr, size, sysaddr);
-  if(result == 0) return -EPERM;
+  result = ZVMValidateHandle(nap, addr, size);
+  if(result != 0) return result;
 
   /* protect */
   result = NaCl_mprotect((void*)sysaddr, size, PROT_READ | PROT_EXEC);
@@ -199,6 +325,48 @@ static int32_t ZVMJailHandle(struct NaClApp *nap, uintptr_t addr, int32_t size)
   return 0;
 }
 
+/*
+ * validate "count" regions and, if all of them are valid, jail them and
+ * return 0. otherwise nothing is jailed: if the protection of a region
+ * fails the regions jailed before are made read / write again
+ */
+static int32_t ZVMJailvHandle(struct NaClApp *nap, uintptr_t addr, int32_t count)
+{
+  struct RegionSerialized *regions;
+  int32_t result;
+  int i;
+
+  if(count <= 0 || count > JAIL_REGIONS_LIMIT) return -EINVAL;
+  if(CheckRAMAccess(nap, addr, count * sizeof *regions, PROT_READ) != 0)
+    return -EINVAL;
+  regions = (void*)NaClUserToSys(nap, addr);
+
+  for(i = 0; i < count; ++i)
+  {
+    result = ZVMValidateHandle(nap, regions[i].buffer, regions[i].size);
+    if(result != 0) return result;
+  }
+
+  for(i = 0; i < count; ++i)
+  {
+    result = NaCl_mprotect((void*)NaClUserToSys(nap, regions[i].buffer),
+        regions[i].size, PROT_READ | PROT_EXEC);
+    if(result != 0) break;
+  }
+
+  /* roll back */
+  if(i < count)
+  {
+    while(--i >= 0)
+      ZLOGIF(NaCl_mprotect((void*)NaClUserToSys(nap, regions[i].buffer),
+          regions[i].size, PROT_READ | PROT_WRITE) != 0,
+          "cannot unjail region %d", i);
+    return -EACCES;
+  }
+
+  return 0;
+}
+
 /* change protection to read / write and return 0 if successful */
 static int32_t ZVMUnjailHandle(struct NaClApp *nap, uintptr_t addr, int32_t size)
 {
@@ -210,32 +378,108 @@ static int32_t ZVMUnjailHandle(struct NaClApp *nap, uintptr_t addr, int32_t size
 
   return 0;
 }
-#undef JAIL_CHECK
 
-/* return index of function id in "function" */
-static int FunctionIndexById(int id)
+/*
+ * return the heap pages to the host. the area becomes read / write (the
+ * released jailed code must not be executed as zeroes) and zero filled.
+ * MADV_DONTNEED keeps the heap mapping intact, only the pages of the restored
+ * session (mapped from the image) are replaced with the fresh anonymous ones:
+ * MADV_DONTNEED would bring back the image contents there
+ */
+static int32_t ZVMReleaseHandle(struct NaClApp *nap, uintptr_t addr, int32_t size)
 {
-  int i;
+  int32_t i;
+  int32_t j;
+  int image;
+  JAIL_CHECK;
+
+  /* the whole area should be inside the heap and consist of 64kb pages */
+  if(size != ROUNDDOWN_64K(size)) return -EINVAL;
+  if(sysaddr + size > nap->mem_map[HeapIdx].end) return -EINVAL;
+
+  result = NaCl_mprotect((void*)sysaddr, size, PROT_READ | PROT_WRITE);
+  if(result != 0) return -EACCES;
 
-  for(i = 0; i < ARRAY_SIZE(idx); ++i)
-    if(idx[i] == id) return i;
-  return ARRAY_SIZE(idx);
+  /* release the runs of the image and the anonymous pages */
+  for(i = 0; i < size; i = j)
+  {
+    image = IsLoaded(nap, sysaddr + i);
+    for(j = i + NACL_MAP_PAGESIZE; j < size
+        && IsLoaded(nap, sysaddr + j) == image; j += NACL_MAP_PAGESIZE);
+
+    if(image)
+    {
+      if(mmap((void*)(sysaddr + i), j - i, PROT_READ | PROT_WRITE,
+          MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED)
+        return -errno;
+      AdviseHeap(nap, sysaddr + i, j - i);
+    }
+    else if(madvise((void*)(sysaddr + i), j - i, MADV_DONTNEED) != 0)
+      return -errno;
+  }
+
+  /* forget the released validated pages */
+  for(i = 0; validated != NULL && i < size; i += NACL_MAP_PAGESIZE)
+    Forget(sysaddr + i);
+
+  return 0;
 }
+#undef JAIL_CHECK
+
+/* the trap handler gets the trap arguments in the system space */
+typedef int32_t (*TrapFunction)(struct NaClApp *nap, uint64_t *args);
 
-static void SyscallZTrace(int i, ...)
+/* ztrace of the trap. only reads the arguments the trap has */
+struct Trap;
+typedef void (*TraceFunction)(const struct Trap *trap,
+    uint64_t *args, int32_t retcode);
+
+struct Trap
+{
+  uint64_t id;
+  TrapFunction handle;
+  char *name;
+  TraceFunction trace;
+};
+
+static void SyscallZTrace(const char *fmt, ...)
 {
   char *msg;
   va_list ap;
-  char *fmt[] = {"%s(%d, %p, %d, %ld) = %d", "%s(%d, %p, %d, %ld) = %d",
-      "%s(%p, %d) = %d", "%s(%p, %d) = %d", "%s(%d) = %d", "%s()"};
 
-  va_start(ap, i);
-  msg = g_strdup_vprintf(fmt[i], ap);
+  va_start(ap, fmt);
+  msg = g_strdup_vprintf(fmt, ap);
   va_end(ap);
   ZTrace(msg);
   g_free(msg);
 }
 
+/* trap(id, 0, desc, buffer, size, offset) */
+static void TraceIO(const struct Trap *trap, uint64_t *args, int32_t retcode)
+{
+  SyscallZTrace("%s(%d, %p, %d, %ld) = %d", trap->name, (int)args[2],
+      (void*)args[3], (int32_t)args[4], (int64_t)args[5], retcode);
+}
+
+/* trap(id, 0, buffer, size) */
+static void TraceArea(const struct Trap *trap, uint64_t *args, int32_t retcode)
+{
+  SyscallZTrace("%s(%p, %d) = %d", trap->name,
+      (void*)args[2], (int32_t)args[3], retcode);
+}
+
+/* trap(id, 0, code) */
+static void TraceCode(const struct Trap *trap, uint64_t *args, int32_t retcode)
+{
+  SyscallZTrace("%s(%d)", trap->name, (int32_t)args[2]);
+}
+
+/* trap(id) */
+static void TraceVoid(const struct Trap *trap, uint64_t *args, int32_t retcode)
+{
+  SyscallZTrace("%s() = %d", trap->name, retcode);
+}
+
 /* user exit. session is finished */
 static void ZVMExitHandle(struct NaClApp *nap, int32_t code)
 {
@@ -245,63 +489,129 @@ static void ZVMExitHandle(struct NaClApp *nap, int32_t code)
   if(GetExitCode() == 0)
     SetExitState(OK_STATE);
   ZLOGS(LOG_DEBUG, "SESSION %d RETURNED %d", nap->manifest->node, code);
-  SyscallZTrace(4, function[4], code);
+  if(ztrace_enabled) SyscallZTrace("%s(%d)", "TrapExit", code);
   ReportDtor(0);
 }
 
+/* the table handlers: unpack the arguments for the trap functions */
+static int32_t TrapReadHandle(struct NaClApp *nap, uint64_t *args)
+{
+  return ZVMReadHandle(nap,
+      (int)args[2], (char*)args[3], (int32_t)args[4], args[5]);
+}
+
+static int32_t TrapWriteHandle(struct NaClApp *nap, uint64_t *args)
+{
+  return ZVMWriteHandle(nap,
+      (int)args[2], (char*)args[3], (int32_t)args[4], args[5]);
+}
+
+static int32_t TrapJailHandle(struct NaClApp *nap, uint64_t *args)
+{
+  return ZVMJailHandle(nap, (uint32_t)args[2], (int32_t)args[3]);
+}
+
+static int32_t TrapUnjailHandle(struct NaClApp *nap, uint64_t *args)
+{
+  return ZVMUnjailHandle(nap, (uint32_t)args[2], (int32_t)args[3]);
+}
+
+static int32_t TrapExitHandle(struct NaClApp *nap, uint64_t *args)
+{
+  ZVMExitHandle(nap, (int32_t)args[2]);
+  return 0; /* unreachable */
+}
+
+static int32_t TrapForkHandle(struct NaClApp *nap, uint64_t *args)
+{
+  if(Daemon(nap) == 0)
+  {
+    if(ztrace_enabled) SyscallZTrace("%s()", "TrapFork");
+    ZVMExitHandle(nap, 0);
+  }
+  return 0;
+}
+
+static int32_t TrapSaveHandle(struct NaClApp *nap, uint64_t *args)
+{
+  return SaveSession(nap) == 0 ? 0 : -EIO;
+}
+
+static int32_t TrapReleaseHandle(struct NaClApp *nap, uint64_t *args)
+{
+  return ZVMReleaseHandle(nap, (uint32_t)args[2], (int32_t)args[3]);
+}
+
+static int32_t TrapJailvHandle(struct NaClApp *nap, uint64_t *args)
+{
+  return ZVMJailvHandle(nap, (uint32_t)args[2], (int32_t)args[3]);
+}
+
+static int32_t TrapUnsupportedHandle(struct NaClApp *nap, uint64_t *args)
+{
+  ZLOG(LOG_ERROR, "function %ld is not supported", *args);
+  return -EPERM;
+}
+
+/* traps table indexed by TRAP_SLOT(id) */
+static const struct Trap traps[TRAPS_TABLE_SIZE] = {
+  [TRAP_SLOT(TrapRead)] = {TrapRead, TrapReadHandle, "TrapRead", TraceIO},
+  [TRAP_SLOT(TrapWrite)] = {TrapWrite, TrapWriteHandle, "TrapWrite", TraceIO},
+  [TRAP_SLOT(TrapJail)] = {TrapJail, TrapJailHandle, "TrapJail", TraceArea},
+  [TRAP_SLOT(TrapUnjail)] = {TrapUnjail, TrapUnjailHandle,
+      "TrapUnjail", TraceArea},
+  [TRAP_SLOT(TrapExit)] = {TrapExit, TrapExitHandle, "TrapExit", TraceCode},
+  [TRAP_SLOT(TrapFork)] = {TrapFork, TrapForkHandle, "TrapFork", TraceVoid},
+  [TRAP_SLOT(TrapSave)] = {TrapSave, TrapSaveHandle, "TrapSave", TraceVoid},
+  [TRAP_SLOT(TrapRelease)] = {TrapRelease, TrapReleaseHandle,
+      "TrapRelease", TraceArea},
+  [TRAP_SLOT(TrapJailv)] = {TrapJailv, TrapJailvHandle,
+      "TrapJailv", TraceArea},
+};
+
+static const struct Trap unsupported =
+    {0, TrapUnsupportedHandle, "n/a", TraceVoid};
+
+/* never called. fails to compile ("duplicate case") if the slots collide */
+static inline void TrapSlots(uint32_t id)
+{
+  switch(id)
+  {
+    case TRAP_SLOT(TrapRead): case TRAP_SLOT(TrapWrite):
+    case TRAP_SLOT(TrapJail): case TRAP_SLOT(TrapUnjail):
+    case TRAP_SLOT(TrapExit): case TRAP_SLOT(TrapFork):
+    case TRAP_SLOT(TrapSave): case TRAP_SLOT(TrapRelease):
+    case TRAP_SLOT(TrapJailv):
+      break;
+  }
+}
+
 int32_t TrapHandler(struct NaClApp *nap, uint32_t args)
 {
+  const struct Trap *trap;
   uint64_t *sargs;
-  int retcode = 0;
-  int i;
+  int32_t retcode;
 
   assert(nap != NULL);
   assert(nap->manifest != NULL);
 
   /*
-   * translate address from user space to system
+   * translate address from user space to system and find the trap
    * note: cannot set "trap error"
    */
   sargs = (uint64_t*)NaClUserToSys(nap, (uintptr_t)args);
-  i = FunctionIndexById(*sargs);
-  ZLOGS(LOG_DEBUG, "%s called", function[i]);
-  ZTrace("untrusted code");
+  trap = &traps[TRAP_SLOT(*sargs)];
+  if(G_UNLIKELY(trap->id != *sargs || trap->handle == NULL))
+    trap = &unsupported;
 
-  switch(*sargs)
-  {
-    case TrapFork:
-      if(Daemon(nap) == 0)
-      {
-        SyscallZTrace(5, function[5]);
-        ZVMExitHandle(nap, 0);
-      }
-      break;
-    case TrapExit:
-      ZVMExitHandle(nap, (int32_t)sargs[2]);
-      break;
-    case TrapRead:
-      retcode = ZVMReadHandle(nap,
-          (int)sargs[2], (char*)sargs[3], (int32_t)sargs[4], sargs[5]);
-      break;
-    case TrapWrite:
-      retcode = ZVMWriteHandle(nap,
-          (int)sargs[2], (char*)sargs[3], (int32_t)sargs[4], sargs[5]);
-      break;
-    case TrapJail:
-      retcode = ZVMJailHandle(nap, (uint32_t)sargs[2], (int32_t)sargs[3]);
-      break;
-    case TrapUnjail:
-      retcode = ZVMUnjailHandle(nap, (uint32_t)sargs[2], (int32_t)sargs[3]);
-      break;
-    default:
-      retcode = -EPERM;
-      ZLOG(LOG_ERROR, "function %ld is not supported", *sargs);
-      break;
-  }
+  ZLOGS(LOG_DEBUG, "%s called", trap->name);
+  if(G_UNLIKELY(ztrace_enabled)) ZTrace("untrusted code");
+
+  retcode = trap->handle(nap, sargs);
 
   /* report, ztrace and return */
-  FastReport();
-  ZLOGS(LOG_DEBUG, "%s returned %d", function[i], retcode);
-  SyscallZTrace(i, function[i], sargs[2], sargs[3], sargs[4], sargs[5], retcode);
+  if(G_UNLIKELY(fast_report)) FastReport();
+  ZLOGS(LOG_DEBUG, "%s returned %d", trap->name, retcode);
+  if(G_UNLIKELY(ztrace_enabled)) trap->trace(trap, sargs, retcode);
   return retcode;
 }
@@ -0,0 +1,366 @@
+/*
+ * tcp name server. serves many clusters at once: each node connects,
+ * sends the header (magic, cluster id, nodes number) and the parcel and
+ * gets them back with resolved "connect" records when all nodes of its
+ * cluster reported. see doc/name_server.txt
+ *
+ * usage: ns_server [port]
+ *
+ * Copyright (c) 2013, LiteStack, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <glib.h>
+
+#define STREAM_MAGIC 0x5a4e5332 /* "ZNS2" */
+#define HEADER_SIZE 16 /* magic, cluster id, nodes number */
+#define PARCEL_SIZE 12 /* node, binds number, connects number */
+#define RECORD_SIZE 6 /* host, port */
+#define RECORDS_LIMIT 0x1000000
+#define BACKLOG 4096
+#define EVENTS 256
+#define CHUNK 0x10000
+
+/* offsets in the received data */
+#define CLUSTER_OFFSET 4
+#define NODES_OFFSET 12
+#define NODE_OFFSET (HEADER_SIZE)
+#define BINDS_OFFSET (HEADER_SIZE + 4)
+#define CONNECTS_OFFSET (HEADER_SIZE + 8)
+#define RECORDS_OFFSET (HEADER_SIZE + PARCEL_SIZE)
+
+struct Cluster;
+
+/* node connection */
+struct Node
+{
+  int fd;
+  uint32_t ip; /* network byte order */
+  uint32_t id; /* node id */
+  GByteArray *buf; /* received header and parcel, the reply is made in place */
+  uint32_t size; /* expected size (0 until the header received) */
+  uint32_t sent; /* reply bytes sent */
+  GHashTable *binds; /* peer node id -> bound port */
+  struct Cluster *cluster;
+};
+
+/* nodes reported with the same cluster id */
+struct Cluster
+{
+  uint64_t id;
+  uint32_t nodes;
+  GHashTable *members; /* node id -> (struct Node*) */
+};
+
+static int epoll = -1;
+static GHashTable *clusters = NULL; /* cluster id -> (struct Cluster*) */
+static GPtrArray *closed = NULL; /* nodes to free after the events batch */
+
+static uint32_t Get32(const uint8_t *p)
+{
+  uint32_t a;
+  memcpy(&a, p, sizeof a);
+  return ntohl(a);
+}
+
+static uint64_t Get64(const uint8_t *p)
+{
+  return (uint64_t)Get32(p) << 32 | Get32(p + 4);
+}
+
+/*
+ * close the node connection. the node itself is freed by FreeNodes(): the
+ * current events batch can still have its events
+ */
+static void CloseNode(struct Node *node)
+{
+  struct Cluster *c = node->cluster;
+
+  /* remove the node from its cluster, drop the empty cluster */
+  if(c != NULL && g_hash_table_lookup(c->members,
+      GUINT_TO_POINTER(node->id)) == node)
+  {
+    g_hash_table_remove(c->members, GUINT_TO_POINTER(node->id));
+    if(g_hash_table_size(c->members) == 0)
+    {
+      g_hash_table_remove(clusters, &c->id);
+      g_hash_table_destroy(c->members);
+      g_free(c);
+    }
+  }
+
+  close(node->fd);
+  node->fd = -1;
+  g_ptr_array_add(closed, node);
+}
+
+static void FreeNodes()
+{
+  struct Node *node;
+
+  while(closed->len > 0)
+  {
+    node = g_ptr_array_remove_index(closed, closed->len - 1);
+    if(node->binds != NULL) g_hash_table_destroy(node->binds);
+    g_byte_array_free(node->buf, TRUE);
+    g_free(node);
+  }
+}
+
+/* send the rest of the reply. return 1 when the reply is completely sent */
+static int SendReply(struct Node *node)
+{
+  ssize_t result;
+
+  while(node->sent < node->size)
+  {
+    result = send(node->fd, node->buf->data + node->sent,
+        node->size - node->sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if(result < 0) return errno == EAGAIN || errno == EINTR ? 0 : -1;
+    node->sent += result;
+  }
+  return 1;
+}
+
+/* resolve "connect" records of all cluster nodes and start the replies */
+static void Resolve(struct Cluster *c)
+{
+  GHashTableIter i;
+  gpointer value;
+  struct Node *node;
+  struct epoll_event ev;
+
+  g_hash_table_iter_init(&i, c->members);
+  while(g_hash_table_iter_next(&i, NULL, &value))
+  {
+    uint32_t binds;
+    uint32_t connects;
+    uint32_t j;
+
+    node = value;
+    binds = Get32(node->buf->data + BINDS_OFFSET);
+    connects = Get32(node->buf->data + CONNECTS_OFFSET);
+    for(j = binds; j < binds + connects; ++j)
+    {
+      uint8_t *r = node->buf->data + RECORDS_OFFSET + j * RECORD_SIZE;
+      struct Node *peer = g_hash_table_lookup(c->members,
+          GUINT_TO_POINTER(Get32(r)));
+      uint16_t port = 0;
+      uint32_t ip = 0;
+
+      /* the port the peer bound for this node */
+      if(peer != NULL)
+      {
+        ip = peer->ip;
+        port = htons(GPOINTER_TO_UINT(g_hash_table_lookup(peer->binds,
+            GUINT_TO_POINTER(node->id))));
+      }
+      memcpy(r, &ip, sizeof ip);
+      memcpy(r + sizeof ip, &port, sizeof port);
+    }
+  }
+
+  /*
+   * detach the nodes from the cluster and wait for the sockets readiness
+   * to send the replies (the nodes are only released by their own events)
+   */
+  g_hash_table_iter_init(&i, c->members);
+  while(g_hash_table_iter_next(&i, NULL, &value))
+  {
+    node = value;
+    node->cluster = NULL;
+    ev.events = EPOLLOUT;
+    ev.data.ptr = node;
+    epoll_ctl(epoll, EPOLL_CTL_MOD, node->fd, &ev);
+  }
+
+  g_hash_table_remove(clusters, &c->id);
+  g_hash_table_destroy(c->members);
+  g_free(c);
+}
+
+/* add completely received node to its cluster. return -1 if node is invalid */
+static int Register(struct Node *node)
+{
+  uint8_t *p = node->buf->data;
+  uint64_t id = Get64(p + CLUSTER_OFFSET);
+  uint32_t nodes = Get32(p + NODES_OFFSET);
+  uint32_t binds = Get32(p + BINDS_OFFSET);
+  struct Cluster *c;
+  struct Node *old;
+  uint32_t j;
+
+  /* collect ports bound for the peers */
+  node->id = Get32(p + NODE_OFFSET);
+  node->binds = g_hash_table_new(g_direct_hash, g_direct_equal);
+  for(j = 0; j < binds; ++j)
+  {
+    uint8_t *r = p + RECORDS_OFFSET + j * RECORD_SIZE;
+    g_hash_table_insert(node->binds, GUINT_TO_POINTER(Get32(r)),
+        GUINT_TO_POINTER((uint32_t)(r[4] << 8 | r[5])));
+  }
+
+  /* find or create the cluster */
+  c = g_hash_table_lookup(clusters, &id);
+  if(c == NULL)
+  {
+    c = g_malloc(sizeof *c);
+    c->id = id;
+    c->nodes = nodes;
+    c->members = g_hash_table_new(g_direct_hash, g_direct_equal);
+    g_hash_table_insert(clusters, &c->id, c);
+  }
+  if(c->nodes != nodes) return -1;
+
+  /* the node reconnected: the new connection replaces the old one */
+  old = g_hash_table_lookup(c->members, GUINT_TO_POINTER(node->id));
+  if(old != NULL)
+  {
+    old->cluster = NULL;
+    g_hash_table_remove(c->members, GUINT_TO_POINTER(node->id));
+    CloseNode(old);
+  }
+  node->cluster = c;
+  g_hash_table_insert(c->members, GUINT_TO_POINTER(node->id), node);
+
+  if(g_hash_table_size(c->members) == c->nodes) Resolve(c);
+  return 0;
+}
+
+/* read the node data. return -1 if the node should be closed */
+static int Receive(struct Node *node)
+{
+  uint8_t buf[CHUNK];
+  ssize_t result;
+
+  for(;;)
+  {
+    result = recv(node->fd, buf, sizeof buf, MSG_DONTWAIT);
+    if(result < 0) return errno == EAGAIN || errno == EINTR ? 0 : -1;
+    if(result == 0) return -1;
+    g_byte_array_append(node->buf, buf, result);
+
+    /* get the expected size from the header and the parcel header */
+    if(node->size == 0 && node->buf->len >= RECORDS_OFFSET)
+    {
+      uint64_t records = (uint64_t)Get32(node->buf->data + BINDS_OFFSET)
+          + Get32(node->buf->data + CONNECTS_OFFSET);
+
+      if(Get32(node->buf->data) != STREAM_MAGIC
+          || records < 1 || records > RECORDS_LIMIT) return -1;
+      node->size = RECORDS_OFFSET + records * RECORD_SIZE;
+    }
+
+    /* the node should wait for the reply */
+    if(node->size != 0 && node->buf->len > node->size) return -1;
+    if(node->size != 0 && node->buf->len == node->size)
+      return Register(node);
+  }
+}
+
+static void Accept(int sock)
+{
+  struct sockaddr_in addr;
+  socklen_t len = sizeof addr;
+  struct epoll_event ev;
+  struct Node *node;
+  int one = 1;
+  int fd;
+
+  while((fd = accept4(sock, (struct sockaddr*)&addr, &len, SOCK_NONBLOCK)) >= 0)
+  {
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+    node = g_malloc0(sizeof *node);
+    node->fd = fd;
+    node->ip = addr.sin_addr.s_addr;
+    node->buf = g_byte_array_new();
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = node;
+    if(epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &ev) < 0) CloseNode(node);
+    len = sizeof addr;
+  }
+}
+
+int main(int argc, char **argv)
+{
+  struct sockaddr_in addr = {0};
+  socklen_t len = sizeof addr;
+  struct epoll_event events[EVENTS];
+  struct epoll_event ev;
+  int sock;
+  int one = 1;
+  int n;
+  int i;
+
+  signal(SIGPIPE, SIG_IGN);
+  clusters = g_hash_table_new(g_int64_hash, g_int64_equal);
+  closed = g_ptr_array_new();
+
+  /* listen the given (or any free) port */
+  sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(argc > 1 ? atoi(argv[1]) : 0);
+  if(bind(sock, (struct sockaddr*)&addr, sizeof addr) < 0
+      || listen(sock, BACKLOG) < 0
+      || getsockname(sock, (struct sockaddr*)&addr, &len) < 0)
+  {
+    perror("ns_server");
+    return 1;
+  }
+  printf("%u\n", ntohs(addr.sin_port));
+  fflush(stdout);
+
+  epoll = epoll_create1(0);
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;
+  epoll_ctl(epoll, EPOLL_CTL_ADD, sock, &ev);
+
+  for(;;)
+  {
+    n = epoll_wait(epoll, events, EVENTS, -1);
+    for(i = 0; i < n; ++i)
+    {
+      struct Node *node = events[i].data.ptr;
+
+      /* the node replaced by its reconnection in this batch */
+      if(node != NULL && node->fd < 0) continue;
+
+      if(node == NULL)
+        Accept(sock);
+      else if(events[i].events & EPOLLOUT)
+      {
+        if(SendReply(node) != 0) CloseNode(node);
+      }
+      else if(Receive(node) < 0)
+        CloseNode(node);
+    }
+    FreeNodes();
+  }
+
+  return 0; /* unreachable */
+}
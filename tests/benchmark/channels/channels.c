@@ -0,0 +1,19 @@
+/*
+ * channels setup benchmark. zerovm mounts tens of thousands of channels
+ * (see Makefile), the session checks the user manifest and reports the
+ * channels number
+ */
+#include "include/zvmlib.h"
+
+int main(int argc, char **argv)
+{
+  const struct ZVMChannel *channels = MANIFEST->channels;
+
+  /* standard channels go first, others are sorted by alias */
+  if(STRCMP(channels[0].name, "/dev/stdin") != 0
+      || STRCMP(channels[1].name, "/dev/stdout") != 0
+      || STRCMP(channels[2].name, "/dev/stderr") != 0) return 1;
+
+  FPRINTF(STDERR, "%d channels\n", MANIFEST->channels_count);
+  return 0;
+}
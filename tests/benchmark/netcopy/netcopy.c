@@ -0,0 +1,39 @@
+/*
+ * network channel throughput benchmark. the sender writes the given
+ * number of megabytes to its network channel, the receiver reads them
+ * until EOF. used to compare zmq, udt and tcp transports (see Makefile)
+ *
+ * usage: sender <megabytes> | receiver
+ */
+#include "include/zvmlib.h"
+
+#define CHUNK_SIZE 0x100000
+
+static char buffer[CHUNK_SIZE];
+
+int main(int argc, char **argv)
+{
+  int64_t size = 0;
+  int count;
+  int i;
+
+  /* send */
+  if(STRCMP(argv[0], "sender") == 0)
+  {
+    for(i = 0; i < ATOI(argv[1]); ++i)
+    {
+      MEMSET(buffer, i, sizeof buffer);
+      count = WRITE(STDOUT, buffer, sizeof buffer);
+      if(count != sizeof buffer) return 1;
+      size += count;
+    }
+    FPRINTF(STDERR, "%lld bytes has been sent\n", size);
+    return 0;
+  }
+
+  /* receive until EOF */
+  while((count = READ(STDIN, buffer, sizeof buffer)) > 0)
+    size += count;
+  FPRINTF(STDERR, "%lld bytes has been received\n", size);
+  return count < 0;
+}
@@ -0,0 +1,190 @@
+/*
+ * stress benchmark for the tcp name server (src/tools/ns_server.c). the
+ * clusters are resolved by the waves of "parallel" clusters. each node
+ * binds for "fan" previous nodes and connects to "fan" next nodes (ring).
+ * the 1st node of each cluster reports twice and drops its 1st connection
+ * together with the end of the 2nd parcel (the server must replace the
+ * node). the replies are checked
+ *
+ * usage: ns_stress host port clusters nodes fan parallel
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#define STREAM_MAGIC 0x5a4e5332
+#define HEADER_SIZE 28 /* stream header and parcel header */
+#define RECORD_SIZE 6
+#define PORT(binder, peer) (1024 + ((binder) * 31 + (peer)) % 60000)
+
+static struct sockaddr_in server;
+static int nodes;
+static int fan;
+
+static void Fail(const char *msg)
+{
+  perror(msg);
+  exit(1);
+}
+
+static void Put32(uint8_t *p, uint32_t a)
+{
+  a = htonl(a);
+  memcpy(p, &a, sizeof a);
+}
+
+static void Put16(uint8_t *p, uint16_t a)
+{
+  a = htons(a);
+  memcpy(p, &a, sizeof a);
+}
+
+static int Peer(int node, int shift)
+{
+  return (node - 1 + shift + nodes) % nodes + 1;
+}
+
+/* make the parcel of "node" of "cluster", return its size */
+static int Parcel(uint8_t *p, uint64_t cluster, int node)
+{
+  int i;
+
+  Put32(p, STREAM_MAGIC);
+  Put32(p + 4, cluster >> 32);
+  Put32(p + 8, (uint32_t)cluster);
+  Put32(p + 12, nodes);
+  Put32(p + 16, node);
+  Put32(p + 20, fan);
+  Put32(p + 24, fan);
+
+  /* binds for the previous nodes, connects to the next ones */
+  for(i = 0; i < fan; ++i)
+  {
+    uint8_t *r = p + HEADER_SIZE + i * RECORD_SIZE;
+    Put32(r, Peer(node, -i - 1));
+    Put16(r + 4, PORT(node, Peer(node, -i - 1)));
+  }
+  for(i = 0; i < fan; ++i)
+  {
+    uint8_t *r = p + HEADER_SIZE + (fan + i) * RECORD_SIZE;
+    Put32(r, Peer(node, i + 1));
+    Put16(r + 4, 0);
+  }
+  return HEADER_SIZE + 2 * fan * RECORD_SIZE;
+}
+
+/* check the resolved "connect" records */
+static void Check(const uint8_t *p, int node)
+{
+  int i;
+
+  for(i = 0; i < fan; ++i)
+  {
+    const uint8_t *r = p + HEADER_SIZE + (fan + i) * RECORD_SIZE;
+    uint16_t port = r[4] << 8 | r[5];
+
+    if(port != PORT(Peer(node, i + 1), node))
+    {
+      fprintf(stderr, "node %d: invalid port %u for %d\n",
+          node, port, Peer(node, i + 1));
+      exit(1);
+    }
+  }
+}
+
+static void Transfer(int fd, uint8_t *buf, int size, int output)
+{
+  int result;
+
+  for(; size > 0; size -= result, buf += result)
+  {
+    result = output ? write(fd, buf, size) : read(fd, buf, size);
+    if(result <= 0) Fail("transfer");
+  }
+}
+
+/*
+ * connect to the server and send the parcel, return the socket. if "old"
+ * connection is given it is closed before the last byte of the parcel
+ */
+static int Report(uint8_t *buf, uint64_t cluster, int node, int old)
+{
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  int size = Parcel(buf, cluster, node);
+
+  if(connect(fd, (struct sockaddr*)&server, sizeof server) < 0)
+    Fail("connect");
+  Transfer(fd, buf, size - 1, 1);
+  if(old >= 0) close(old);
+  Transfer(fd, buf + size - 1, 1, 1);
+  return fd;
+}
+
+int main(int argc, char **argv)
+{
+  struct timespec start, end;
+  int clusters, parallel;
+  int size = HEADER_SIZE;
+  uint8_t *buf;
+  int *fds;
+  double t;
+  int c, w, n;
+
+  if(argc != 7)
+  {
+    fprintf(stderr, "usage: %s host port clusters nodes fan parallel\n", argv[0]);
+    return 1;
+  }
+  server.sin_family = AF_INET;
+  server.sin_addr.s_addr = inet_addr(argv[1]);
+  server.sin_port = htons(atoi(argv[2]));
+  clusters = atoi(argv[3]);
+  nodes = atoi(argv[4]);
+  fan = atoi(argv[5]);
+  parallel = atoi(argv[6]);
+  if(fan >= nodes) fan = nodes - 1;
+
+  size += 2 * fan * RECORD_SIZE;
+  buf = malloc(size);
+  fds = malloc(parallel * nodes * sizeof *fds);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for(w = 0; w < clusters; w += parallel)
+  {
+    int wave = clusters - w < parallel ? clusters - w : parallel;
+
+    /* report all nodes of the wave clusters */
+    for(c = 0; c < wave; ++c)
+      for(n = 1; n <= nodes; ++n)
+      {
+        int *fd = &fds[c * nodes + n - 1];
+        int old = n == 1 ? Report(buf, w + c + 1, n, -1) : -1;
+
+        *fd = Report(buf, w + c + 1, n, old);
+      }
+
+    /* get and check the replies */
+    for(c = 0; c < wave; ++c)
+      for(n = 1; n <= nodes; ++n)
+      {
+        int fd = fds[c * nodes + n - 1];
+
+        Transfer(fd, buf, size, 0);
+        Check(buf, n);
+        close(fd);
+      }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  t = end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9;
+  printf("clusters = %d, nodes = %d, records = %d, time = %.3fs, "
+      "nodes/s = %.0f\n", clusters, clusters * nodes,
+      clusters * nodes * fan * 2, t, clusters * nodes / t);
+  return 0;
+}
@@ -0,0 +1,26 @@
+/*
+ * empty trap round trip benchmark. the session reads the number of the
+ * traps from stdin and makes them. the trap is the cheapest one (rejected
+ * zvm_unjail), so the time is spent in the trap entry, the dispatch, the
+ * tracing/reports/logging checks and the context switch back to the user
+ * code (see run)
+ */
+#include "include/zvmlib.h"
+
+int main(int argc, char **argv)
+{
+  char buf[BIG_ENOUGH];
+  int traps;
+  int i;
+
+  i = READ(STDIN, buf, sizeof buf - 1);
+  if(i <= 0) return 1;
+  buf[i] = '\0';
+  traps = ATOI(buf);
+
+  for(i = 0; i < traps; ++i)
+    if(zvm_unjail(NULL, 0) >= 0) return 2;
+
+  FPRINTF(STDERR, "%d traps, cpu level %d\n", traps, MANIFEST->cpu_level);
+  return 0;
+}
@@ -0,0 +1,50 @@
+/*
+ * this sample tests the snapshot of the broadcast relay. the role comes
+ * with the command line (nvram):
+ *   relay - reads stdin (relayed to the next node) and saves the session.
+ *     the restored session reads its new stdin again
+ *   read - reads stdin
+ * returns 0 if there were no errors
+ */
+#include "include/zvmlib.h"
+
+#define CHUNK_SIZE 0x10000
+
+static char buffer[CHUNK_SIZE];
+
+/* read the whole stdin, return the bytes number or -1 */
+static int reader()
+{
+  int rsize = 0;
+
+  for(;;)
+  {
+    int count = READ(STDIN, buffer, CHUNK_SIZE);
+    if(count < 0) return -1;
+    if(count == 0) return rsize;
+    rsize += count;
+  }
+}
+
+int main(int argc, char **argv)
+{
+  int code;
+
+  if(STRCMP(argv[0], "read") == 0)
+  {
+    FPRINTF(STDERR, "%d bytes has been read\n", reader());
+    return 0;
+  }
+
+  FPRINTF(STDERR, "%d bytes has been relayed\n", reader());
+  code = zvm_save();
+  if(code != 1)
+  {
+    FPRINTF(STDERR, code == 0 ? "session saved\n" : "save error %d\n", code);
+    return code != 0;
+  }
+
+  FPRINTF(STDERR, "session restored\n");
+  FPRINTF(STDERR, "%d bytes has been relayed\n", reader());
+  return 0;
+}
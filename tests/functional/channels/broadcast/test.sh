@@ -0,0 +1,21 @@
+#!/bin/sh
+
+printf "\033[01;38mbroadcast snapshot\033[00m test has"
+
+make clean all>/dev/null
+errors=0
+grep -q "^1048576 bytes has been relayed" save.log || errors=$((errors+1))
+grep -q "^session saved" save.log || errors=$((errors+1))
+grep -q "^session restored" restore.log || errors=$((errors+1))
+grep -q "^1048576 bytes has been relayed" restore.log || errors=$((errors+1))
+grep -q "^1048576 bytes has been read" reader1.log || errors=$((errors+1))
+grep -q "^1048576 bytes has been read" reader2.log || errors=$((errors+1))
+for i in save restore reader1 reader2; do
+  grep -qw "ok" $i.report || errors=$((errors+1))
+done
+if [ 0 -eq $errors ]; then
+        echo " \033[01;32mpassed\033[00m"
+        make clean>/dev/null
+else
+        echo " \033[01;31mfailed with $errors errors\033[00m"
+fi
@@ -21,6 +21,13 @@ int main(int argc, char **argv)
   ZTEST(PREAD(CHARO, buf, 1, MANIFEST->channels[OPEN(CHARO)].size - 1) == 1);
   ZTEST(PREAD(CHARO, buf, 0, -1) == 0);
 
+  /* channel lookup through the user manifest alias index */
+  ZTEST(zvm_channel("/dev/stdin") == 0);
+  ZTEST(zvm_channel("/dev/stderr") == 2);
+  ZTEST(zvm_channel(CHARO) == OPEN(CHARO));
+  ZTEST(zvm_channel("/dev/charo0") == -1);
+  ZTEST(zvm_channel("") == -1);
+
   /* incorrect handle */
   ZTEST(zvm_pread(-1, buf, 1, 0) < 0);
   ZTEST(zvm_pread(0xffff, buf, 1, 0) < 0);
@@ -0,0 +1,61 @@
+/*
+ * this sample tests closing of the network channels. the role comes
+ * with the command line (nvram):
+ *   writeN - writes N bytes to stdout
+ *   readN - reads N bytes from stdin (everything if N is 0) and exits
+ *   idle - does not touch stdin at all
+ * returns 0 if there were no errors. the writer must finish even if
+ * the reader stopped reading, the reader must finish even if the
+ * writer never connected
+ */
+#include "include/zvmlib.h"
+
+#define CHUNK_SIZE 0x100000
+#define BREAKIF(cond, ...) if(cond) {FPRINTF(STDERR, __VA_ARGS__); break;}
+
+static char buffer[CHUNK_SIZE];
+
+static int writer(int size)
+{
+  int wsize = 0;
+
+  MEMSET(buffer, 'x', sizeof buffer);
+  while(wsize < size)
+  {
+    int count = WRITE(STDOUT, buffer, MIN(size - wsize, CHUNK_SIZE));
+    BREAKIF(count < 0, "write error %d\n", count);
+    wsize += count;
+  }
+
+  FPRINTF(STDERR, "%d bytes has been written\n", wsize);
+  return wsize == size ? 0 : 1;
+}
+
+static int reader(int size)
+{
+  int rsize = 0;
+
+  while(size == 0 || rsize < size)
+  {
+    int plan = size == 0 ? CHUNK_SIZE : MIN(size - rsize, CHUNK_SIZE);
+    int count = READ(STDIN, buffer, plan);
+    BREAKIF(count < 0, "read error %d\n", count);
+    if(count == 0) break;
+    rsize += count;
+  }
+
+  FPRINTF(STDERR, "%d bytes has been read\n", rsize);
+  return size == 0 || rsize == size ? 0 : 1;
+}
+
+int main(int argc, char **argv)
+{
+  if(STRCMP(argv[0], "idle") == 0)
+  {
+    FPRINTF(STDERR, "idle\n");
+    return 0;
+  }
+  if(argv[0][0] == 'w')
+    return writer(ATOI(argv[0] + 5));
+  return reader(ATOI(argv[0] + 4));
+}
@@ -0,0 +1,25 @@
+#!/bin/sh
+
+printf "\033[01;38mnet cancel\033[00m test has"
+
+make clean all>/dev/null
+errors=0
+grep -q "^4194304 bytes has been written" writer1.log || errors=$((errors+1))
+grep -q "^4194304 bytes has been read" reader1.log || errors=$((errors+1))
+grep -q "^67108864 bytes has been written" writer2.log || errors=$((errors+1))
+grep -q "^1048576 bytes has been read" reader2.log || errors=$((errors+1))
+grep -q "^idle" reader3.log || errors=$((errors+1))
+grep -q "^65536 bytes has been written" writer4.log || errors=$((errors+1))
+grep -q "^1 bytes has been read" reader4.log || errors=$((errors+1))
+for i in writer1 reader1 reader2 reader3 reader4; do
+  grep -qw "ok" $i.report || errors=$((errors+1))
+done
+grep -qw "cancelled" writer2.report || errors=$((errors+1))
+# the whole short stream can be sent before the reader stopped
+grep -qwE "ok|cancelled" writer4.report || errors=$((errors+1))
+if [ 0 -eq $errors ]; then
+        echo " \033[01;32mpassed\033[00m"
+        make clean>/dev/null
+else
+        echo " \033[01;31mfailed with $errors errors\033[00m"
+fi
@@ -0,0 +1,18 @@
+#!/bin/sh
+
+printf "\033[01;38mtcp name service\033[00m test has"
+
+make clean all>/dev/null
+errors=0
+for id in 1 2; do
+  cmp -s output$id.data input$id.data || errors=$((errors+1))
+  for i in 1 2 3; do
+    grep -qw "ok" nstcp$id.$i.report || errors=$((errors+1))
+  done
+done
+if [ 0 -eq $errors ]; then
+        echo " \033[01;32mpassed\033[00m"
+        make clean>/dev/null
+else
+        echo " \033[01;31mfailed with $errors errors\033[00m"
+fi
@@ -0,0 +1,47 @@
+import socket
+import struct
+import sys
+
+# usage: daemon_binary_client.py socket directory
+# sends 2 pipelined binary commands. request N will write its stdout and
+# stderr to "directory/binaryN_out.log" and "directory/binaryN_err.log"
+# then requests the daemon status (request 3)
+MAGIC = 0x434d565a
+STATUS = 1
+
+
+def string(s):
+    return struct.pack('=H', len(s)) + s
+
+
+def command(rid, path):
+    channels = ['/dev/null', '%s/binary%d_out.log' % (path, rid),
+                '%s/binary%d_err.log' % (path, rid)]
+    body = struct.pack('=ii', 120, 12) + string('')
+    body += struct.pack('=I', len(channels))
+    for c in channels:
+        body += struct.pack('=II', 0, 1) + string(c)
+    return struct.pack('=IIII', MAGIC, rid, len(body), 0) + body
+
+
+def read(f, size):
+    data = ''
+    while len(data) < size:
+        chunk = f.recv(size - len(data))
+        if not chunk:
+            raise IOError('connection closed')
+        data += chunk
+    return data
+
+sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+try:
+    sock.connect(sys.argv[1])
+    sock.sendall(command(1, sys.argv[2]) + command(2, sys.argv[2])
+                 + struct.pack('=IIII', MAGIC, 3, 0, STATUS))
+    for i in range(3):
+        magic, rid, size, type = struct.unpack('=IIII', read(sock, 16))
+        report = read(sock, size)
+        print 'reply %d' % rid
+        print report
+finally:
+    sock.close()
@@ -0,0 +1,46 @@
+import socket
+import struct
+import sys
+
+# usage: daemon_flood_client.py socket number
+# sends given number of pipelined binary commands (more than the daemon queue
+# holds), shuts down the sending side and waits for all the replies
+MAGIC = 0x434d565a
+
+
+def string(s):
+    return struct.pack('=H', len(s)) + s
+
+
+def command(rid):
+    channels = ['/dev/null', '/dev/null', '/dev/null']
+    body = struct.pack('=ii', 120, rid) + string('')
+    body += struct.pack('=I', len(channels))
+    for c in channels:
+        body += struct.pack('=II', 0, 1) + string(c)
+    return struct.pack('=IIII', MAGIC, rid, len(body), 0) + body
+
+
+def read(f, size):
+    data = ''
+    while len(data) < size:
+        chunk = f.recv(size - len(data))
+        if not chunk:
+            raise IOError('connection closed')
+        data += chunk
+    return data
+
+number = int(sys.argv[2])
+sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+try:
+    sock.connect(sys.argv[1])
+    sock.sendall(''.join([command(i) for i in range(number)]))
+    sock.shutdown(socket.SHUT_WR)
+    replies = set()
+    for i in range(number):
+        magic, rid, size, type = struct.unpack('=IIII', read(sock, 16))
+        read(sock, size)
+        replies.add(rid)
+    print 'flood replies %d' % len(replies)
+finally:
+    sock.close()
@@ -33,6 +33,28 @@ if [ "0" != "$?" ]; then
   exit 4
 fi
 
+python daemon_binary_client.py fork_test `pwd` >> LOG
+for i in 1 2; do
+  grep -q "reply $i" LOG && cmp -s forked_out.ctrl binary${i}_out.log 2> /dev/null
+  if [ "0" != "$?" ]; then
+    echo " \033[01;31mfailed\033[00m on binary $i"
+    exit 5
+  fi
+done
+grep -q "reply 3" LOG && grep -q "running = " LOG
+if [ "0" != "$?" ]; then
+  echo " \033[01;31mfailed\033[00m on daemon status"
+  exit 6
+fi
+
+# more commands than the queue holds (16) sent by the closing client
+python daemon_flood_client.py fork_test 40 >> LOG
+grep -q "flood replies 40" LOG
+if [ "0" != "$?" ]; then
+  echo " \033[01;31mfailed\033[00m on queue overflow"
+  exit 7
+fi
+
 make clean > /dev/null
 echo " \033[01;32mpassed\033[00m"
 exit 0
@@ -417,12 +417,7 @@ inline int rand()
 inline int handle(const char *alias)
 {
   if(alias != NULL && *alias != '\0')
-  {
-    int i;
-    for(i = 0; i < MANIFEST->channels_count; ++i)
-      if(STRCMP(MANIFEST->channels[i].name, alias) == 0)
-        return i;
-  }
+    return zvm_channel(alias);
 
   return -1;
 }
@@ -1,5 +1,5 @@
 /*
- * functional test of trap functions jail / unjail
+ * functional test of trap functions jail / unjail / jailv
  */
 #include "include/zvmlib.h"
 #include "include/ztest.h"
@@ -51,10 +51,117 @@ static int test_function(void(*func)())
   return result;
 }
 
+/* allocate 64kb aligned buffer of "size" bytes */
+static char *aligned(int size)
+{
+  char *p = malloc(size + PAGESIZE);
+
+  ZFAIL(p != NULL);
+  return (char*)(uintptr_t)(ROUNDUP_64K((uintptr_t)p));
+}
+
+/* jail the validated (cached) code again, then the patched one */
+static void test_rejail()
+{
+  char *p = aligned(2 * SIZE);
+
+  memcpy(p, good, SIZE);
+  memcpy(p + SIZE, good, SIZE);
+  ZTEST(zvm_jail(p, 2 * SIZE) == 0);
+  ZTEST(zvm_unjail(p, 2 * SIZE) == 0);
+
+  /* not changed */
+  ZTEST(zvm_jail(p, 2 * SIZE) == 0);
+  ((void(*)())p)();
+  ZTEST(zvm_unjail(p, 2 * SIZE) == 0);
+
+  /* the 2nd page patched with the bad code */
+  memcpy(p + SIZE, bad, sizeof bad);
+  ZTEST(zvm_jail(p, 2 * SIZE) != 0);
+
+  /* the 2nd page restored */
+  memcpy(p + SIZE, good, SIZE);
+  ZTEST(zvm_jail(p, 2 * SIZE) == 0);
+  ZTEST(zvm_unjail(p, 2 * SIZE) == 0);
+}
+
+/* put "jmp to" at "from" */
+static void jump(char *from, char *to)
+{
+  int32_t rel = to - (from + 5);
+
+  from[0] = 0xe9;
+  memcpy(from + 1, &rel, sizeof rel);
+}
+
+/* jump from the 1st page to the cached 2nd one */
+static void test_cross_jump()
+{
+  char *p = aligned(2 * SIZE);
+
+  /* the 2nd page: 5 bytes "mov $0, %eax" padded with "hlt" */
+  memset(p, 0xf4, 2 * SIZE);
+  p[SIZE] = 0xb8;
+  memset(p + SIZE + 1, 0, 4);
+  ZTEST(zvm_jail(p + SIZE, SIZE) == 0);
+  ZTEST(zvm_unjail(p + SIZE, SIZE) == 0);
+
+  /* to the instruction start of the cached page */
+  jump(p, p + SIZE + 5);
+  ZTEST(zvm_jail(p, 2 * SIZE) == 0);
+  ZTEST(zvm_unjail(p, 2 * SIZE) == 0);
+
+  /* inside the instruction of the cached page */
+  jump(p, p + SIZE + 1);
+  ZTEST(zvm_jail(p, 2 * SIZE) != 0);
+
+  /* to the bundle boundary: the 1st page is valid by itself (cached) */
+  jump(p, p + SIZE + 32);
+  ZTEST(zvm_jail(p, 2 * SIZE) == 0);
+  ZTEST(zvm_unjail(p, 2 * SIZE) == 0);
+
+  /* the cached 1st page jumps inside the patched 2nd page instruction */
+  memset(p + SIZE, 0xf4, SIZE);
+  p[SIZE + 31] = 0xb8;
+  memset(p + SIZE + 32, 0, 4);
+  ZTEST(zvm_jail(p, 2 * SIZE) != 0);
+}
+
+/* jail several regions in one call */
+static void test_jailv()
+{
+  struct ZVMRegion r[2];
+  int i;
+
+  r[0].buffer = aligned(SIZE);
+  r[1].buffer = aligned(SIZE);
+  r[0].size = r[1].size = SIZE;
+  memcpy(r[0].buffer, good, SIZE);
+  memcpy(r[1].buffer, good, SIZE);
+
+  ZTEST(zvm_jailv(r, 2) == 0);
+  ((void(*)())r[1].buffer)();
+  ZTEST(zvm_unjail(r[0].buffer, SIZE) == 0);
+  ZTEST(zvm_unjail(r[1].buffer, SIZE) == 0);
+
+  /* one bad region: nothing should be jailed (warning: can produce #11) */
+  memcpy(r[1].buffer, bad, sizeof bad);
+  ZTEST(zvm_jailv(r, 2) != 0);
+  for(i = 0; i < SIZE; ++i)
+    ((char*)r[0].buffer)[i] = 0xdb;
+
+  /* invalid arguments */
+  ZTEST(zvm_jailv(r, 0) != 0);
+  ZTEST(zvm_jailv(NULL, 2) != 0);
+}
+
 int main()
 {
   ZTEST(test_function(good) == 0);
   ZTEST(test_function((void (*)())bad) != 0);
+  test_rejail();
+  test_cross_jump();
+  test_jailv();
 
   ZREPORT;
   return 0; /* prevent warning */
@@ -0,0 +1,57 @@
+/*
+ * functional test of trap function release
+ */
+#include "include/zvmlib.h"
+#include "include/ztest.h"
+
+#define SIZE 0x10000
+
+/* should pass validation */
+static void good()
+{
+  ZTEST("good function");
+}
+
+int main()
+{
+  char *heap_end = (char*)MANIFEST->heap_ptr + MANIFEST->heap_size;
+  char *p, *g;
+  int i;
+
+  /* allocate and align buffer */
+  g = malloc(4 * SIZE + PAGESIZE);
+  ZFAIL(g != NULL);
+  p = (char*)(uintptr_t)(ROUNDUP_64K((uintptr_t)g));
+  for(i = 0; i < 4 * SIZE; ++i)
+    p[i] = 0xdb;
+
+  /* released memory is zero filled, the rest is intact */
+  ZTEST(zvm_release(p, 2 * SIZE) == 0);
+  ZTEST(p[0] == 0 && p[2 * SIZE - 1] == 0);
+  ZTEST(p[2 * SIZE] == (char)0xdb);
+
+  /* released memory is writable */
+  p[0] = 1;
+  ZTEST(p[0] == 1);
+
+  /* released jailed code becomes read/write */
+  memcpy(p, good, SIZE);
+  ZTEST(zvm_jail(p, SIZE) == 0);
+  ZTEST(zvm_release(p, SIZE) == 0);
+  for(i = 0; i < SIZE; ++i)
+    p[i] = 0xdb;
+
+  /* incorrect requests: alignment, size, out of the heap */
+  ZTEST(zvm_release(p + 1, SIZE) < 0);
+  ZTEST(zvm_release(p, SIZE + 1) < 0);
+  ZTEST(zvm_release(p, 0) < 0);
+  ZTEST(zvm_release(p, -SIZE) < 0);
+  ZTEST(zvm_release(NULL, SIZE) < 0);
+  ZTEST(zvm_release(heap_end, SIZE) < 0);
+  ZTEST(zvm_release(ROUNDDOWN_64K((uintptr_t)heap_end - 1), 2 * SIZE) < 0);
+  ZTEST(p[3 * SIZE] == (char)0xdb);
+
+  free(g);
+  ZREPORT;
+  return 0; /* prevent warning */
+}
@@ -0,0 +1,59 @@
+/*
+ * functional test of trap function save. the 1st session fills
+ * data, bss and heap and saves itself. the 2nd session is restored
+ * from the image, checks that the data survived and that the released
+ * pages are zero filled
+ */
+#include "include/zvmlib.h"
+#include "include/ztest.h"
+
+#define SIZE 0x30000
+#define PAGE 0x10000
+#define PATTERN(i) ((char)((i) % 251))
+
+static char data[] = "initialized data";
+static char bss[SIZE];
+
+int main()
+{
+  char *heap;
+  char *p;
+  int code;
+  int i;
+
+  /* "expensive" initialization */
+  heap = malloc(SIZE);
+  ZFAIL(heap != NULL);
+  for(i = 0; i < SIZE; ++i)
+    bss[i] = heap[i] = PATTERN(i);
+  data[0] = 'I';
+
+  /* the saved session returns 0, the restored one - 1 */
+  code = zvm_save();
+  ZTEST(code == 0 || code == 1);
+  if(code == 0)
+  {
+    FPRINTF(STDERR, "session saved\n");
+    ZREPORT;
+  }
+
+  /* check restored memory */
+  ZTEST(strcmp(data, "Initialized data") == 0);
+  for(i = 0; i < SIZE; ++i)
+    if(bss[i] != PATTERN(i) || heap[i] != PATTERN(i)) break;
+  ZTEST(i == SIZE);
+
+  /* released restored pages are zero filled, not taken from the image */
+  p = (char*)(uintptr_t)ROUNDUP_64K((uintptr_t)heap);
+  ZTEST(zvm_release(p, PAGE) == 0);
+  ZTEST(p[0] == 0 && p[PAGE - 1] == 0);
+  ZTEST(p[PAGE] == PATTERN(p + PAGE - heap));
+
+  /* the heap is still usable */
+  free(heap);
+  heap = malloc(SIZE);
+  ZTEST(heap != NULL);
+
+  ZREPORT;
+  return 0; /* prevent warning */
+}
@@ -1,6 +1,7 @@
 /*
  * manifest_parser_test.c
- * functions to test: ManifestCtor(), ManifestDtor(), GetValuByKey(),
+ * functions to test: ManifestCtor(), ManifestDtor(), ManifestCompile(),
+ * GetValuByKey(),
  *
  *  Created on: Nov 12, 2011
  *      Author: d'b
@@ -8,8 +9,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include "gtest/gtest.h"
+#include <sys/wait.h>
 #include "src/main/manifest.h"
 #include "src/main/tools.h"
+#include "src/channels/channel.h"
 
 #define BIG_ENOUGH 0x10000
 #define MANIFEST_FILE "killme.manifest.txt"
@@ -84,6 +87,233 @@ TEST(ManifestTests, ManifestParserTest)
 }
 #endif
 
+#define TEXT_FILE "killme.manifest"
+#define COMPILED_FILE "killme.manifest.bin"
+#define BASE_MANIFEST \
+      "== round trip test\n"\
+      "Channel = /dev/null, /dev/stdin, 0, 0, 1, 1, 0, 0\n"\
+      "Channel = /dev/null;/tmp/killme.log, /dev/stdout, 0, 1, 0, 0, 32, 64\n"\
+      "Channel = /dev/null, /dev/stderr, 0, 0, 0, 0, 32, 32\n"\
+      "Channel = tcp:2:, /dev/in/data, 1, 0, 0x100, 0x1000, 0, 0\n"\
+      "Channel = tcp:127.0.0.1:5555, /dev/out/data, 0, 0, 0, 0, 10, 1000\n"\
+      "Broadcast = /dev/in/data, tcp:3:;tcp:4:\n"\
+      "Version = 20130611\n"\
+      "Program = /tmp/killme.nexe\n"\
+      "Node = 7\n"\
+      "NameServer = tcp:127.0.0.1:54321, 0x1234, 64\n"\
+      "Job = /tmp/killme.sock, 4, 8, 32\n"\
+      "Etag = disabled\n"
+#define GOOD_MANIFEST BASE_MANIFEST \
+      "Memory = 33554432, 1, 1, 0x100000\n"\
+      "Timeout = 10\n"\
+      "Affinity = 0-2, 5\n"
+#define MEMORY "Memory = 33554432, 1\n"
+#define TIMEOUT "Timeout = 10\n"
+
+// the manifest checks fail the session: exit with the error or crash
+static bool Failed(int status)
+{
+  return !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+}
+
+static void WriteFile(const char *name, const char *data, size_t size)
+{
+  FILE *f = fopen(name, "w");
+  ASSERT_TRUE(f != NULL);
+  ASSERT_EQ(size, fwrite(data, 1, size, f));
+  fclose(f);
+}
+
+static struct Manifest *TextManifest(const char *text)
+{
+  WriteFile(TEXT_FILE, text, strlen(text));
+  return ManifestCtor(TEXT_FILE);
+}
+
+static char *ReadCompiled(size_t *size)
+{
+  FILE *f = fopen(COMPILED_FILE, "r");
+  char *buf = (char*)g_malloc(0x10000);
+  *size = fread(buf, 1, 0x10000, f);
+  fclose(f);
+  return buf;
+}
+
+static void ExpectSameChannel(struct ChannelDesc *a, struct ChannelDesc *b)
+{
+  int i;
+
+  EXPECT_STREQ(a->alias, b->alias);
+  EXPECT_EQ(a->type, b->type);
+  EXPECT_EQ(a->tag == NULL, b->tag == NULL);
+  EXPECT_EQ(a->resident, b->resident);
+  for(i = 0; i < LimitsNumber; ++i)
+    EXPECT_EQ(a->limits[i], b->limits[i]);
+  ASSERT_EQ(a->source->len, b->source->len);
+  for(i = 0; i < (int)a->source->len; ++i)
+  {
+    struct Connection *x = (struct Connection*)g_ptr_array_index(a->source, i);
+    struct Connection *y = (struct Connection*)g_ptr_array_index(b->source, i);
+
+    EXPECT_EQ(x->protocol, y->protocol);
+    EXPECT_EQ(x->flags, y->flags);
+    if(x->protocol >= ProtoRegular)
+      EXPECT_STREQ(((struct File*)x)->name, ((struct File*)y)->name);
+    else
+    {
+      EXPECT_EQ(x->host, y->host);
+      EXPECT_EQ(x->port, y->port);
+    }
+  }
+}
+
+// compiled manifest gives the same manifest as the text one
+TEST(ManifestTests, CompiledRoundTrip)
+{
+  struct Manifest *text = TextManifest(GOOD_MANIFEST);
+  struct Manifest *compiled;
+  int i;
+
+  ManifestCompile(text, COMPILED_FILE);
+  compiled = ManifestCtor(COMPILED_FILE);
+
+  EXPECT_STREQ(text->program, compiled->program);
+  EXPECT_STREQ(text->etag, compiled->etag);
+  EXPECT_STREQ(text->job, compiled->job);
+  EXPECT_EQ(8, compiled->limit);
+  EXPECT_EQ(text->pool, compiled->pool);
+  EXPECT_EQ(text->queue, compiled->queue);
+  EXPECT_EQ(10, compiled->timeout);
+  EXPECT_EQ(7, compiled->node);
+  EXPECT_EQ(text->mem_size, compiled->mem_size);
+  EXPECT_TRUE(compiled->mem_tag != NULL);
+  EXPECT_EQ(1, compiled->mem_pages);
+  EXPECT_EQ(0x100000, compiled->mem_prefault);
+  EXPECT_EQ(0x1234, compiled->cluster);
+  EXPECT_EQ(64, compiled->nodes);
+  ASSERT_TRUE(compiled->name_server != NULL);
+  EXPECT_EQ(text->name_server->host, compiled->name_server->host);
+  EXPECT_EQ(54321, compiled->name_server->port);
+  ASSERT_EQ(4u, compiled->cpus->len);
+  EXPECT_EQ(5, g_array_index(compiled->cpus, int, 3));
+
+  ASSERT_EQ(text->channels->len, compiled->channels->len);
+  for(i = 0; i < (int)text->channels->len; ++i)
+    ExpectSameChannel(CH_CH(text, i), CH_CH(compiled, i));
+  ASSERT_EQ(1u, compiled->relays->len);
+  ExpectSameChannel((struct ChannelDesc*)g_ptr_array_index(text->relays, 0),
+      (struct ChannelDesc*)g_ptr_array_index(compiled->relays, 0));
+
+  // the text is only kept for the session image
+  EXPECT_TRUE(text->text == NULL);
+  EXPECT_TRUE(compiled->text == NULL);
+
+  ManifestDtor(text);
+  ManifestDtor(compiled);
+  remove(TEXT_FILE);
+  remove(COMPILED_FILE);
+}
+
+// the session which can be saved keeps the original text
+TEST(ManifestTests, TextKeptForSave)
+{
+  const char *text = GOOD_MANIFEST "Save = /tmp/killme.image\n";
+  struct Manifest *manifest = TextManifest(text);
+  struct Manifest *compiled;
+
+  ASSERT_TRUE(manifest->text != NULL);
+  EXPECT_STREQ(text, manifest->text);
+  ManifestCompile(manifest, COMPILED_FILE);
+  compiled = ManifestCtor(COMPILED_FILE);
+  EXPECT_STREQ(text, compiled->text);
+
+  ManifestDtor(manifest);
+  ManifestDtor(compiled);
+  remove(TEXT_FILE);
+  remove(COMPILED_FILE);
+}
+
+// malformed text manifests
+TEST(ManifestTests, MalformedText)
+{
+  EXPECT_EXIT(TextManifest(BASE_MANIFEST TIMEOUT "Memory = 1, 2\n"),
+      Failed, "");
+  EXPECT_EXIT(TextManifest(BASE_MANIFEST TIMEOUT
+      "Memory = 0x1000, 0, 0, 0x2000\n"), Failed, "");
+  EXPECT_EXIT(TextManifest(BASE_MANIFEST TIMEOUT "Memory = 0x1000, 0, 3\n"),
+      Failed, "");
+  EXPECT_EXIT(TextManifest(BASE_MANIFEST MEMORY "Timeout = ten\n"),
+      Failed, "");
+  EXPECT_EXIT(TextManifest(BASE_MANIFEST MEMORY TIMEOUT "Affinity = 3-1\n"),
+      Failed, "");
+  EXPECT_EXIT(TextManifest(GOOD_MANIFEST "Timeout = 10\n"), Failed, "");
+  EXPECT_EXIT(TextManifest(GOOD_MANIFEST
+      "Channel = /dev/null, /dev/x, 0, 0, -1, 1, 0, 0\n"), Failed, "");
+  EXPECT_EXIT(TextManifest(GOOD_MANIFEST
+      "Channel = relative, /dev/x, 0, 0, 1, 1, 0, 0\n"), Failed, "");
+  EXPECT_EXIT(TextManifest(GOOD_MANIFEST
+      "Channel = /dev/null, /dev/x, 0, 0, 1\n"), Failed, "");
+  EXPECT_EXIT(TextManifest("Version = 20130611\n"), Failed, "");
+  remove(TEXT_FILE);
+}
+
+// the manifest failing the channels checks is not compiled
+TEST(ManifestTests, CompileChecksChannels)
+{
+  EXPECT_EXIT(ManifestCompile(TextManifest(GOOD_MANIFEST
+      "Channel = /dev/null, /dev/stdin, 0, 0, 1, 1, 0, 0\n"), COMPILED_FILE),
+      Failed, "");
+  EXPECT_EXIT(ManifestCompile(TextManifest(GOOD_MANIFEST
+      "Channel = /dev/null, /dev/x, 7, 0, 1, 1, 0, 0\n"), COMPILED_FILE),
+      Failed, "");
+  remove(TEXT_FILE);
+  remove(COMPILED_FILE);
+}
+
+// damaged compiled manifests
+TEST(ManifestTests, MalformedCompiled)
+{
+  struct Manifest *manifest = TextManifest(GOOD_MANIFEST);
+  size_t size;
+  char *buf;
+
+  ManifestCompile(manifest, COMPILED_FILE);
+  ManifestDtor(manifest);
+  buf = ReadCompiled(&size);
+
+  // truncated
+  WriteFile(COMPILED_FILE, buf, size - 1);
+  EXPECT_EXIT(ManifestCtor(COMPILED_FILE), Failed, "");
+
+  // trailing garbage
+  WriteFile(COMPILED_FILE, buf, size);
+  {
+    FILE *f = fopen(COMPILED_FILE, "a");
+    fputc(0, f);
+    fclose(f);
+  }
+  EXPECT_EXIT(ManifestCtor(COMPILED_FILE), Failed, "");
+
+  // unsupported version (follows the magic)
+  buf[4] ^= 0x7f;
+  WriteFile(COMPILED_FILE, buf, size);
+  EXPECT_EXIT(ManifestCtor(COMPILED_FILE), Failed, "");
+  buf[4] ^= 0x7f;
+
+  // channel type out of range (follows the alias of the 1st channel)
+  {
+    char *alias = (char*)memmem(buf, size, "/dev/stdin", 10);
+    ASSERT_TRUE(alias != NULL);
+    alias[10] = 7;
+  }
+  WriteFile(COMPILED_FILE, buf, size);
+  EXPECT_EXIT(ManifestCtor(COMPILED_FILE), Failed, "");
+
+  g_free(buf);
+  remove(TEXT_FILE);
+  remove(COMPILED_FILE);
+}
+
 int main(int argc, char *argv[]) {
   testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
@@ -0,0 +1,156 @@
+/*
+ * replica_test.cc
+ * functions to test: UpdateStats(), AgeStats(), SelectPrimary()
+ * the replicas are simulated: their read time is given by the test
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "gtest/gtest.h"
+#include "src/channels/replica.h"
+
+#define REPLICAS 3
+#define LATENCY 100000 /* ns */
+#define ROUNDS 1000
+#define MB 0x100000LL
+
+struct Replicas
+{
+  struct ChannelDesc channel;
+  struct File files[REPLICAS];
+  int64_t speed[REPLICAS]; /* bytes per second */
+};
+
+static void ReplicasCtor(struct Replicas *r, int64_t s0, int64_t s1, int64_t s2)
+{
+  int i;
+
+  memset(r, 0, sizeof *r);
+  r->channel.alias = (char*)"/dev/replicated";
+  r->channel.source = g_ptr_array_new();
+  r->speed[0] = s0;
+  r->speed[1] = s1;
+  r->speed[2] = s2;
+  for(i = 0; i < REPLICAS; ++i)
+    g_ptr_array_add(r->channel.source, &r->files[i]);
+}
+
+static void ReplicasDtor(struct Replicas *r)
+{
+  g_ptr_array_free(r->channel.source, TRUE);
+  g_free(r->channel.order);
+}
+
+/*
+ * read one chunk as ChannelRead() does: from the primary on until 2 valid
+ * sources agree, the rest are aged. return the replica index of the primary
+ */
+static int Round(struct Replicas *r)
+{
+  struct ChannelDesc *channel = &r->channel;
+  int read = 0;
+  int primary = -1;
+  int k;
+
+  SelectPrimary(channel);
+  for(k = 0; k < REPLICAS && read < 2; ++k)
+  {
+    struct File *f = CH_FILE(channel, channel->order[k]);
+    int i = f - r->files;
+
+    if(!IS_VALID(f)) continue;
+    if(primary < 0) primary = i;
+    UpdateStats(f, BUFFER_SIZE, LATENCY + BUFFER_SIZE * NANO_PER_SEC / r->speed[i]);
+    ++read;
+  }
+  for(; k < REPLICAS; ++k)
+    AgeStats(CH_FILE(channel, channel->order[k]));
+  return primary;
+}
+
+// count the rounds the replica "i" was the primary
+static int Primary(struct Replicas *r, int i)
+{
+  int count = 0;
+  int j;
+
+  for(j = 0; j < ROUNDS; ++j)
+    count += Round(r) == i;
+  return count;
+}
+
+// the averages start from the 1st sample and follow the new speed
+TEST(ReplicaTests, Averages)
+{
+  struct File f = {0};
+  int i;
+
+  UpdateStats(&f, BUFFER_SIZE, NANO_PER_SEC / 1000);
+  EXPECT_EQ(NANO_PER_SEC / 1000, f.latency);
+  EXPECT_EQ(BUFFER_SIZE * 1000, f.rate);
+
+  for(i = 0; i < 100; ++i)
+    UpdateStats(&f, BUFFER_SIZE, NANO_PER_SEC / 10);
+  EXPECT_TRUE(f.rate > BUFFER_SIZE * 10 * 99 / 100);
+  EXPECT_TRUE(f.rate < BUFFER_SIZE * 10 * 101 / 100);
+  EXPECT_TRUE(f.latency > NANO_PER_SEC / 10 * 99 / 100);
+}
+
+// the aging skips failed and unknown sources and does not overflow
+TEST(ReplicaTests, Aging)
+{
+  struct File unknown = {0};
+  struct File failed = {0};
+  struct File idle = {0};
+  int i;
+
+  UpdateStats(&failed, BUFFER_SIZE, LATENCY);
+  failed.flags |= FLAG_VALID_MASK;
+  UpdateStats(&idle, BUFFER_SIZE, LATENCY);
+  for(i = 0; i < 100000; ++i)
+  {
+    AgeStats(&unknown);
+    AgeStats(&failed);
+    AgeStats(&idle);
+  }
+
+  EXPECT_EQ(0, unknown.rate);
+  EXPECT_EQ(BUFFER_SIZE * NANO_PER_SEC / LATENCY, failed.rate);
+  EXPECT_EQ(RATE_LIMIT, idle.rate);
+  EXPECT_TRUE(idle.latency >= 0);
+  EXPECT_TRUE(Estimate(&idle, BUFFER_SIZE) > 0);
+}
+
+// the fastest replica becomes the primary and the choice follows the speed
+TEST(ReplicaTests, SelectPrimary)
+{
+  struct Replicas r;
+  int i;
+
+  ReplicasCtor(&r, 100 * MB, 400 * MB, 50 * MB);
+  EXPECT_TRUE(Primary(&r, 1) > ROUNDS * 9 / 10);
+
+  // the fastest replica slowed down
+  r.speed[1] = 10 * MB;
+  Primary(&r, 0);
+  EXPECT_TRUE(Primary(&r, 0) > ROUNDS * 9 / 10);
+
+  // the failed replica is never the primary
+  r.speed[2] = 1000 * MB;
+  r.files[2].flags |= FLAG_VALID_MASK;
+  EXPECT_EQ(0, Primary(&r, 2));
+
+  // the sources keep their positions
+  for(i = 0; i < REPLICAS; ++i)
+    EXPECT_EQ((gpointer)&r.files[i], r.channel.source->pdata[i]);
+
+  // all sources failed
+  r.files[0].flags |= FLAG_VALID_MASK;
+  r.files[1].flags |= FLAG_VALID_MASK;
+  EXPECT_EQ(-1, SelectPrimary(&r.channel));
+  ReplicasDtor(&r);
+}
+
+int main(int argc, char *argv[]) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
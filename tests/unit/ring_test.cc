@@ -0,0 +1,229 @@
+/*
+ * ring_test.cc
+ * functions to test: RingCtor(), RingRead(), RingWrite(), RingDtor()
+ * the writer runs in the child process
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "gtest/gtest.h"
+#include "src/channels/ring.h"
+
+#define RING_SIZE 0x100000 /* the ring data size (see ring.c) */
+#define PATTERN(i) ((char)((i) % 251))
+#define TEST_TIMEOUT 10 /* seconds for the writer to finish */
+
+// the session lost the peer (not killed by the timeout)
+static bool Lost(int status)
+{
+  return WIFEXITED(status) && WEXITSTATUS(status) == EPIPE;
+}
+
+// the session refused the peer (not killed by the signal)
+static bool Refused(int status)
+{
+  return WIFEXITED(status) && WEXITSTATUS(status) == EFAULT;
+}
+
+static struct ChannelDesc *Channel(bool ro)
+{
+  struct ChannelDesc *channel = g_new0(struct ChannelDesc, 1);
+  struct Connection *c = g_new0(struct Connection, 1);
+
+  c->protocol = ProtoIPC;
+  c->host = htonl(INADDR_LOOPBACK);
+  channel->alias = (char*)"/dev/ring";
+  channel->source = g_ptr_array_new();
+  g_ptr_array_add(channel->source, c);
+  channel->limits[ro ? GetsLimit : PutsLimit] = 1;
+  channel->limits[ro ? GetSizeLimit : PutSizeLimit] = 1;
+  return channel;
+}
+
+// start the writer of "size" bytes (in "chunk" writes) to the "reader" ring
+static pid_t Writer(struct ChannelDesc *reader, int64_t size, int32_t chunk,
+    bool close)
+{
+  struct ChannelDesc *writer;
+  pid_t pid = fork();
+  char *buf;
+  int64_t i;
+
+  if(pid != 0) return pid;
+
+  alarm(TEST_TIMEOUT);
+  writer = Channel(false);
+  CH_PORT(writer, 0) = CH_PORT(reader, 0);
+  RingCtor(writer, 0);
+  buf = (char*)g_malloc(chunk);
+  for(i = 0; i < size; i += chunk)
+  {
+    int32_t j;
+    int32_t count = MIN(chunk, size - i);
+
+    for(j = 0; j < count; ++j)
+      buf[j] = PATTERN(i + j);
+    RingWrite(writer, 0, buf, count);
+  }
+
+  // exit without EOF (as crashed session does)
+  if(!close) _exit(0);
+  RingDtor(writer, 0);
+  _exit(IS_CANCELLED(CH_FILE(writer, 0)) ? 2 : 0);
+}
+
+// read "size" bytes in "chunk" reads, return the number of wrong bytes
+static int64_t Read(struct ChannelDesc *reader, int64_t size, int32_t chunk)
+{
+  char *buf = (char*)g_malloc(chunk);
+  int64_t errors = 0;
+  int64_t i = 0;
+
+  while(i < size)
+  {
+    int32_t j;
+    int32_t count = RingRead(reader, 0, buf, MIN(chunk, size - i));
+
+    if(count <= 0) return -1;
+    for(j = 0; j < count; ++j)
+      errors += buf[j] != PATTERN(i + j);
+    i += count;
+  }
+  g_free(buf);
+  return errors;
+}
+
+static int Wait(pid_t pid)
+{
+  int status;
+
+  waitpid(pid, &status, 0);
+  return status;
+}
+
+// the stream several times larger than the ring, chunks not aligned to it
+TEST(RingTests, WraparoundAndEOF)
+{
+  struct ChannelDesc *reader = Channel(true);
+  int64_t size = 5 * RING_SIZE + 123;
+  int status;
+  pid_t pid;
+
+  RingCtor(reader, 0);
+  pid = Writer(reader, size, 0x12345, true);
+  EXPECT_EQ(0, Read(reader, size, 0x9876));
+
+  // EOF is given each time it is asked
+  EXPECT_EQ(0, RingRead(reader, 0, NULL, 1));
+  EXPECT_EQ(0, RingRead(reader, 0, NULL, 1));
+  RingDtor(reader, 0);
+
+  status = Wait(pid);
+  ASSERT_TRUE(WIFEXITED(status));
+  EXPECT_EQ(0, WEXITSTATUS(status));
+}
+
+// the reader stopped before EOF releases the writer waiting for the space
+TEST(RingTests, Cancel)
+{
+  struct ChannelDesc *reader = Channel(true);
+  int status;
+  pid_t pid;
+
+  RingCtor(reader, 0);
+  pid = Writer(reader, 64 * RING_SIZE, 0x10000, true);
+  EXPECT_EQ(0, Read(reader, RING_SIZE + 1, 0x10000));
+  RingDtor(reader, 0);
+
+  status = Wait(pid);
+  ASSERT_TRUE(WIFEXITED(status));
+  EXPECT_EQ(2, WEXITSTATUS(status));
+}
+
+// the reader w/o the writer closes at once
+TEST(RingTests, NoWriter)
+{
+  struct ChannelDesc *reader = Channel(true);
+
+  RingCtor(reader, 0);
+  RingDtor(reader, 0);
+  EXPECT_TRUE(CH_HANDLE(reader, 0) == NULL);
+}
+
+// the reader waiting for the data of the dead writer fails
+TEST(RingTests, WriterLost)
+{
+  struct ChannelDesc *reader = Channel(true);
+
+  RingCtor(reader, 0);
+  Wait(Writer(reader, 100, 100, false));
+  EXPECT_EXIT({alarm(TEST_TIMEOUT); Read(reader, 101, 101);}, Lost, "");
+}
+
+// the writer does not connect to the port of the other host
+TEST(RingTests, WriterNotLocal)
+{
+  struct ChannelDesc *reader = Channel(true);
+  struct ChannelDesc *writer = Channel(false);
+
+  RingCtor(reader, 0);
+  CH_PORT(writer, 0) = CH_PORT(reader, 0);
+  CH_HOST(writer, 0) = inet_addr("192.0.2.1");
+  EXPECT_EXIT(RingCtor(writer, 0), Refused, "");
+  RingDtor(reader, 0);
+}
+
+// the reader refuses the ring which can shrink instead of faulting on it
+TEST(RingTests, InvalidRing)
+{
+  struct ChannelDesc *reader = Channel(true);
+  char control[CMSG_SPACE(sizeof(int))] = {0};
+  struct sockaddr_un addr = {0};
+  struct msghdr msg = {0};
+  struct iovec iov;
+  struct cmsghdr *cm;
+  char dummy = 0;
+  int sock;
+  int fd;
+
+  RingCtor(reader, 0);
+
+  // pass the unsealed small memfd
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path + 1, sizeof addr.sun_path - 1,
+      "zerovm.ring.%u", (unsigned)CH_PORT(reader, 0));
+  sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+  ASSERT_EQ(0, connect(sock, (struct sockaddr*)&addr,
+      offsetof(struct sockaddr_un, sun_path) + 1 + strlen(addr.sun_path + 1)));
+  fd = memfd_create("ring", 0);
+  ASSERT_EQ(0, ftruncate(fd, 0x1000));
+
+  iov.iov_base = &dummy;
+  iov.iov_len = sizeof dummy;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof control;
+  cm = CMSG_FIRSTHDR(&msg);
+  cm->cmsg_level = SOL_SOCKET;
+  cm->cmsg_type = SCM_RIGHTS;
+  cm->cmsg_len = CMSG_LEN(sizeof fd);
+  memcpy(CMSG_DATA(cm), &fd, sizeof fd);
+  ASSERT_EQ(1, sendmsg(sock, &msg, 0));
+
+  EXPECT_EXIT({alarm(TEST_TIMEOUT); Read(reader, 1, 1);}, Refused, "");
+  close(sock);
+  close(fd);
+}
+
+int main(int argc, char *argv[]) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
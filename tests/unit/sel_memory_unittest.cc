@@ -5,12 +5,17 @@
  */
 
 // Testing NativeClient cross-platfom memory management functions
+#include <fcntl.h>
 #include <sys/mman.h>
 #include "src/main/zlog.h"
 #include "src/platform/sel_memory.h"
 
 #include "gtest/gtest.h"
 
+#ifndef MADV_PAGEOUT
+#define MADV_PAGEOUT 21
+#endif
+
 class SelMemoryBasic : public testing::Test {
  protected:
   virtual void SetUp();
@@ -80,3 +85,36 @@ TEST_F(SelMemoryBasic, mprotect) {
 
   NaCl_page_free(p, size);
 }
+
+// the touched page stays populated when it is paged out (swapped)
+TEST_F(SelMemoryBasic, untouched) {
+  int pagemap = open("/proc/self/pagemap", O_RDONLY);
+  int size = 0x20000;
+  void *p = NULL;
+  char *addr;
+  int res;
+
+  ASSERT_LE(0, pagemap);
+  res = NaCl_page_alloc_intern_flags(&p, size, 0);
+  EXPECT_EQ(0, res);
+  res = NaCl_mprotect(p, size, PROT_READ | PROT_WRITE);
+  EXPECT_EQ(0, res);
+  addr = reinterpret_cast<char*>(p);
+  EXPECT_EQ(1, NaCl_page_untouched(pagemap, addr, size));
+
+  addr[size - 1] = '5';
+  EXPECT_EQ(1, NaCl_page_untouched(pagemap, addr, size / 2));
+  EXPECT_EQ(0, NaCl_page_untouched(pagemap, addr + size / 2, size / 2));
+
+  // w/o swap the page stays resident, with swap it is swapped out
+  madvise(addr + size / 2, size / 2, MADV_PAGEOUT);
+  EXPECT_EQ(0, NaCl_page_untouched(pagemap, addr + size / 2, size / 2));
+  EXPECT_EQ('5', addr[size - 1]);
+
+  res = NaCl_madvise(addr, size, MADV_DONTNEED);
+  EXPECT_EQ(0, res);
+  EXPECT_EQ(1, NaCl_page_untouched(pagemap, addr, size));
+
+  NaCl_page_free(p, size);
+  close(pagemap);
+}